@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Ahead-of-time translator.                                                                              */
+/*                                                                                                                     */
+/* Turns the loaded program image into a C file with one label per */
+/* basic block and a switch on the PC for computed targets (JR,     */
+/* JALR). The output links against libmu-mips.a for guest memory,  */
+/* the interpreter and rdump, and its main() runs the program to    */
+/* completion (or -n instructions) and prints the same register    */
+/* dump as the simulator. Code it cannot place statically (PCs      */
+/* outside the image, the middle of a block, text rewritten by a    */
+/* store) runs in the interpreter.                                                     */
+/***************************************************************/
+
+#define AOT_IS_LEADER 0x1
+
+static int ends_block(uint8_t op)
+{
+	switch (op) {
+		case OP_BEQ: case OP_BNE: case OP_BLEZ: case OP_BGTZ: case OP_BLTZ: case OP_BGEZ:
+		case OP_J: case OP_JAL: case OP_JR: case OP_JALR: case OP_SYSCALL:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/* direct transfer to pc: a label when pc starts a translated block */
+static void emit_goto(FILE *out, const uint8_t *flags, uint32_t words, uint32_t pc)
+{
+	uint32_t index = (pc - MEM_TEXT_BEGIN) >> 2;
+	if ((pc & 0x3) == 0 && pc >= MEM_TEXT_BEGIN && index < words && (flags[index] & AOT_IS_LEADER)) {
+		fprintf(out, "goto B_%08x;", pc);
+	}
+	else {
+		fprintf(out, "{ cpu->PC = 0x%08xu; goto dispatch; }", pc);
+	}
+}
+
+/***************************************************************/
+/* C statement(s) for one instruction at pc; k is its position in a  */
+/* block of n instructions (for exact counts on early exits)          */
+/***************************************************************/
+static void emit_insn(FILE *out, const decoded_inst_t *d, uint32_t pc, uint32_t k, uint32_t n,
+	const uint8_t *flags, uint32_t words)
+{
+	fprintf(out, "\t/* 0x%08x: %08x */ ", pc, d->word);
+	switch (d->op) {
+		case OP_NOP:
+			fprintf(out, ";\n");
+			break;
+		case OP_SLL:
+			fprintf(out, "R(%u) = R(%u) << %u;\n", d->rd, d->rt, d->sa);
+			break;
+		case OP_SRL:
+		case OP_SRA: /* logical, matching the interpreter */
+			fprintf(out, "R(%u) = R(%u) >> %u;\n", d->rd, d->rt, d->sa);
+			break;
+		case OP_ADD:
+		case OP_ADDU:
+			fprintf(out, "R(%u) = R(%u) + R(%u);\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_SUB:
+		case OP_SUBU:
+			fprintf(out, "R(%u) = R(%u) - R(%u);\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_AND:
+			fprintf(out, "R(%u) = R(%u) & R(%u);\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_OR:
+			fprintf(out, "R(%u) = R(%u) | R(%u);\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_XOR:
+			fprintf(out, "R(%u) = R(%u) ^ R(%u);\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_NOR:
+			fprintf(out, "R(%u) = ~(R(%u) | R(%u));\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_SLT: /* unsigned, matching the interpreter */
+			fprintf(out, "R(%u) = R(%u) < R(%u);\n", d->rd, d->rs, d->rt);
+			break;
+		case OP_MFHI:
+			fprintf(out, "R(%u) = cpu->HI;\n", d->rd);
+			break;
+		case OP_MFLO:
+			fprintf(out, "R(%u) = cpu->LO;\n", d->rd);
+			break;
+		case OP_MTHI:
+			fprintf(out, "cpu->HI = R(%u);\n", d->rs);
+			break;
+		case OP_MTLO:
+			fprintf(out, "cpu->LO = R(%u);\n", d->rs);
+			break;
+		case OP_MULT:
+			fprintf(out, "{ uint64_t p = (uint64_t)((int64_t)(int32_t)R(%u) * (int32_t)R(%u)); "
+				"cpu->LO = (uint32_t)p; cpu->HI = (uint32_t)(p >> 32); }\n", d->rs, d->rt);
+			break;
+		case OP_MULTU:
+			fprintf(out, "{ uint64_t p = (uint64_t)R(%u) * R(%u); "
+				"cpu->LO = (uint32_t)p; cpu->HI = (uint32_t)(p >> 32); }\n", d->rs, d->rt);
+			break;
+		case OP_DIV:
+			fprintf(out, "{ int32_t a = R(%u), b = R(%u); if (b != 0) { cpu->LO = a / b; cpu->HI = a %% b; } }\n", d->rs, d->rt);
+			break;
+		case OP_DIVU:
+			fprintf(out, "{ uint32_t a = R(%u), b = R(%u); if (b != 0) { cpu->LO = a / b; cpu->HI = a %% b; } }\n", d->rs, d->rt);
+			break;
+		case OP_ADDI:
+		case OP_ADDIU:
+			fprintf(out, "R(%u) = R(%u) + 0x%08xu;\n", d->rt, d->rs, d->imm);
+			break;
+		case OP_SLTI: /* sign of rs - imm, matching the interpreter */
+			fprintf(out, "R(%u) = (int32_t)(R(%u) - 0x%08xu) < 0;\n", d->rt, d->rs, d->imm);
+			break;
+		case OP_ANDI:
+			fprintf(out, "R(%u) = R(%u) & 0x%08xu;\n", d->rt, d->rs, d->imm);
+			break;
+		case OP_ORI:
+			fprintf(out, "R(%u) = R(%u) | 0x%08xu;\n", d->rt, d->rs, d->imm);
+			break;
+		case OP_XORI:
+			fprintf(out, "R(%u) = R(%u) ^ 0x%08xu;\n", d->rt, d->rs, d->imm);
+			break;
+		case OP_LUI:
+			fprintf(out, "R(%u) = 0x%08xu;\n", d->rt, d->imm);
+			break;
+		case OP_LB:
+			fprintf(out, "{ uint32_t v = mem_read_32(m, R(%u) + 0x%08xu); R(%u) = (v & 0x80) ? (v | 0xFFFFFF00u) : (v & 0xFFu); }\n",
+				d->rs, d->imm, d->rt);
+			break;
+		case OP_LH:
+			fprintf(out, "{ uint32_t v = mem_read_32(m, R(%u) + 0x%08xu); R(%u) = (v & 0x8000) ? (v | 0xFFFF0000u) : (v & 0xFFFFu); }\n",
+				d->rs, d->imm, d->rt);
+			break;
+		case OP_LW:
+			fprintf(out, "R(%u) = mem_read_32(m, R(%u) + 0x%08xu);\n", d->rt, d->rs, d->imm);
+			break;
+		case OP_SB:
+		case OP_SH:
+		case OP_SW:
+			fprintf(out, "{ uint32_t a = R(%u) + 0x%08xu; ", d->rs, d->imm);
+			if (d->op == OP_SB) {
+				fprintf(out, "mem_write_32(m, a, (mem_read_32(m, a) & 0xFFFFFF00u) | (R(%u) & 0xFFu)); ", d->rt);
+			}
+			else if (d->op == OP_SH) {
+				fprintf(out, "mem_write_32(m, a, (mem_read_32(m, a) & 0xFFFF0000u) | (R(%u) & 0xFFFFu)); ", d->rt);
+			}
+			else {
+				fprintf(out, "mem_write_32(m, a, R(%u)); ", d->rt);
+			}
+			fprintf(out, "if (CODE_WRITE(a)) { m->instruction_count -= %u; cpu->PC = 0x%08xu; goto interpret; } }\n",
+				n - k - 1, pc + 4);
+			break;
+		case OP_SYSCALL:
+			fprintf(out, "if (R(2) == 0xa) { m->run_flag = FALSE; m->instruction_count -= %u; cpu->PC = 0x%08xu; goto done; }\n",
+				n - k - 1, pc + 4);
+			fprintf(out, "\t");
+			emit_goto(out, flags, words, pc + 4);
+			fprintf(out, "\n");
+			break;
+		case OP_J:
+			emit_goto(out, flags, words, d->target);
+			fprintf(out, "\n");
+			break;
+		case OP_JAL:
+			fprintf(out, "R(31) = 0x%08xu; ", pc + 4);
+			emit_goto(out, flags, words, d->target);
+			fprintf(out, "\n");
+			break;
+		case OP_JR:
+			fprintf(out, "cpu->PC = R(%u); goto dispatch;\n", d->rs);
+			break;
+		case OP_JALR:
+			fprintf(out, "cpu->PC = R(%u); R(%u) = 0x%08xu; goto dispatch;\n", d->rs, d->rd, pc + 4);
+			break;
+		case OP_BEQ:
+		case OP_BNE:
+		case OP_BLTZ:
+		case OP_BGEZ:
+		case OP_BLEZ:
+		case OP_BGTZ:
+			switch (d->op) {
+				case OP_BEQ: fprintf(out, "if (R(%u) == R(%u)) ", d->rs, d->rt); break;
+				case OP_BNE: fprintf(out, "if (R(%u) != R(%u)) ", d->rs, d->rt); break;
+				case OP_BLTZ: fprintf(out, "if ((int32_t)R(%u) < 0) ", d->rs); break;
+				case OP_BGEZ: fprintf(out, "if ((int32_t)R(%u) >= 0) ", d->rs); break;
+				case OP_BLEZ: fprintf(out, "if ((int32_t)R(%u) <= 0) ", d->rs); break;
+				default: fprintf(out, "/* BGTZ: taken for every value, as in the interpreter */ "); break;
+			}
+			emit_goto(out, flags, words, d->target);
+			fprintf(out, "\n\t");
+			emit_goto(out, flags, words, pc + 4);
+			fprintf(out, "\n");
+			break;
+		default:
+			fprintf(out, "printf(\"Instruction at 0x%%x is not implemented!\\n\", 0x%08xu);\n", pc);
+			break;
+	}
+}
+
+/***************************************************************/
+/* Emit the loaded program as C. Returns 0 on success.                   */
+/***************************************************************/
+int aot_translate(mips_machine *m, const char *path)
+{
+	FILE *out;
+	decoded_inst_t *insns;
+	uint8_t *flags;
+	uint32_t words = m->program_size, i, j, k, n, pc, target;
+
+	if (words == 0) {
+		printf("Error: No program loaded to translate\n");
+		return -1;
+	}
+	/* the translated image is text only, entered at MEM_TEXT_BEGIN with blank registers */
+	if (m->image == IMAGE_ELF) {
+		printf("Error: Only .in programs can be translated, not ELF executables\n");
+		return -1;
+	}
+	if (m->image == IMAGE_CHECKPOINT) {
+		printf("Error: Only .in programs can be translated, not restored checkpoints\n");
+		return -1;
+	}
+	out = fopen(path, "w");
+	if (out == NULL) {
+		printf("Error: Can't open %s for writing\n", path);
+		return -1;
+	}
+	insns = calloc(words, sizeof(decoded_inst_t));
+	flags = calloc(words, 1);
+	if (insns == NULL || flags == NULL) {
+		printf("Error: Out of memory translating program\n");
+		exit(-1);
+	}
+
+	/* leaders: entry, static targets in the image, and every instruction after a block end */
+	flags[0] |= AOT_IS_LEADER;
+	for (i = 0; i < words; i++) {
+		pc = MEM_TEXT_BEGIN + 4 * i;
+		decode_instruction(mem_read_32(m, pc), pc, &insns[i]);
+		if (!ends_block(insns[i].op)) {
+			continue;
+		}
+		if (i + 1 < words) {
+			flags[i + 1] |= AOT_IS_LEADER;
+		}
+		if (insns[i].op != OP_JR && insns[i].op != OP_JALR && insns[i].op != OP_SYSCALL) {
+			target = insns[i].target;
+			if ((target & 0x3) == 0 && target >= MEM_TEXT_BEGIN && ((target - MEM_TEXT_BEGIN) >> 2) < words) {
+				flags[(target - MEM_TEXT_BEGIN) >> 2] |= AOT_IS_LEADER;
+			}
+		}
+	}
+
+	fprintf(out, "/* Generated by mu-mips --aot from %s (%u words). Do not edit. */\n", m->prog_file, words);
+	fprintf(out, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n#include <stdint.h>\n\n");
+	fprintf(out, "#include \"mu-mips.h\"\n\n");
+	fprintf(out, "#define R(n) cpu->REGS[n]\n");
+	fprintf(out, "#define IMAGE_WORDS %uu\n", words);
+	fprintf(out, "/* store overlapping the translated image */\n");
+	fprintf(out, "#define CODE_WRITE(a) ((uint32_t)((a) - (MEM_TEXT_BEGIN - 3)) < IMAGE_WORDS * 4 + 3)\n\n");
+
+	fprintf(out, "static const uint32_t IMAGE[IMAGE_WORDS] = {");
+	for (i = 0; i < words; i++) {
+		fprintf(out, "%s0x%08xu,", i % 8 == 0 ? "\n\t" : " ", insns[i].word);
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "/* run translated code until SYSCALL exit or limit instructions */\n");
+	fprintf(out, "static void aot_run(mips_machine *m, uint32_t limit)\n{\n");
+	fprintf(out, "\tCPU_State *cpu = &m->cpu;\n\n");
+	fprintf(out, "dispatch:\n");
+	fprintf(out, "\tif (!m->run_flag) {\n\t\tgoto done;\n\t}\n");
+	fprintf(out, "\tswitch (cpu->PC) {\n");
+	for (i = 0; i < words; i++) {
+		if (flags[i] & AOT_IS_LEADER) {
+			fprintf(out, "\t\tcase 0x%08xu: goto B_%08x;\n", MEM_TEXT_BEGIN + 4 * i, MEM_TEXT_BEGIN + 4 * i);
+		}
+	}
+	fprintf(out, "\t\tdefault:\n");
+	fprintf(out, "\t\t\t/* not a translated block entry: interpret one instruction */\n");
+	fprintf(out, "\t\t\tif (m->instruction_count >= limit) {\n\t\t\t\tgoto done;\n\t\t\t}\n");
+	fprintf(out, "\t\t\tcycle(m);\n\t\t\tgoto dispatch;\n\t}\n\n");
+
+	for (i = 0; i < words; i = j) {
+		/* block: leader i up to the next block end or leader */
+		for (j = i + 1; j < words && !ends_block(insns[j - 1].op) && !(flags[j] & AOT_IS_LEADER); j++) {
+		}
+		n = j - i;
+		pc = MEM_TEXT_BEGIN + 4 * i;
+		fprintf(out, "B_%08x:\n", pc);
+		fprintf(out, "\tif (limit - m->instruction_count < %u) {\n\t\tcpu->PC = 0x%08xu;\n\t\tgoto interpret;\n\t}\n", n, pc);
+		fprintf(out, "\tm->instruction_count += %u;\n", n);
+		for (k = 0; k < n; k++) {
+			emit_insn(out, &insns[i + k], pc + 4 * k, k, n, flags, words);
+		}
+		if (!ends_block(insns[j - 1].op)) {
+			fprintf(out, "\t");
+			emit_goto(out, flags, words, pc + 4 * n);
+			fprintf(out, "\n");
+		}
+		fprintf(out, "\n");
+	}
+
+	fprintf(out, "interpret:\n");
+	fprintf(out, "\t/* budget ends inside a block, or the image was rewritten */\n");
+	fprintf(out, "\twhile (m->run_flag && m->instruction_count < limit) {\n\t\tcycle(m);\n\t}\n");
+	fprintf(out, "done:\n\treturn;\n}\n\n");
+
+	fprintf(out, "/* a whole number in strtoul syntax; -1 if empty or followed by junk */\n");
+	fprintf(out, "static int parse_value(const char *s, uint32_t *value)\n{\n");
+	fprintf(out, "\tchar *end;\n\n");
+	fprintf(out, "\t*value = strtoul(s, &end, 0);\n");
+	fprintf(out, "\treturn (end == s || *end != '\\0') ? -1 : 0;\n}\n\n");
+
+	fprintf(out, "int main(int argc, char *argv[])\n{\n");
+	fprintf(out, "\tmips_machine *m = machine_create();\n");
+	fprintf(out, "\tuint32_t i, limit = UINT32_MAX;\n");
+	fprintf(out, "\tunsigned long number;\n");
+	fprintf(out, "\tchar *end;\n");
+	fprintf(out, "\tint a, bad;\n\n");
+	fprintf(out, "\tfor (i = 0; i < IMAGE_WORDS; i++) {\n\t\tmem_write_32(m, MEM_TEXT_BEGIN + 4 * i, IMAGE[i]);\n\t}\n");
+	fprintf(out, "\tm->program_size = IMAGE_WORDS;\n\n");
+	fprintf(out, "\t/* -n <max instructions>, r<N>=<val>, hi=<val>, lo=<val> */\n");
+	fprintf(out, "\tfor (a = 1; a < argc; a++) {\n");
+	fprintf(out, "\t\tif (strcmp(argv[a], \"-n\") == 0 && a + 1 < argc) {\n");
+	fprintf(out, "\t\t\tbad = parse_value(argv[++a], &limit);\n\t\t}\n");
+	fprintf(out, "\t\telse if (argv[a][0] == 'r' && argv[a][1] >= '0' && argv[a][1] <= '9'\n");
+	fprintf(out, "\t\t\t\t&& (number = strtoul(argv[a] + 1, &end, 10), *end == '=')) {\n");
+	fprintf(out, "\t\t\tbad = number == 0 || number >= MIPS_REGS || parse_value(end + 1, &m->cpu.REGS[number]) != 0;\n\t\t}\n");
+	fprintf(out, "\t\telse if (strncmp(argv[a], \"hi=\", 3) == 0) {\n");
+	fprintf(out, "\t\t\tbad = parse_value(argv[a] + 3, &m->cpu.HI);\n\t\t}\n");
+	fprintf(out, "\t\telse if (strncmp(argv[a], \"lo=\", 3) == 0) {\n");
+	fprintf(out, "\t\t\tbad = parse_value(argv[a] + 3, &m->cpu.LO);\n\t\t}\n");
+	fprintf(out, "\t\telse {\n\t\t\tbad = 1;\n\t\t}\n");
+	fprintf(out, "\t\tif (bad) {\n");
+	fprintf(out, "\t\t\tprintf(\"Usage: %%s [-n <max instructions>] [r<N>=<val>]... [hi=<val>] [lo=<val>]\\n\", argv[0]);\n");
+	fprintf(out, "\t\t\tmachine_destroy(m);\n");
+	fprintf(out, "\t\t\treturn 1;\n\t\t}\n\t}\n\n");
+	fprintf(out, "\taot_run(m, limit);\n");
+	fprintf(out, "\trdump(m);\n");
+	fprintf(out, "\tmachine_destroy(m);\n");
+	fprintf(out, "\treturn 0;\n}\n");
+
+	fclose(out);
+	free(insns);
+	free(flags);
+	printf("Translated %u words into %s\n", words, path);
+	return 0;
+}
@@ -0,0 +1,664 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Batch runner.                                                                                                       */
+/*                                                                                                                     */
+/* Runs every job of a manifest to completion on a pool of worker   */
+/* threads. Each worker owns one machine, reused from job to job,   */
+/* and a work-stealing deque: jobs are dealt round-robin up front,   */
+/* a worker pops from the bottom of its own deque and, once that is */
+/* empty, steals from the top of the others'. Results go to one     */
+/* file per job plus a summary, so workers share nothing but the     */
+/* deques.                                                                                                             */
+/*                                                                                                                     */
+/* With lockstep on, jobs of the same program are dealt in tasks of  */
+/* up to the lockstep width, and a task runs as one lockstep group    */
+/* (see mu-mips-lockstep.c) on a pool of machines owned by the worker. */
+/* Results are identical to running the jobs one at a time.                */
+/*                                                                                                                     */
+/* Manifest: one job per line, '#' starts a comment.                          */
+/*   <program.in> [rN=<val>]... [hi=<val>] [lo=<val>]                         */
+/*                [max=<instructions>] [mdump=<start>:<stop>]              */
+/*                [restore=<checkpoint>]                                                          */
+/* A job with restore= starts from the checkpoint (see save) instead  */
+/* of loading the program; max= and the reported instructions then  */
+/* count from the checkpoint's instruction count.                          */
+/***************************************************************/
+
+#define BATCH_DEFAULT_MAX 100000000u  /* instruction limit for jobs without max= */
+#define BATCH_LINE_MAX (PROG_FILE_MAX + 1024)
+#define BATCH_MAX_THREADS 256
+
+enum { JOB_PENDING, JOB_HALTED, JOB_LIMIT, JOB_LOAD_ERROR, JOB_OUTPUT_ERROR };
+
+static const char *const JOB_STATUS[] = { "pending", "halted", "limit", "load-error", "output-error" };
+
+typedef struct {
+	char *prog;
+	char *restore;                /* checkpoint to start from, or NULL */
+	uint32_t set_mask;            /* registers given on the manifest line */
+	uint32_t regs[MIPS_REGS];
+	int set_hi, set_lo;
+	uint32_t hi, lo;
+	uint32_t max;
+	int has_mdump;
+	uint32_t mdump_start, mdump_stop;
+
+	/* filled in by the worker that runs the job */
+	uint32_t base;                /* instruction count the job started at */
+	uint32_t limit;               /* base + max, saturated */
+	int status;
+	uint32_t instructions;
+	uint64_t ns;
+} batch_job_t;
+
+/* Chase-Lev deque. Jobs are all pushed before the workers start and */
+/* never added later, so the buffer never wraps or grows.                  */
+typedef struct {
+	_Atomic int64_t top;
+	_Atomic int64_t bottom;
+	int64_t *slots;
+} job_deque_t;
+
+/* a unit of work in the deques: order[first .. first + count) */
+typedef struct {
+	uint32_t first, count;
+} batch_task_t;
+
+typedef struct batch batch_t;
+
+typedef struct {
+	batch_t *batch;
+	int id;
+	job_deque_t deque;
+	uint32_t steals;
+	uint32_t jobs_run;
+} batch_worker_t;
+
+struct batch {
+	batch_job_t *jobs;
+	uint32_t num_jobs;
+	uint32_t *order;              /* job indices, grouped by program in lockstep */
+	batch_task_t *tasks;
+	uint32_t num_tasks;
+	const char *out_dir;
+	int engine;
+	int lockstep;                 /* lanes per lockstep group, 0 when off */
+	batch_worker_t *workers;
+	int num_workers;
+	_Atomic uint32_t remaining;
+};
+
+/***************************************************************/
+/* Owner only: add a job to the bottom                                                            */
+/***************************************************************/
+static void deque_push(job_deque_t *q, int64_t job)
+{
+	int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	q->slots[b] = job;
+	atomic_store_explicit(&q->bottom, b + 1, memory_order_release);
+}
+
+/***************************************************************/
+/* Owner only: take the newest job, or -1 when empty                        */
+/***************************************************************/
+static int64_t deque_pop(job_deque_t *q)
+{
+	int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+	int64_t t, job;
+
+	atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&q->top, memory_order_relaxed);
+	if (t > b) {
+		atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+		return -1;
+	}
+	job = q->slots[b];
+	if (t == b) {
+		/* last job: race the thieves for it */
+		if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+				memory_order_seq_cst, memory_order_relaxed)) {
+			job = -1;
+		}
+		atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+	}
+	return job;
+}
+
+/***************************************************************/
+/* Any thread: take the oldest job, or -1 when empty or lost a race */
+/***************************************************************/
+static int64_t deque_steal(job_deque_t *q)
+{
+	int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+	int64_t b, job;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+	if (t >= b) {
+		return -1;
+	}
+	job = q->slots[t];
+	if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+			memory_order_seq_cst, memory_order_relaxed)) {
+		return -1;
+	}
+	return job;
+}
+
+static void job_free(batch_job_t *job)
+{
+	free(job->prog);
+	free(job->restore);
+}
+
+/***************************************************************/
+/* Parse one manifest line into job; returns 1 for a job, 0 for a   */
+/* blank or comment line and -1 on a syntax error                            */
+/***************************************************************/
+static int parse_job_tokens(char *line, batch_job_t *job)
+{
+	char *save, *tok, *end;
+	unsigned long number;
+	uint32_t reg;
+
+	if ((end = strchr(line, '#')) != NULL) {
+		*end = '\0';
+	}
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (tok == NULL) {
+		return 0;
+	}
+	memset(job, 0, sizeof(*job));
+	if (strlen(tok) >= PROG_FILE_MAX || (job->prog = strdup(tok)) == NULL) {
+		return -1;
+	}
+	job->max = BATCH_DEFAULT_MAX;
+
+	while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+		if (tok[0] == 'r' && tok[1] >= '0' && tok[1] <= '9'
+				&& (number = strtoul(tok + 1, &end, 10), *end == '=')) {
+			reg = number;
+			if (number == 0 || number >= MIPS_REGS) {
+				return -1;
+			}
+			job->regs[reg] = strtoul(end + 1, &end, 0);
+			job->set_mask |= 1u << reg;
+		}
+		else if (strncmp(tok, "hi=", 3) == 0) {
+			job->hi = strtoul(tok + 3, &end, 0);
+			job->set_hi = TRUE;
+		}
+		else if (strncmp(tok, "lo=", 3) == 0) {
+			job->lo = strtoul(tok + 3, &end, 0);
+			job->set_lo = TRUE;
+		}
+		else if (strncmp(tok, "max=", 4) == 0) {
+			job->max = strtoul(tok + 4, &end, 0);
+		}
+		else if (strncmp(tok, "restore=", 8) == 0) {
+			free(job->restore);
+			if ((job->restore = strdup(tok + 8)) == NULL) {
+				return -1;
+			}
+			continue;
+		}
+		else if (strncmp(tok, "mdump=", 6) == 0) {
+			if (sscanf(tok + 6, "%x:%x", &job->mdump_start, &job->mdump_stop) != 2) {
+				return -1;
+			}
+			job->has_mdump = TRUE;
+			continue;
+		}
+		else {
+			return -1;
+		}
+		if (*end != '\0') {
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/* parse_job_tokens, releasing the job's strings when the line is bad */
+static int parse_job(char *line, batch_job_t *job)
+{
+	int r = parse_job_tokens(line, job);
+
+	if (r < 0) {
+		job_free(job);
+	}
+	return r;
+}
+
+/***************************************************************/
+/* Read every job of the manifest; returns the count or -1                 */
+/***************************************************************/
+static int64_t read_manifest(const char *path, batch_job_t **jobs_out)
+{
+	FILE *fp;
+	char line[BATCH_LINE_MAX];
+	batch_job_t *jobs = NULL, *grown;
+	uint32_t count = 0, capacity = 0, line_no = 0;
+	int r;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open manifest %s\n", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line_no++;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			grown = realloc(jobs, capacity * sizeof(batch_job_t));
+			if (grown == NULL) {
+				printf("Error: Out of memory reading manifest\n");
+				exit(-1);
+			}
+			jobs = grown;
+		}
+		r = parse_job(line, &jobs[count]);
+		if (r < 0) {
+			printf("Error: %s:%u: bad job line\n", path, line_no);
+			fclose(fp);
+			while (count > 0) {
+				job_free(&jobs[--count]);
+			}
+			free(jobs);
+			return -1;
+		}
+		count += r;
+	}
+	fclose(fp);
+	*jobs_out = jobs;
+	return count;
+}
+
+static uint64_t batch_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/***************************************************************/
+/* Load job's program into m and apply its overrides; returns 0, or */
+/* -1 (status load-error) when the program can't be loaded             */
+/***************************************************************/
+static int job_start(batch_job_t *job, mips_machine *m)
+{
+	int i;
+
+	if (job->restore != NULL) {
+		if (checkpoint_restore(m, job->restore) != 0) {
+			job->status = JOB_LOAD_ERROR;
+			return -1;
+		}
+	}
+	else {
+		set_prog_file(m, job->prog);
+		if (reset(m) != 0) {
+			job->status = JOB_LOAD_ERROR;
+			return -1;
+		}
+	}
+	for (i = 1; i < MIPS_REGS; i++) {
+		if (job->set_mask & (1u << i)) {
+			m->cpu.REGS[i] = job->regs[i];
+		}
+	}
+	if (job->set_hi) {
+		m->cpu.HI = job->hi;
+	}
+	if (job->set_lo) {
+		m->cpu.LO = job->lo;
+	}
+	job->base = m->instruction_count;
+	job->limit = job->max > UINT32_MAX - job->base ? UINT32_MAX : job->base + job->max;
+	return 0;
+}
+
+/***************************************************************/
+/* Record the outcome of job index from m and write                          */
+/* <out_dir>/job-<index>.out                                                                    */
+/***************************************************************/
+static void job_finish(batch_t *batch, mips_machine *m, uint32_t index)
+{
+	batch_job_t *job = &batch->jobs[index];
+	char path[PROG_FILE_MAX + 32];
+	FILE *out;
+
+	if (job->status != JOB_LOAD_ERROR) {
+		job->status = m->run_flag ? JOB_LIMIT : JOB_HALTED;
+		job->instructions = m->instruction_count - job->base;
+	}
+
+	snprintf(path, sizeof(path), "%s/job-%06u.out", batch->out_dir, index);
+	out = fopen(path, "w");
+	if (out == NULL) {
+		job->status = JOB_OUTPUT_ERROR;
+		return;
+	}
+	fprintf(out, "Job\t: %u\n", index);
+	fprintf(out, "Program\t: %s\n", job->prog);
+	fprintf(out, "Status\t: %s\n", JOB_STATUS[job->status]);
+	if (job->status != JOB_LOAD_ERROR) {
+		rdump_to(m, out);
+		if (job->has_mdump) {
+			mdump_to(m, out, job->mdump_start, job->mdump_stop);
+		}
+	}
+	fclose(out);
+}
+
+/***************************************************************/
+/* Run job index on m                                                                                       */
+/***************************************************************/
+static void run_job(batch_t *batch, mips_machine *m, uint32_t index)
+{
+	batch_job_t *job = &batch->jobs[index];
+	uint64_t start = batch_now_ns();
+
+	if (job_start(job, m) == 0) {
+		while (m->run_flag && m->instruction_count < job->limit) {
+			run_cycles(m, job->limit - m->instruction_count);
+		}
+	}
+	job->ns = batch_now_ns() - start;
+	job_finish(batch, m, index);
+}
+
+/***************************************************************/
+/* Run a task's jobs as one lockstep group on pool (allocated on     */
+/* first use); each job is charged an equal share of the group time  */
+/***************************************************************/
+static void run_lockstep_task(batch_t *batch, mips_machine **pool, const batch_task_t *task)
+{
+	mips_machine *lanes[LOCKSTEP_MAX_LANES];
+	uint32_t max[LOCKSTEP_MAX_LANES];
+	uint64_t start = batch_now_ns(), ns;
+	uint32_t i, n = 0, index;
+
+	for (i = 0; i < task->count; i++) {
+		index = batch->order[task->first + i];
+		if (pool[i] == NULL) {
+			pool[i] = machine_create();
+			pool[i]->quiet = TRUE;
+			pool[i]->engine = batch->engine;
+		}
+		if (job_start(&batch->jobs[index], pool[i]) == 0) {
+			lanes[n] = pool[i];
+			max[n++] = batch->jobs[index].limit;
+		}
+	}
+	lockstep_run(lanes, max, n);
+	ns = (batch_now_ns() - start) / task->count;
+	for (i = 0; i < task->count; i++) {
+		index = batch->order[task->first + i];
+		batch->jobs[index].ns = ns;
+		job_finish(batch, pool[i], index);
+	}
+}
+
+/***************************************************************/
+/* Worker: drain the own deque, then steal until no job is left        */
+/***************************************************************/
+static void *batch_worker(void *arg)
+{
+	batch_worker_t *self = arg;
+	batch_t *batch = self->batch;
+	mips_machine *m = machine_create();
+	mips_machine *pool[LOCKSTEP_MAX_LANES] = { NULL };
+	uint32_t seed = self->id * 2654435761u + 1;
+	const batch_task_t *task;
+	int64_t job;
+	int victim, i;
+
+	m->quiet = TRUE;
+	m->engine = batch->engine;
+	while (atomic_load_explicit(&batch->remaining, memory_order_acquire) > 0) {
+		job = deque_pop(&self->deque);
+		if (job < 0) {
+			/* xorshift victim choice keeps thieves from piling onto one deque */
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			victim = seed % batch->num_workers;
+			if (victim == self->id || (job = deque_steal(&batch->workers[victim].deque)) < 0) {
+				sched_yield();
+				continue;
+			}
+			self->steals++;
+		}
+		task = &batch->tasks[job];
+		if (batch->lockstep) {
+			run_lockstep_task(batch, pool, task);
+		}
+		else {
+			run_job(batch, m, batch->order[task->first]);
+		}
+		self->jobs_run += task->count;
+		atomic_fetch_sub_explicit(&batch->remaining, 1, memory_order_release);
+	}
+	for (i = 0; i < LOCKSTEP_MAX_LANES; i++) {
+		if (pool[i] != NULL) {
+			machine_destroy(pool[i]);
+		}
+	}
+	machine_destroy(m);
+	return NULL;
+}
+
+typedef struct {
+	const char *prog;
+	const char *restore;
+	uint32_t index;
+} job_key_t;
+
+/* jobs that start from the same image may share a lockstep group */
+static int compare_job_starts(const job_key_t *x, const job_key_t *y)
+{
+	int c = strcmp(x->prog, y->prog);
+	if (c != 0 || x->restore == y->restore) {
+		return c;
+	}
+	if (x->restore == NULL || y->restore == NULL) {
+		return x->restore == NULL ? -1 : 1;
+	}
+	return strcmp(x->restore, y->restore);
+}
+
+static int compare_job_keys(const void *a, const void *b)
+{
+	const job_key_t *x = a, *y = b;
+	int c = compare_job_starts(x, y);
+	if (c != 0) {
+		return c;
+	}
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/***************************************************************/
+/* Fill order and tasks: one job per task, or with lockstep on, runs */
+/* of the same program (and checkpoint) cut into tasks of up to width */
+/* jobs                                                                                                                */
+/***************************************************************/
+static void plan_tasks(batch_t *batch, int width)
+{
+	job_key_t *keys = NULL;
+	uint32_t i, n = batch->num_jobs;
+
+	batch->order = malloc((n + 1) * sizeof(uint32_t));
+	batch->tasks = malloc((n + 1) * sizeof(batch_task_t));
+	if (width > 0) {
+		keys = malloc((n + 1) * sizeof(job_key_t));
+	}
+	if (batch->order == NULL || batch->tasks == NULL || (width > 0 && keys == NULL)) {
+		printf("Error: Out of memory starting batch\n");
+		exit(-1);
+	}
+	batch->num_tasks = 0;
+	if (width <= 0) {
+		for (i = 0; i < n; i++) {
+			batch->order[i] = i;
+			batch->tasks[i].first = i;
+			batch->tasks[i].count = 1;
+		}
+		batch->num_tasks = n;
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		keys[i].prog = batch->jobs[i].prog;
+		keys[i].restore = batch->jobs[i].restore;
+		keys[i].index = i;
+	}
+	qsort(keys, n, sizeof(job_key_t), compare_job_keys);
+	for (i = 0; i < n; i++) {
+		batch->order[i] = keys[i].index;
+		if (i == 0 || batch->tasks[batch->num_tasks - 1].count == (uint32_t)width
+				|| compare_job_starts(&keys[i], &keys[i - 1]) != 0) {
+			batch->tasks[batch->num_tasks].first = i;
+			batch->tasks[batch->num_tasks].count = 0;
+			batch->num_tasks++;
+		}
+		batch->tasks[batch->num_tasks - 1].count++;
+	}
+	free(keys);
+}
+
+/***************************************************************/
+/* Run every job in manifest on threads workers (0: one per online */
+/* CPU), writing results under out_dir. lockstep > 0 runs jobs of    */
+/* the same program in lockstep groups of that many lanes. Returns 0 */
+/* when every job loaded and was written, else -1.                          */
+/***************************************************************/
+int batch_run(const char *manifest, const char *out_dir, int threads, int engine, int lockstep)
+{
+	batch_t batch;
+	pthread_t tids[BATCH_MAX_THREADS];
+	char path[PROG_FILE_MAX + 32];
+	batch_job_t *jobs = NULL;
+	int64_t count;
+	uint64_t start, ns, total = 0;
+	uint32_t i, failed = 0, steals = 0;
+	FILE *summary;
+	int w;
+
+	count = read_manifest(manifest, &jobs);
+	if (count < 0) {
+		return -1;
+	}
+	if (mkdir(out_dir, 0777) != 0 && errno != EEXIST) {
+		printf("Error: Can't create output directory %s\n", out_dir);
+		return -1;
+	}
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads > BATCH_MAX_THREADS) {
+		threads = BATCH_MAX_THREADS;
+	}
+	if (lockstep > LOCKSTEP_MAX_LANES) {
+		lockstep = LOCKSTEP_MAX_LANES;
+	}
+
+	batch.jobs = jobs;
+	batch.num_jobs = (uint32_t)count;
+	batch.out_dir = out_dir;
+	batch.engine = engine;
+	batch.lockstep = lockstep > 0 ? lockstep : 0;
+	plan_tasks(&batch, batch.lockstep);
+	if ((uint32_t)threads > batch.num_tasks && batch.num_tasks > 0) {
+		threads = (int)batch.num_tasks;
+	}
+	batch.num_workers = threads;
+	batch.workers = calloc(threads, sizeof(batch_worker_t));
+	if (batch.workers == NULL) {
+		printf("Error: Out of memory starting batch\n");
+		exit(-1);
+	}
+	atomic_init(&batch.remaining, batch.num_tasks);
+	for (w = 0; w < threads; w++) {
+		batch.workers[w].batch = &batch;
+		batch.workers[w].id = w;
+		atomic_init(&batch.workers[w].deque.top, 0);
+		atomic_init(&batch.workers[w].deque.bottom, 0);
+		batch.workers[w].deque.slots = malloc((batch.num_tasks / threads + 1) * sizeof(int64_t));
+		if (batch.workers[w].deque.slots == NULL) {
+			printf("Error: Out of memory starting batch\n");
+			exit(-1);
+		}
+	}
+	/* deal in reverse so each worker pops its lowest-numbered task first */
+	for (i = batch.num_tasks; i-- > 0; ) {
+		deque_push(&batch.workers[i % threads].deque, i);
+	}
+
+	start = batch_now_ns();
+	for (w = 0; w < threads; w++) {
+		if (pthread_create(&tids[w], NULL, batch_worker, &batch.workers[w]) != 0) {
+			printf("Error: Can't start batch worker\n");
+			exit(-1);
+		}
+	}
+	for (w = 0; w < threads; w++) {
+		pthread_join(tids[w], NULL);
+		steals += batch.workers[w].steals;
+		free(batch.workers[w].deque.slots);
+	}
+	ns = batch_now_ns() - start;
+
+	snprintf(path, sizeof(path), "%s/summary.txt", out_dir);
+	summary = fopen(path, "w");
+	if (summary != NULL) {
+		fprintf(summary, "# job\tstatus\tinstructions\tms\tprogram\n");
+	}
+	for (i = 0; i < batch.num_jobs; i++) {
+		total += jobs[i].instructions;
+		if (jobs[i].status == JOB_LOAD_ERROR || jobs[i].status == JOB_OUTPUT_ERROR) {
+			failed++;
+		}
+		if (summary != NULL) {
+			fprintf(summary, "%u\t%s\t%u\t%.3f\t%s\n", i, JOB_STATUS[jobs[i].status],
+				jobs[i].instructions, jobs[i].ns / 1e6, jobs[i].prog);
+		}
+		job_free(&jobs[i]);
+	}
+	if (summary != NULL) {
+		fclose(summary);
+	}
+	printf("Batch: %u jobs (%u failed) on %d threads, %u steals", batch.num_jobs, failed, threads, steals);
+	if (batch.lockstep) {
+		printf(", %u lockstep groups of up to %d", batch.num_tasks, batch.lockstep);
+	}
+	printf("\n");
+	printf("Simulated %llu instructions in %.3f ms", (unsigned long long)total, ns / 1e6);
+	if (total > 0) {
+		printf(" (%.2f ns/instruction)", (double)ns / total);
+	}
+	printf("\nResults written to %s\n", out_dir);
+
+	free(batch.workers);
+	free(batch.order);
+	free(batch.tasks);
+	free(jobs);
+	return (failed == 0 && summary != NULL) ? 0 : -1;
+}
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Simulator benchmarks.                                                                                    */
+/*                                                                                                                     */
+/* mu-mips-bench [--samples=<n>] [--json=<file>] [--label=<text>]      */
+/*               [<program.in>]...                                                                     */
+/*                                                                                                                     */
+/* Times the simulator core in isolation: mem_read_32/mem_write_32   */
+/* (TLB hits and misses), decode_instruction, handle_instruction per  */
+/* instruction class, load_program on a large generated program and  */
+/* reset() after a run, then runs each program end to end on every   */
+/* engine. Each benchmark takes n samples of a batch of operations    */
+/* and reports the median and 99th percentile time per operation     */
+/* (and guest MIPS end to end), as a table and optionally as JSON       */
+/* labelled with the commit it measured (make bench does both).        */
+/***************************************************************/
+
+#define BENCH_DEFAULT_SAMPLES 31
+#define BENCH_MEM_OPS (1u << 18)            /* per sample */
+#define BENCH_MISS_PAGES 4096               /* > TLB_SIZE, so every access misses */
+#define BENCH_DECODE_OPS (1u << 18)
+#define BENCH_CLASS_WORDS 1024              /* straight-line block, then J back */
+#define BENCH_CLASS_OPS (1u << 16)
+#define BENCH_LOAD_WORDS (1u << 18)         /* 1 MB of text */
+#define BENCH_RESET_RUN 512                 /* instructions before each reset: 256 dirty pages */
+#define BENCH_RUN_OPS (1u << 20)            /* guest instructions per end-to-end sample */
+
+typedef struct {
+	char name[96];
+	const char *unit;
+	double median, p99;
+	int mips;                     /* also report 1e3 / median as guest MIPS */
+} bench_result_t;
+
+static bench_result_t *results;
+static uint32_t num_results, results_capacity;
+static uint32_t samples = BENCH_DEFAULT_SAMPLES;
+static volatile uint32_t sink;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/***************************************************************/
+/* Record and print the median and p99 of the n samples (ns per op)   */
+/***************************************************************/
+static void report(const char *name, const char *unit, double *sample, int mips)
+{
+	bench_result_t *r;
+	uint32_t p99 = (99 * samples + 99) / 100;
+
+	if (num_results == results_capacity) {
+		results_capacity = results_capacity ? results_capacity * 2 : 64;
+		results = realloc(results, results_capacity * sizeof(bench_result_t));
+		if (results == NULL) {
+			printf("Error: Out of memory recording results\n");
+			exit(1);
+		}
+	}
+	r = &results[num_results++];
+	qsort(sample, samples, sizeof(double), compare_double);
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->unit = unit;
+	r->median = sample[samples / 2];
+	r->p99 = sample[(p99 > 0 ? p99 : 1) - 1];
+	r->mips = mips;
+	printf("%-40s %12.2f %12.2f  %s", r->name, r->median, r->p99, unit);
+	if (mips) {
+		printf("  (%.1f MIPS)", 1e3 / r->median);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+/***************************************************************/
+/* mem_read_32 / mem_write_32, within resident pages and across more */
+/* pages than the TLB holds                                                                      */
+/***************************************************************/
+static void bench_memory(double *sample)
+{
+	mips_machine *m = machine_create();
+	uint32_t i, s, sum = 0, stride;
+	uint64_t t;
+	int miss;
+
+	for (i = 0; i < BENCH_MISS_PAGES; i++) {
+		mem_write_32(m, MEM_DATA_BEGIN + i * PAGE_SIZE, i);
+	}
+	for (miss = 0; miss < 2; miss++) {
+		/* hits: 16 KB of consecutive words; misses: one word per page */
+		stride = miss ? PAGE_SIZE : 4;
+		for (s = 0; s < samples; s++) {
+			t = now_ns();
+			for (i = 0; i < BENCH_MEM_OPS; i++) {
+				sum += mem_read_32(m, MEM_DATA_BEGIN + (i % (miss ? BENCH_MISS_PAGES : 4096)) * stride);
+			}
+			sample[s] = (double)(now_ns() - t) / BENCH_MEM_OPS;
+		}
+		report(miss ? "mem_read_32 (TLB miss)" : "mem_read_32", "ns/op", sample, FALSE);
+		for (s = 0; s < samples; s++) {
+			t = now_ns();
+			for (i = 0; i < BENCH_MEM_OPS; i++) {
+				mem_write_32(m, MEM_DATA_BEGIN + (i % (miss ? BENCH_MISS_PAGES : 4096)) * stride, i);
+			}
+			sample[s] = (double)(now_ns() - t) / BENCH_MEM_OPS;
+		}
+		report(miss ? "mem_write_32 (TLB miss)" : "mem_write_32", "ns/op", sample, FALSE);
+	}
+	sink = sum;
+	machine_destroy(m);
+}
+
+/* one word of every implemented op */
+static const uint32_t DECODE_WORDS[] = {
+	0x000940C0, 0x000940C2, 0x000940C3, 0x03E00008, 0x0120F809, 0x0000000C,
+	0x00004010, 0x01000011, 0x00004012, 0x01000013, 0x012A0018, 0x012A0019, 0x012A001A, 0x012A001B,
+	0x012A4020, 0x012A4021, 0x012A4022, 0x012A4023, 0x012A4024, 0x012A4025, 0x012A4026, 0x012A4027, 0x012A402A,
+	0x0520FFFF, 0x0521FFFF, 0x08100000, 0x0C100000, 0x112AFFFF, 0x152AFFFF, 0x1920FFFF, 0x1D20FFFF,
+	0x21280001, 0x25280001, 0x29280001, 0x31280001, 0x35280001, 0x39280001, 0x3C081001,
+	0x81280004, 0x85280004, 0x8D280004, 0xA1280004, 0xA5280004, 0xAD280004,
+};
+
+static void bench_decode(double *sample)
+{
+	decoded_inst_t d;
+	uint32_t i, s, n = sizeof(DECODE_WORDS) / sizeof(DECODE_WORDS[0]), sum = 0;
+	uint64_t t;
+
+	for (s = 0; s < samples; s++) {
+		t = now_ns();
+		for (i = 0; i < BENCH_DECODE_OPS; i++) {
+			decode_instruction(DECODE_WORDS[i % n], MEM_TEXT_BEGIN + 4 * i, &d);
+			sum += d.op;
+		}
+		sample[s] = (double)(now_ns() - t) / BENCH_DECODE_OPS;
+	}
+	sink = sum;
+	report("decode_instruction", "ns/op", sample, FALSE);
+}
+
+/***************************************************************/
+/* handle_instruction on a block of one instruction class                   */
+/***************************************************************/
+static void bench_class(double *sample, const char *name, uint32_t word)
+{
+	mips_machine *m = machine_create();
+	char label[96];
+	uint32_t i, s, address;
+	uint64_t t;
+
+	for (i = 0; i < BENCH_CLASS_WORDS; i++) {
+		address = MEM_TEXT_BEGIN + 4 * i;
+		/* J: jump to the next word, so every class runs straight through */
+		mem_write_32(m, address, word == 0x08000000 ? word | (((address + 4) >> 2) & 0x03FFFFFF) : word);
+	}
+	mem_write_32(m, MEM_TEXT_BEGIN + 4 * BENCH_CLASS_WORDS, 0x08000000 | ((MEM_TEXT_BEGIN >> 2) & 0x03FFFFFF));
+	m->cpu.REGS[9] = MEM_DATA_BEGIN;
+	m->cpu.REGS[10] = 7;
+	m->trace_level = TRACE_OFF;
+	for (s = 0; s < samples; s++) {
+		t = now_ns();
+		for (i = 0; i < BENCH_CLASS_OPS; i++) {
+			handle_instruction(m);
+		}
+		sample[s] = (double)(now_ns() - t) / BENCH_CLASS_OPS;
+	}
+	snprintf(label, sizeof(label), "handle_instruction %s", name);
+	report(label, "ns/op", sample, FALSE);
+	machine_destroy(m);
+}
+
+/***************************************************************/
+/* load_program on a large generated program, then reset() after a   */
+/* short run of it                                                                                         */
+/***************************************************************/
+static void bench_load_reset(double *sample)
+{
+	char path[] = "/tmp/mu-mips-bench-XXXXXX";
+	mips_machine *m;
+	FILE *fp;
+	uint32_t i, s;
+	uint64_t t;
+	int fd = mkstemp(path);
+
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		printf("Error: Can't create %s\n", path);
+		exit(1);
+	}
+	/* LUI $9, 0x1001, then ADDIU $9, $9, 0x1000 / SW $9, 0($9): a new data page every 2 */
+	fprintf(fp, "3C091001\n");
+	for (i = 1; i < BENCH_LOAD_WORDS; i++) {
+		fprintf(fp, "%08X\n", i % 2 ? 0x25291000 : 0xAD290000);
+	}
+	if (fclose(fp) != 0) {
+		printf("Error: Can't write %s\n", path);
+		exit(1);
+	}
+
+	for (s = 0; s < samples; s++) {
+		m = machine_create();
+		m->quiet = TRUE;
+		set_prog_file(m, path);
+		t = now_ns();
+		if (load_program(m) != 0) {
+			exit(1);
+		}
+		sample[s] = (double)(now_ns() - t) / BENCH_LOAD_WORDS;
+		machine_destroy(m);
+	}
+	report("load_program (1 MB text)", "ns/word", sample, FALSE);
+
+	m = machine_create();
+	m->quiet = TRUE;
+	set_prog_file(m, path);
+	if (reset(m) != 0) {
+		exit(1);
+	}
+	for (s = 0; s < samples; s++) {
+		run_cycles(m, BENCH_RESET_RUN);
+		t = now_ns();
+		reset(m);
+		sample[s] = (double)(now_ns() - t) / 1e3;
+	}
+	report("reset (256 dirty pages)", "us/reset", sample, FALSE);
+	machine_destroy(m);
+	unlink(path);
+}
+
+/***************************************************************/
+/* Run prog end to end on engine, restarting it whenever it halts      */
+/***************************************************************/
+static void bench_program(double *sample, const char *prog, const char *engine)
+{
+	mips_machine *m = machine_create();
+	char label[96];
+	const char *base = strrchr(prog, '/') != NULL ? strrchr(prog, '/') + 1 : prog;
+	uint64_t t, ns, executed;
+	uint32_t s;
+
+	m->quiet = TRUE;
+	if (set_prog_file(m, prog) != 0 || set_engine(m, engine) != 0 || reset(m) != 0) {
+		printf("Error: Can't run %s on %s\n", prog, engine);
+		machine_destroy(m);
+		return;
+	}
+	for (s = 0; s < samples; s++) {
+		for (executed = 0, ns = 0; executed < BENCH_RUN_OPS; ) {
+			if (!m->run_flag) {
+				reset(m);
+			}
+			t = now_ns();
+			executed += run_cycles(m, BENCH_RUN_OPS - executed);
+			ns += now_ns() - t;
+		}
+		sample[s] = (double)ns / executed;
+	}
+	snprintf(label, sizeof(label), "run %s (%s)", base, engine);
+	report(label, "ns/instruction", sample, TRUE);
+	machine_destroy(m);
+}
+
+/* s as a JSON string literal */
+static void json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(fp, "\\%c", *s);
+		}
+		else if ((unsigned char)*s < 0x20) {
+			fprintf(fp, "\\u%04x", *s);
+		}
+		else {
+			fputc(*s, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+/***************************************************************/
+/* Write the results as JSON; returns 0 or -1                                      */
+/***************************************************************/
+static int write_json(const char *path, const char *label)
+{
+	FILE *fp = fopen(path, "w");
+	uint32_t i;
+
+	if (fp == NULL) {
+		printf("Error: Can't create %s\n", path);
+		return -1;
+	}
+	fprintf(fp, "{\n  \"label\": ");
+	json_string(fp, label);
+	fprintf(fp, ",\n  \"samples\": %u,\n  \"benchmarks\": [\n", samples);
+	for (i = 0; i < num_results; i++) {
+		fprintf(fp, "    { \"name\": ");
+		json_string(fp, results[i].name);
+		fprintf(fp, ", \"unit\": \"%s\", \"median\": %.3f, \"p99\": %.3f",
+			results[i].unit, results[i].median, results[i].p99);
+		if (results[i].mips) {
+			fprintf(fp, ", \"mips\": %.3f", 1e3 / results[i].median);
+		}
+		fprintf(fp, " }%s\n", i + 1 < num_results ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+	if (fclose(fp) != 0) {
+		printf("Error: Can't write %s\n", path);
+		return -1;
+	}
+	printf("\nResults written to %s\n", path);
+	return 0;
+}
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[])
+{
+	static const char *const engines[] = { "switch", "threaded", "block", "jit" };
+	static const struct { const char *name; uint32_t word; } classes[] = {
+		{ "ALU (ADDU)", 0x012A4021 }, { "immediate (ADDIU)", 0x25080001 }, { "shift (SLL)", 0x000940C0 },
+		{ "multiply (MULT)", 0x012A0018 }, { "divide (DIV)", 0x012A001A },
+		{ "load (LW)", 0x8D280000 }, { "store (SW)", 0xAD280000 },
+		{ "branch (BEQ taken)", 0x10000001 }, { "jump (J)", 0x08000000 },
+	};
+	const char *json = NULL, *label = "";
+	double *sample;
+	uint32_t i, e;
+	int first_prog = argc;
+
+	for (i = 1; i < (uint32_t)argc; i++) {
+		if (strncmp(argv[i], "--samples=", 10) == 0) {
+			samples = atoi(argv[i] + 10);
+		}
+		else if (strncmp(argv[i], "--json=", 7) == 0) {
+			json = argv[i] + 7;
+		}
+		else if (strncmp(argv[i], "--label=", 8) == 0) {
+			label = argv[i] + 8;
+		}
+		else if (argv[i][0] == '-') {
+			printf("Usage: %s [--samples=<n>] [--json=<file>] [--label=<text>] [<program.in>]...\n", argv[0]);
+			return 1;
+		}
+		else {
+			first_prog = i;
+			break;
+		}
+	}
+	if (samples == 0) {
+		samples = 1;
+	}
+	sample = malloc(samples * sizeof(double));
+	if (sample == NULL) {
+		printf("Error: Out of memory\n");
+		return 1;
+	}
+
+	printf("%-40s %12s %12s  (%u samples)\n", "Benchmark", "Median", "p99", samples);
+	bench_memory(sample);
+	bench_decode(sample);
+	for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+		bench_class(sample, classes[i].name, classes[i].word);
+	}
+	bench_load_reset(sample);
+	for (i = first_prog; i < (uint32_t)argc; i++) {
+		for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+			if (strcmp(engines[e], "jit") != 0 || jit_available()) {
+				bench_program(sample, argv[i], engines[e]);
+			}
+		}
+	}
+	free(sample);
+	return json != NULL && write_json(json, label) != 0 ? 1 : 0;
+}
@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* ELF32 MIPS executables (little or big endian).                             */
+/*                                                                                                                     */
+/* PT_LOAD segments go to guest memory. Whole pages of a little-endian */
+/* image whose file offset is page aligned become guest pages in place: */
+/* the file is mapped privately, so they are read in on first touch and  */
+/* copied on first write, like a restored checkpoint. The rest is copied */
+/* a word at a time. The simulator's memory is little endian, so the      */
+/* words of a big-endian image are stored swapped and the machine is   */
+/* marked big_endian: word accesses and instruction fetch see the        */
+/* image's values, and byte and halfword accesses flip their address   */
+/* (see BYTE_ADDRESS in mu-mips.h).                                                       */
+/*                                                                                                                     */
+/* The entry point becomes the PC, $gp is _gp (or MEM_DATA_BEGIN +     */
+/* 0x8000 without one), $sp the top of the stack. The symbol table is  */
+/* kept for print and the profiler.                                                           */
+/***************************************************************/
+
+#define ELF_GP_DEFAULT (MEM_DATA_BEGIN + 0x8000)
+#define ELF_SP_DEFAULT (MEM_STACK_BEGIN & ~0xfu)
+
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+	int big;                      /* ELFDATA2MSB */
+	int swap;                     /* file byte order differs from the host's */
+	Elf32_Ehdr ehdr;
+} elf_file_t;
+
+static uint16_t e16(const elf_file_t *e, uint16_t v)
+{
+	return e->swap ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t e32(const elf_file_t *e, uint32_t v)
+{
+	return e->swap ? __builtin_bswap32(v) : v;
+}
+
+/***************************************************************/
+/* TRUE if fd starts with the ELF magic (fd's offset is unchanged)  */
+/***************************************************************/
+int elf_probe(int fd)
+{
+	unsigned char magic[SELFMAG];
+	return pread(fd, magic, SELFMAG, 0) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+}
+
+/***************************************************************/
+/* Check the header of the mapped file; prints why and returns -1 if */
+/* it is not a 32-bit MIPS executable                                                */
+/***************************************************************/
+static int elf_open(elf_file_t *e, const uint8_t *data, size_t size, const char *path)
+{
+	const unsigned char *ident = data;
+	int host_big = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+
+	e->data = data;
+	e->size = size;
+	if (size < sizeof(Elf32_Ehdr) || memcmp(ident, ELFMAG, SELFMAG) != 0 || ident[EI_CLASS] != ELFCLASS32
+			|| (ident[EI_DATA] != ELFDATA2LSB && ident[EI_DATA] != ELFDATA2MSB)) {
+		printf("Error: %s is not a 32-bit ELF file\n", path);
+		return -1;
+	}
+	e->big = ident[EI_DATA] == ELFDATA2MSB;
+	e->swap = e->big != host_big;
+	memcpy(&e->ehdr, data, sizeof(Elf32_Ehdr));
+	if (e16(e, e->ehdr.e_machine) != EM_MIPS || e16(e, e->ehdr.e_type) != ET_EXEC) {
+		printf("Error: %s is not a MIPS executable\n", path);
+		return -1;
+	}
+	if (e16(e, e->ehdr.e_phentsize) != sizeof(Elf32_Phdr)
+			|| e32(e, e->ehdr.e_phoff) + (uint64_t)e16(e, e->ehdr.e_phnum) * sizeof(Elf32_Phdr) > size) {
+		printf("Error: %s has a corrupt program header table\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static void elf_phdr(const elf_file_t *e, uint32_t i, Elf32_Phdr *ph)
+{
+	memcpy(ph, e->data + e32(e, e->ehdr.e_phoff) + i * sizeof(Elf32_Phdr), sizeof(Elf32_Phdr));
+	ph->p_type = e32(e, ph->p_type);
+	ph->p_offset = e32(e, ph->p_offset);
+	ph->p_vaddr = e32(e, ph->p_vaddr);
+	ph->p_filesz = e32(e, ph->p_filesz);
+	ph->p_memsz = e32(e, ph->p_memsz);
+	ph->p_flags = e32(e, ph->p_flags);
+}
+
+/* region holding [begin, begin + size), or -1 */
+static int elf_region(uint32_t begin, uint32_t size)
+{
+	int i;
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		if (begin >= MEM_REGIONS[i].begin && (uint64_t)begin + size - 1 <= MEM_REGIONS[i].end) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/***************************************************************/
+/* Copy the file bytes of a segment in [begin, end) into guest memory */
+/* a word at a time, merging partial words at the edges                     */
+/***************************************************************/
+static void elf_copy(mips_machine *m, const elf_file_t *e, const Elf32_Phdr *ph, uint32_t begin, uint32_t end)
+{
+	uint32_t a, k, src, word;
+
+	for (a = begin & ~3u; a < end; a += 4) {
+		word = mem_read_32(m, a);
+		for (k = 0; k < 4; k++) {
+			/* guest byte a + k holds bits 8k..8k+7 of the image's word */
+			src = e->big ? a + 3 - k : a + k;
+			if (a + k < begin || a + k >= end || src < ph->p_vaddr || src - ph->p_vaddr >= ph->p_filesz) {
+				continue;
+			}
+			word = (word & ~(0xffu << (8 * k))) | (uint32_t)e->data[ph->p_offset + (src - ph->p_vaddr)] << (8 * k);
+		}
+		mem_write_32(m, a, word);
+	}
+}
+
+/***************************************************************/
+/* Order symbols by address                                                                     */
+/***************************************************************/
+static int symbol_compare(const void *a, const void *b)
+{
+	const symbol_t *x = a, *y = b;
+
+	if (x->addr != y->addr) {
+		return x->addr < y->addr ? -1 : 1;
+	}
+	/* functions and objects before plain labels at the same address */
+	return (x->type == STT_NOTYPE) - (y->type == STT_NOTYPE);
+}
+
+/***************************************************************/
+/* Load the symbol table (if any) of the mapped file into m; returns */
+/* the value of _gp through gp (unchanged if there is none)             */
+/***************************************************************/
+static void elf_symbols(mips_machine *m, const elf_file_t *e, uint32_t *gp)
+{
+	Elf32_Shdr sh, strsh;
+	Elf32_Sym sym;
+	uint32_t shoff = e32(e, e->ehdr.e_shoff), shnum = e16(e, e->ehdr.e_shnum), i, j, n, count, name, length;
+	const char *strtab;
+	size_t pool = 0;
+	char *names;
+	symbol_t *symbols;
+	unsigned char type;
+
+	symbols_release(m);
+	if (shoff == 0 || e16(e, e->ehdr.e_shentsize) != sizeof(Elf32_Shdr)
+			|| shoff + (uint64_t)shnum * sizeof(Elf32_Shdr) > e->size) {
+		return;
+	}
+	for (i = 0; i < shnum; i++) {
+		memcpy(&sh, e->data + shoff + i * sizeof(Elf32_Shdr), sizeof(Elf32_Shdr));
+		if (e32(e, sh.sh_type) == SHT_SYMTAB) {
+			break;
+		}
+	}
+	if (i == shnum || e32(e, sh.sh_link) >= shnum || e32(e, sh.sh_entsize) != sizeof(Elf32_Sym)
+			|| e32(e, sh.sh_offset) + (uint64_t)e32(e, sh.sh_size) > e->size) {
+		return;
+	}
+	memcpy(&strsh, e->data + shoff + e32(e, sh.sh_link) * sizeof(Elf32_Shdr), sizeof(Elf32_Shdr));
+	if (e32(e, strsh.sh_offset) + (uint64_t)e32(e, strsh.sh_size) > e->size || e32(e, strsh.sh_size) == 0) {
+		return;
+	}
+	strtab = (const char *)e->data + e32(e, strsh.sh_offset);
+	count = e32(e, sh.sh_size) / sizeof(Elf32_Sym);
+
+	/* two passes: size the name pool, then fill it */
+	symbols = malloc((count + 1) * sizeof(symbol_t));
+	for (j = 0; j < 2; j++) {
+		names = j == 0 ? NULL : malloc(pool + 1);
+		if (symbols == NULL || (j == 1 && names == NULL)) {
+			printf("Error: Out of memory loading symbols\n");
+			exit(-1);
+		}
+		for (i = 1, n = 0, pool = 0; i < count; i++) {
+			memcpy(&sym, e->data + e32(e, sh.sh_offset) + i * sizeof(Elf32_Sym), sizeof(Elf32_Sym));
+			name = e32(e, sym.st_name);
+			type = ELF32_ST_TYPE(sym.st_info);
+			if (name == 0 || name >= e32(e, strsh.sh_size) || e16(e, sym.st_shndx) == SHN_UNDEF
+					|| (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE)) {
+				continue;
+			}
+			length = strnlen(strtab + name, e32(e, strsh.sh_size) - name);
+			if (j == 1) {
+				memcpy(names + pool, strtab + name, length);
+				names[pool + length] = '\0';
+				symbols[n].addr = e32(e, sym.st_value);
+				symbols[n].size = e32(e, sym.st_size);
+				symbols[n].type = type;
+				symbols[n].name = names + pool;
+				if (strcmp(symbols[n].name, "_gp") == 0) {
+					*gp = symbols[n].addr;
+				}
+			}
+			pool += length + 1;
+			n++;
+		}
+	}
+	qsort(symbols, n, sizeof(symbol_t), symbol_compare);
+	m->symbols = symbols;
+	m->num_symbols = n;
+	m->symbol_names = names;
+}
+
+/***************************************************************/
+/* Load the ELF executable open on fd (the program file) into m,    */
+/* whose memory is empty, as reset and a new machine leave it; returns */
+/* 0, or -1 (memory unchanged) if the file can't be used                    */
+/***************************************************************/
+int elf_load(mips_machine *m, int fd)
+{
+	elf_file_t e;
+	Elf32_Phdr ph;
+	struct stat st;
+	uint8_t *map;
+	uint32_t i, a, end, text_end = MEM_TEXT_BEGIN, mapped = 0, gp = ELF_GP_DEFAULT;
+	int in_place, segments = 0;
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		printf("Error: Can't read program file %s\n", m->prog_file);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		printf("Error: Can't map program file %s\n", m->prog_file);
+		return -1;
+	}
+	if (elf_open(&e, map, st.st_size, m->prog_file) != 0) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	/* validate every segment before touching the machine */
+	for (i = 0; i < e16(&e, e.ehdr.e_phnum); i++) {
+		elf_phdr(&e, i, &ph);
+		if (ph.p_type != PT_LOAD || ph.p_memsz == 0) {
+			continue;
+		}
+		if (ph.p_filesz > ph.p_memsz || (uint64_t)ph.p_offset + ph.p_filesz > (uint64_t)st.st_size) {
+			printf("Error: %s has a corrupt segment at 0x%08x\n", m->prog_file, ph.p_vaddr);
+			munmap(map, st.st_size);
+			return -1;
+		}
+		if (elf_region(ph.p_vaddr, ph.p_memsz) < 0) {
+			printf("Error: Segment 0x%08x-0x%08x of %s is outside guest memory\n", ph.p_vaddr,
+				ph.p_vaddr + ph.p_memsz - 1, m->prog_file);
+			munmap(map, st.st_size);
+			return -1;
+		}
+	}
+
+	/* pages of the mapping can stand in for guest pages as they are */
+	in_place = !e.big && m->ckpt_map == NULL && sysconf(_SC_PAGESIZE) == PAGE_SIZE;
+	for (i = 0; i < e16(&e, e.ehdr.e_phnum); i++) {
+		elf_phdr(&e, i, &ph);
+		if (ph.p_type != PT_LOAD || ph.p_memsz == 0) {
+			continue;
+		}
+		segments++;
+		end = ph.p_vaddr + ph.p_filesz;
+		a = ph.p_vaddr;
+		if (in_place && ((ph.p_offset - ph.p_vaddr) & PAGE_MASK) == 0) {
+			if ((a & PAGE_MASK) != 0) {
+				a = (a + PAGE_MASK) & ~PAGE_MASK;
+				elf_copy(m, &e, &ph, ph.p_vaddr, a < end ? a : end);
+			}
+			for (; a < end && end - a >= PAGE_SIZE; a += PAGE_SIZE, mapped++) {
+				mem_map_page(m, a, map + ph.p_offset + (a - ph.p_vaddr));
+			}
+		}
+		if (a < end) {
+			elf_copy(m, &e, &ph, a, end);
+		}
+		/* p_filesz up to p_memsz (.bss) stays blank: the memory is fresh */
+
+		/* program_size covers the code from MEM_TEXT_BEGIN, for print and --aot */
+		if ((ph.p_flags & PF_X) && ph.p_vaddr >= MEM_TEXT_BEGIN && ph.p_vaddr <= MEM_TEXT_END
+				&& ph.p_vaddr + ph.p_memsz > text_end) {
+			text_end = ph.p_vaddr + ph.p_memsz;
+		}
+	}
+
+	elf_symbols(m, &e, &gp);
+	m->cpu.PC = e32(&e, e.ehdr.e_entry);
+	m->cpu.REGS[28] = gp;
+	m->cpu.REGS[29] = ELF_SP_DEFAULT;
+	m->program_size = (text_end - MEM_TEXT_BEGIN + 3) / 4;
+	m->image = IMAGE_ELF;
+	m->big_endian = e.big;
+	if (mapped != 0) {
+		m->ckpt_map = map;
+		m->ckpt_map_size = st.st_size;
+	}
+	else {
+		munmap(map, st.st_size);
+	}
+	if (!m->quiet) {
+		printf("ELF program loaded into memory.\n%d segments (%u pages mapped in place), entry 0x%08x, %u symbols.\n\n",
+			segments, mapped, m->cpu.PC, m->num_symbols);
+	}
+	return 0;
+}
+
+/***************************************************************/
+/* Replace m's symbols with those of the ELF file at path, if it is one */
+/* (a restored checkpoint names its program file)                              */
+/***************************************************************/
+void elf_load_symbols(mips_machine *m, const char *path)
+{
+	elf_file_t e;
+	struct stat st;
+	uint8_t *map;
+	uint32_t gp;
+	int fd;
+
+	symbols_release(m);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	if (!elf_probe(fd) || fstat(fd, &st) != 0
+			|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	close(fd);
+	if (elf_open(&e, map, st.st_size, path) == 0) {
+		elf_symbols(m, &e, &gp);
+	}
+	munmap(map, st.st_size);
+}
+
+/***************************************************************/
+/* Symbol covering addr: the closest one at or below it that either  */
+/* spans it or, for labels without a size, is the last one before it; */
+/* NULL if none                                                                                            */
+/***************************************************************/
+const symbol_t *symbol_lookup(mips_machine *m, uint32_t addr)
+{
+	uint32_t lo = 0, hi = m->num_symbols, mid;
+	const symbol_t *s;
+
+	while (hi > lo) {
+		mid = (lo + hi) / 2;
+		if (m->symbols[mid].addr <= addr) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	/* lo: first symbol above addr; prefer the first entry at the best address */
+	if (lo == 0) {
+		return NULL;
+	}
+	s = &m->symbols[lo - 1];
+	while (s > m->symbols && (s - 1)->addr == s->addr) {
+		s--;
+	}
+	if (s->size != 0 && addr - s->addr >= s->size) {
+		return NULL;
+	}
+	return s;
+}
+
+/***************************************************************/
+/* Format addr as name, name+0xoff or (without a symbol) 0x%08x     */
+/***************************************************************/
+const char *symbol_format(mips_machine *m, uint32_t addr, char *buf, size_t size)
+{
+	const symbol_t *s = symbol_lookup(m, addr);
+
+	if (s == NULL) {
+		snprintf(buf, size, "0x%08x", addr);
+	}
+	else if (s->addr == addr) {
+		snprintf(buf, size, "%s", s->name);
+	}
+	else {
+		snprintf(buf, size, "%s+0x%x", s->name, addr - s->addr);
+	}
+	return buf;
+}
+
+void symbols_release(mips_machine *m)
+{
+	free(m->symbols);
+	free(m->symbol_names);
+	m->symbols = NULL;
+	m->symbol_names = NULL;
+	m->num_symbols = 0;
+}
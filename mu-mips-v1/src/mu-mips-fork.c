@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* What-if forks.                                                                                                  */
+/*                                                                                                                     */
+/* fork <n> [rN=<first>[+<step>]]... [hi=...] [lo=...] [max=<count>]  */
+/*                                                                                                                     */
+/* Clones the machine into n child processes with fork(): each child */
+/* shares guest memory copy-on-write with the session and gets its   */
+/* own copy of the register file, applies its overrides (child i     */
+/* sets a register to first + i * step, step defaulting to 0), and   */
+/* runs untraced until it halts or has executed max instructions.   */
+/* At most one child per online CPU runs at a time. Each child writes */
+/* its final state to a temporary file, which the session prints in */
+/* child order; the session's own machine is left as it was.            */
+/***************************************************************/
+
+#define FORK_DEFAULT_MAX 100000000u   /* instructions per child without max= */
+#define FORK_MAX_CHILDREN 65536
+
+typedef struct {
+	uint32_t set_mask;            /* registers swept (bit 0: unused) */
+	uint32_t first[MIPS_REGS], step[MIPS_REGS];
+	int set_hi, set_lo;
+	uint32_t hi_first, hi_step, lo_first, lo_step;
+	uint32_t max;
+} fork_spec_t;
+
+typedef struct {
+	pid_t pid;
+	FILE *result;
+	int done;
+	int status;
+} fork_child_t;
+
+/***************************************************************/
+/* Parse "<first>[+<step>]"; returns 0 or -1                                                */
+/***************************************************************/
+static int parse_sweep(const char *text, uint32_t *first, uint32_t *step)
+{
+	char *end;
+
+	*first = strtoul(text, &end, 0);
+	*step = 0;
+	if (end == text) {
+		return -1;
+	}
+	if (*end == '+') {
+		text = end + 1;
+		*step = strtoul(text, &end, 0);
+		if (end == text) {
+			return -1;
+		}
+	}
+	return *end == '\0' ? 0 : -1;
+}
+
+/***************************************************************/
+/* Parse the override list after "fork <n>"; returns 0 or -1          */
+/***************************************************************/
+static int parse_fork_spec(char *line, fork_spec_t *spec)
+{
+	char *save, *tok, *end;
+	unsigned long number;
+	uint32_t reg;
+
+	memset(spec, 0, sizeof(*spec));
+	spec->max = FORK_DEFAULT_MAX;
+	for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save)) {
+		if ((tok[0] == 'r' || tok[0] == 'R') && tok[1] >= '0' && tok[1] <= '9'
+				&& (number = strtoul(tok + 1, &end, 10), *end == '=')) {
+			reg = number;
+			if (number == 0 || number >= MIPS_REGS
+					|| parse_sweep(end + 1, &spec->first[reg], &spec->step[reg]) != 0) {
+				return -1;
+			}
+			spec->set_mask |= 1u << reg;
+		}
+		else if (strncmp(tok, "hi=", 3) == 0) {
+			if (parse_sweep(tok + 3, &spec->hi_first, &spec->hi_step) != 0) {
+				return -1;
+			}
+			spec->set_hi = TRUE;
+		}
+		else if (strncmp(tok, "lo=", 3) == 0) {
+			if (parse_sweep(tok + 3, &spec->lo_first, &spec->lo_step) != 0) {
+				return -1;
+			}
+			spec->set_lo = TRUE;
+		}
+		else if (strncmp(tok, "max=", 4) == 0) {
+			spec->max = strtoul(tok + 4, &end, 0);
+			if (end == tok + 4 || *end != '\0') {
+				return -1;
+			}
+		}
+		else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/***************************************************************/
+/* Child index: apply its overrides, run, and write its final state  */
+/* (registers that differ from the session's) to out                       */
+/***************************************************************/
+static void fork_child(mips_machine *m, const fork_spec_t *spec, uint32_t index, FILE *out)
+{
+	CPU_State before = m->cpu;
+	uint32_t start = m->instruction_count, limit;
+	int i;
+
+	m->trace_level = TRACE_OFF;
+	m->record = NULL;             /* the session's replay log is not ours */
+	m->history.enabled = FALSE;   /* nobody steps back in a child */
+	profile_stop(m);              /* nor reads its profile */
+	fprintf(out, "-------------------------------------\n");
+	fprintf(out, "Child %u\t:", index);
+	for (i = 1; i < MIPS_REGS; i++) {
+		if (spec->set_mask & (1u << i)) {
+			m->cpu.REGS[i] = spec->first[i] + index * spec->step[i];
+			fprintf(out, " r%d=0x%08x", i, m->cpu.REGS[i]);
+		}
+	}
+	if (spec->set_hi) {
+		m->cpu.HI = spec->hi_first + index * spec->hi_step;
+		fprintf(out, " hi=0x%08x", m->cpu.HI);
+	}
+	if (spec->set_lo) {
+		m->cpu.LO = spec->lo_first + index * spec->lo_step;
+		fprintf(out, " lo=0x%08x", m->cpu.LO);
+	}
+	fprintf(out, "\n");
+
+	limit = spec->max > UINT32_MAX - start ? UINT32_MAX : start + spec->max;
+	while (m->run_flag && m->instruction_count < limit) {
+		run_cycles(m, limit - m->instruction_count);
+	}
+
+	fprintf(out, "Status\t: %s\n", m->run_flag ? "limit" : "halted");
+	fprintf(out, "# Instructions Executed\t: %u (+%u)\n", m->instruction_count, m->instruction_count - start);
+	fprintf(out, "PC\t: 0x%08x\n", m->cpu.PC);
+	for (i = 0; i < MIPS_REGS; i++) {
+		if (m->cpu.REGS[i] != before.REGS[i]) {
+			fprintf(out, "[R%d]\t: 0x%08x\n", i, m->cpu.REGS[i]);
+		}
+	}
+	if (m->cpu.HI != before.HI) {
+		fprintf(out, "[HI]\t: 0x%08x\n", m->cpu.HI);
+	}
+	if (m->cpu.LO != before.LO) {
+		fprintf(out, "[LO]\t: 0x%08x\n", m->cpu.LO);
+	}
+}
+
+/***************************************************************/
+/* Print a finished child's report and release its file                    */
+/***************************************************************/
+static void fork_report(fork_child_t *child, uint32_t index)
+{
+	char buffer[4096];
+	size_t n;
+
+	if (child->result != NULL) {
+		rewind(child->result);
+		while ((n = fread(buffer, 1, sizeof(buffer), child->result)) > 0) {
+			fwrite(buffer, 1, n, stdout);
+		}
+		fclose(child->result);
+		child->result = NULL;
+	}
+	if (!WIFEXITED(child->status) || WEXITSTATUS(child->status) != 0) {
+		printf("-------------------------------------\n");
+		printf("Child %u\t: failed (%s %d)\n", index,
+			WIFSIGNALED(child->status) ? "signal" : "exit status",
+			WIFSIGNALED(child->status) ? WTERMSIG(child->status) : WEXITSTATUS(child->status));
+	}
+}
+
+/***************************************************************/
+/* Run n what-if children of m as described by args (the rest of the */
+/* fork command line); returns 0, or -1 on bad arguments or when a    */
+/* child could not be started                                                                   */
+/***************************************************************/
+int fork_run(mips_machine *m, uint32_t n, char *args)
+{
+	fork_spec_t spec;
+	fork_child_t *children;
+	uint32_t launched = 0, running = 0, printed = 0, i;
+	struct timespec t0, t1;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int status, failed = 0;
+	pid_t pid;
+
+	if (n == 0 || n > FORK_MAX_CHILDREN || parse_fork_spec(args, &spec) != 0) {
+		printf("Usage: fork <n> [rN=<first>[+<step>]]... [hi=...] [lo=...] [max=<instructions>]\n\n");
+		return -1;
+	}
+	if (m->run_flag == FALSE) {
+		printf("Simulation Stopped.\n\n");
+		return -1;
+	}
+	children = calloc(n, sizeof(fork_child_t));
+	if (children == NULL) {
+		printf("Error: Out of memory starting children\n");
+		exit(-1);
+	}
+	if (cpus < 1) {
+		cpus = 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (printed < n) {
+		if (launched < n && running < (uint32_t)cpus && !failed) {
+			fork_child_t *child = &children[launched];
+
+			child->result = tmpfile();
+			fflush(stdout);
+			pid = child->result != NULL ? fork() : -1;
+			if (pid == 0) {
+				/* _exit: the session's stdio buffers and atexit hooks are not ours */
+				fork_child(m, &spec, launched, child->result);
+				_exit(fclose(child->result) == 0 ? 0 : 1);
+			}
+			if (pid < 0) {
+				printf("Error: Can't start child %u\n", launched);
+				if (child->result != NULL) {
+					fclose(child->result);
+				}
+				failed = 1;
+				n = launched;
+				continue;
+			}
+			child->pid = pid;
+			launched++;
+			running++;
+			continue;
+		}
+
+		if (running > 0) {
+			pid = waitpid(-1, &status, 0);
+			if (pid < 0) {
+				break;
+			}
+			for (i = 0; i < launched; i++) {
+				if (children[i].pid == pid && !children[i].done) {
+					children[i].done = TRUE;
+					children[i].status = status;
+					running--;
+					break;
+				}
+			}
+		}
+		/* print finished children in order as soon as possible */
+		while (printed < n && printed < launched && children[printed].done) {
+			fork_report(&children[printed], printed);
+			printed++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	printf("-------------------------------------\n");
+	printf("Forked %u children (up to %ld at a time) in %.3f ms\n\n", launched, cpus,
+		(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+	free(children);
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Synthetic workload generator.                                                                    */
+/*                                                                                                                     */
+/* mu-mips-gen [-o <out.in>] [--seed=<n>] [section]...                           */
+/*   --alu=<words>x<iterations>        loop over a block of random ALU */
+/*                                     instructions (long loops, or large */
+/*                                     text with a big block)                  */
+/*   --chase=<MB>[x<steps>]            pointer-chasing LW chain over <MB>  */
+/*                                     of data, built by the program first   */
+/*   --calls=<depth>x<fanout>[x<repeat>] JAL/JR call tree: every level      */
+/*                                     calls the next <fanout> times          */
+/*   --branches=<n>x<iterations>       loop of <n> data-dependent BEQs       */
+/*                                                                                                                     */
+/* Writes a .in program (one hex word per line) that runs the sections */
+/* in order and halts with SYSCALL, $v0 = 10. Branch offsets follow    */
+/* this simulator's convention (relative to the branch itself, no     */
+/* delay slots). The program size and the instructions it will execute */
+/* are reported on standard error.                                                              */
+/***************************************************************/
+
+#define GEN_MAX_WORDS (TEXT_SIZE / 4)
+#define GEN_CHASE_UNROLL 8
+#define GEN_CHASE_C 0x3d7                   /* odd: x -> 4101 x + c is one cycle mod 2^k */
+#define GEN_LEAF_WORDS 8
+#define GEN_STACK_TOP 0x7ffffff0
+
+/* registers: $t0-$t8 scratch, $s0-$s4 section state, $v0, $sp, $ra */
+enum { R_V0 = 2, R_T0 = 8, R_T1, R_T2, R_T3, R_T4, R_T5, R_T6, R_T7,
+	R_S0 = 16, R_S1, R_S2, R_S3, R_S4, R_T8 = 24, R_SP = 29, R_RA = 31 };
+
+typedef struct {
+	uint32_t *words;
+	uint32_t count, capacity;
+	uint64_t executed;            /* instructions the program will run */
+	uint64_t seed;
+} gen_t;
+
+static uint32_t here(gen_t *g)
+{
+	return MEM_TEXT_BEGIN + 4 * g->count;
+}
+
+static void emit(gen_t *g, uint32_t word)
+{
+	if (g->count == g->capacity) {
+		g->capacity = g->capacity ? g->capacity * 2 : 4096;
+		g->words = realloc(g->words, g->capacity * sizeof(uint32_t));
+		if (g->words == NULL) {
+			fprintf(stderr, "Error: Out of memory\n");
+			exit(1);
+		}
+	}
+	if (g->count == GEN_MAX_WORDS) {
+		fprintf(stderr, "Error: Program does not fit the text segment\n");
+		exit(1);
+	}
+	g->words[g->count++] = word;
+}
+
+static uint32_t r_type(uint32_t funct, uint32_t rs, uint32_t rt, uint32_t rd, uint32_t sa)
+{
+	return (rs << 21) | (rt << 16) | (rd << 11) | (sa << 6) | funct;
+}
+
+static uint32_t i_type(uint32_t opcode, uint32_t rs, uint32_t rt, uint32_t imm)
+{
+	return (opcode << 26) | (rs << 21) | (rt << 16) | (imm & 0xffff);
+}
+
+static uint32_t j_type(uint32_t opcode, uint32_t target)
+{
+	return (opcode << 26) | ((target >> 2) & 0x03ffffff);
+}
+
+/* branch at the current address to target */
+static uint32_t branch(gen_t *g, uint32_t opcode, uint32_t rs, uint32_t rt, uint32_t target)
+{
+	return i_type(opcode, rs, rt, (target - here(g)) >> 2);
+}
+
+static void load_imm32(gen_t *g, uint32_t rt, uint32_t value)
+{
+	emit(g, i_type(0x0f, 0, rt, value >> 16));                      /* LUI */
+	emit(g, i_type(0x0d, rt, rt, value));                            /* ORI */
+	g->executed += 2;
+}
+
+static uint64_t next_random(gen_t *g)
+{
+	g->seed = g->seed * 6364136223846793005ull + 1442695040888963407ull;
+	return g->seed >> 33;
+}
+
+/***************************************************************/
+/* Close a loop started at top that runs while counter != 0 after   */
+/* decrementing it; BNE when top is in reach, else BEQ over a J      */
+/***************************************************************/
+static void loop_end(gen_t *g, uint32_t counter, uint32_t top)
+{
+	emit(g, i_type(0x09, counter, counter, 0xffff));                 /* ADDIU -1 */
+	if (here(g) - top < 0x8000 * 4) {
+		emit(g, branch(g, 0x05, counter, 0, top));                   /* BNE */
+	}
+	else {
+		emit(g, branch(g, 0x04, counter, 0, here(g) + 8));           /* BEQ */
+		emit(g, j_type(0x02, top));                                  /* J */
+	}
+}
+
+/* one random ALU instruction over $t0-$t7 */
+static uint32_t random_alu(gen_t *g)
+{
+	static const uint32_t FUNCTS[] = { 0x21, 0x23, 0x24, 0x25, 0x26, 0x27, 0x2a };
+	uint64_t r = next_random(g);
+	uint32_t rs = R_T0 + (r & 7), rt = R_T0 + ((r >> 3) & 7), rd = R_T0 + ((r >> 6) & 7);
+
+	switch ((r >> 9) % 5) {
+		case 0:
+			return r_type(0x00, 0, rt, rd, (r >> 12) & 31);          /* SLL */
+		case 1:
+			return r_type(0x02, 0, rt, rd, (r >> 12) & 31);          /* SRL */
+		case 2:
+			return i_type(0x09, rs, rt, r >> 12);                    /* ADDIU */
+		case 3:
+			return i_type(0x0e, rs, rt, r >> 12);                    /* XORI */
+		default:
+			return r_type(FUNCTS[(r >> 12) % 7], rs, rt, rd, 0);
+	}
+}
+
+static void gen_alu(gen_t *g, uint32_t words, uint32_t iterations)
+{
+	uint32_t top, i, end;
+
+	load_imm32(g, R_S2, iterations);
+	top = here(g);
+	for (i = 0; i < words; i++) {
+		emit(g, random_alu(g));
+	}
+	end = here(g);
+	loop_end(g, R_S2, top);
+	/* BEQ over a J runs the J on every iteration but the last */
+	g->executed += (uint64_t)iterations * (words + 2) + (here(g) - end == 12 ? iterations - 1 : 0);
+}
+
+/***************************************************************/
+/* Fill N = MB words (rounded up to a power of two) at MEM_DATA_BEGIN */
+/* with one pointer cycle, word x pointing at word 4101 x + c mod N,  */
+/* then follow it steps times                                                                  */
+/***************************************************************/
+static void gen_chase(gen_t *g, uint32_t mb, uint32_t steps)
+{
+	uint32_t n = 1, top;
+
+	while (n < (uint64_t)mb << 18) {
+		n <<= 1;
+	}
+	emit(g, i_type(0x0f, 0, R_S0, MEM_DATA_BEGIN >> 16));            /* LUI $s0: base */
+	load_imm32(g, R_S1, n - 1);
+	load_imm32(g, R_T1, n);
+	emit(g, r_type(0x25, 0, 0, R_T0, 0));                            /* OR $t0, $0, $0 */
+	g->executed += 2;
+	top = here(g);
+	emit(g, r_type(0x00, 0, R_T0, R_T2, 2));                         /* SLL $t2, $t0, 2 */
+	emit(g, r_type(0x21, R_T0, R_T2, R_T3, 0));                      /* ADDU $t3, $t0, $t2 */
+	emit(g, r_type(0x00, 0, R_T0, R_T2, 12));                        /* SLL $t2, $t0, 12 */
+	emit(g, r_type(0x21, R_T3, R_T2, R_T3, 0));                      /* ADDU $t3, $t3, $t2 */
+	emit(g, i_type(0x09, R_T3, R_T3, GEN_CHASE_C));                  /* ADDIU $t3, $t3, c */
+	emit(g, r_type(0x24, R_T3, R_S1, R_T3, 0));                      /* AND $t3, $t3, $s1 */
+	emit(g, r_type(0x00, 0, R_T3, R_T3, 2));                         /* SLL $t3, $t3, 2 */
+	emit(g, r_type(0x21, R_T3, R_S0, R_T3, 0));                      /* ADDU $t3, $t3, $s0 */
+	emit(g, r_type(0x00, 0, R_T0, R_T2, 2));                         /* SLL $t2, $t0, 2 */
+	emit(g, r_type(0x21, R_T2, R_S0, R_T2, 0));                      /* ADDU $t2, $t2, $s0 */
+	emit(g, i_type(0x2b, R_T2, R_T3, 0));                            /* SW $t3, 0($t2) */
+	emit(g, i_type(0x09, R_T0, R_T0, 1));                            /* ADDIU $t0, $t0, 1 */
+	emit(g, branch(g, 0x05, R_T0, R_T1, top));                       /* BNE $t0, $t1, top */
+	g->executed += 13ull * n;
+
+	steps = (steps + GEN_CHASE_UNROLL - 1) / GEN_CHASE_UNROLL;
+	emit(g, r_type(0x21, R_S0, 0, R_T4, 0));                         /* ADDU $t4, $s0, $0 */
+	load_imm32(g, R_S2, steps);
+	g->executed++;
+	top = here(g);
+	for (n = 0; n < GEN_CHASE_UNROLL; n++) {
+		emit(g, i_type(0x23, R_T4, R_T4, 0));                        /* LW $t4, 0($t4) */
+	}
+	loop_end(g, R_S2, top);
+	g->executed += (uint64_t)steps * (GEN_CHASE_UNROLL + 2);
+}
+
+/***************************************************************/
+/* Call tree: level d (< depth) calls level d + 1 fanout times, keeping */
+/* $ra and its counter on the stack; the leaves do a little ALU work. */
+/* The functions are placed after the exit SYSCALL: main jumps over   */
+/* them with J.                                                                                            */
+/***************************************************************/
+static void gen_calls(gen_t *g, uint32_t depth, uint32_t fanout, uint32_t repeat)
+{
+	uint32_t skip, top, d, i, *calls_at, *entries;
+	uint64_t calls = 1, per_level = 1;
+
+	entries = malloc((depth + 1) * sizeof(uint32_t));
+	calls_at = malloc((depth + 1) * sizeof(uint32_t));
+	if (entries == NULL || calls_at == NULL) {
+		fprintf(stderr, "Error: Out of memory\n");
+		exit(1);
+	}
+	/* main: set up the stack, call level 0 repeat times */
+	load_imm32(g, R_SP, GEN_STACK_TOP);
+	load_imm32(g, R_S4, repeat);
+	calls_at[0] = here(g);
+	emit(g, 0);                                                      /* JAL level 0, patched */
+	loop_end(g, R_S4, calls_at[0]);
+	skip = here(g);
+	emit(g, 0);                                                      /* J past the functions, patched */
+
+	for (d = 0; d < depth; d++) {
+		entries[d] = here(g);
+		emit(g, i_type(0x09, R_SP, R_SP, -8));                       /* ADDIU $sp, $sp, -8 */
+		emit(g, i_type(0x2b, R_SP, R_RA, 0));                        /* SW $ra, 0($sp) */
+		emit(g, i_type(0x2b, R_SP, R_S3, 4));                        /* SW $s3, 4($sp) */
+		emit(g, i_type(0x09, 0, R_S3, fanout));                      /* ADDIU $s3, $0, fanout */
+		top = calls_at[d + 1] = here(g);
+		emit(g, 0);                                                  /* JAL level d + 1, patched */
+		loop_end(g, R_S3, top);
+		emit(g, i_type(0x23, R_SP, R_S3, 4));                        /* LW $s3, 4($sp) */
+		emit(g, i_type(0x23, R_SP, R_RA, 0));                        /* LW $ra, 0($sp) */
+		emit(g, i_type(0x09, R_SP, R_SP, 8));                        /* ADDIU $sp, $sp, 8 */
+		emit(g, r_type(0x08, R_RA, 0, 0, 0));                        /* JR $ra */
+	}
+	entries[depth] = here(g);
+	for (i = 0; i < GEN_LEAF_WORDS; i++) {
+		emit(g, random_alu(g));
+	}
+	emit(g, r_type(0x08, R_RA, 0, 0, 0));                            /* JR $ra */
+
+	for (d = 0; d <= depth; d++) {
+		g->words[(calls_at[d] - MEM_TEXT_BEGIN) / 4] = j_type(0x03, entries[d]);
+	}
+	g->words[(skip - MEM_TEXT_BEGIN) / 4] = j_type(0x02, here(g));
+
+	/* per call of level d: 4 + fanout * 3 + 4 own instructions; leaves GEN_LEAF_WORDS + 1 */
+	for (d = 0; d < depth; d++) {
+		g->executed += (uint64_t)repeat * per_level * (8 + 3ull * fanout);
+		per_level *= fanout;
+		calls += per_level;
+	}
+	g->executed += (uint64_t)repeat * (per_level * (GEN_LEAF_WORDS + 1) + 3) + 1;
+	free(entries);
+	free(calls_at);
+	fprintf(stderr, "calls: %llu per repeat\n", (unsigned long long)calls);
+}
+
+/***************************************************************/
+/* n branches per iteration, each on one bit of an LCG state stepped */
+/* every iteration (about half taken, hard to predict); the bits come */
+/* from the upper half, where the LCG's periods are long                 */
+/***************************************************************/
+static void gen_branches(gen_t *g, uint32_t n, uint32_t iterations)
+{
+	uint32_t top, i;
+
+	load_imm32(g, R_T6, (uint32_t)next_random(g) | 1);
+	load_imm32(g, R_S2, iterations);
+	top = here(g);
+	emit(g, r_type(0x00, 0, R_T6, R_T5, 2));                         /* SLL $t5, $t6, 2 */
+	emit(g, r_type(0x21, R_T6, R_T5, R_T6, 0));                      /* ADDU $t6, $t6, $t5 */
+	emit(g, i_type(0x09, R_T6, R_T6, 0x3039));                       /* ADDIU $t6, $t6, 12345 */
+	for (i = 0; i < n; i++) {
+		emit(g, r_type(0x02, 0, R_T6, R_T7, 16 + i % 16));           /* SRL $t7, $t6, bit */
+		emit(g, i_type(0x0c, R_T7, R_T7, 1));                        /* ANDI $t7, $t7, 1 */
+		emit(g, branch(g, 0x04, R_T7, 0, here(g) + 8));              /* BEQ $t7, $0, +2 */
+		emit(g, i_type(0x09, R_T8, R_T8, 1));                        /* ADDIU $t8, $t8, 1 */
+	}
+	loop_end(g, R_S2, top);
+	/* the ADDIUs run when their bit is set: counted as half */
+	g->executed += (uint64_t)iterations * (3 + 3ull * n + n / 2 + 2);
+}
+
+/***************************************************************/
+/* Parse "<a>x<b>[x<c>]" into up to three numbers; returns how many   */
+/***************************************************************/
+static int parse_dims(const char *text, uint32_t *dims, int max)
+{
+	char *end;
+	int n = 0;
+
+	while (n < max) {
+		dims[n++] = strtoul(text, &end, 10);
+		if (end == text) {
+			return -1;
+		}
+		if (*end == '\0') {
+			return n;
+		}
+		if (*end != 'x') {
+			return -1;
+		}
+		text = end + 1;
+	}
+	return -1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-o <out.in>] [--seed=<n>] [--alu=<words>x<iterations>] [--chase=<MB>[x<steps>]]\n"
+		"       [--calls=<depth>x<fanout>[x<repeat>]] [--branches=<n>x<iterations>]...\n", name);
+	exit(1);
+}
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[])
+{
+	gen_t g = { NULL, 0, 0, 0, 1 };
+	const char *out = NULL;
+	uint32_t dims[3];
+	FILE *fp = stdout;
+	int i, n, sections = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--seed=", 7) == 0) {
+			g.seed = strtoull(argv[i] + 7, NULL, 0);
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			out = argv[++i];
+		}
+	}
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (strcmp(arg, "-o") == 0 || strncmp(arg, "--seed=", 7) == 0) {
+			i += arg[1] == 'o';
+			continue;
+		}
+		else if (strncmp(arg, "--alu=", 6) == 0 && parse_dims(arg + 6, dims, 2) == 2 && dims[1] > 0) {
+			gen_alu(&g, dims[0], dims[1]);
+		}
+		else if (strncmp(arg, "--chase=", 8) == 0 && (n = parse_dims(arg + 8, dims, 2)) > 0
+				&& dims[0] > 0 && dims[0] <= 1024 && (n < 2 || dims[1] > 0)) {
+			gen_chase(&g, dims[0], n > 1 ? dims[1] : 1000000);
+		}
+		else if (strncmp(arg, "--calls=", 8) == 0 && (n = parse_dims(arg + 8, dims, 3)) >= 2
+				&& dims[1] > 0 && dims[1] < 0x8000 && (n < 3 || dims[2] > 0)) {
+			gen_calls(&g, dims[0], dims[1], n > 2 ? dims[2] : 1);
+		}
+		else if (strncmp(arg, "--branches=", 11) == 0 && parse_dims(arg + 11, dims, 2) == 2 && dims[1] > 0) {
+			gen_branches(&g, dims[0], dims[1]);
+		}
+		else {
+			usage(argv[0]);
+		}
+		sections++;
+	}
+	/* default mix when no section is given */
+	if (sections == 0) {
+		gen_alu(&g, 64, 100000);
+		gen_chase(&g, 1, 100000);
+		gen_calls(&g, 8, 2, 100);
+		gen_branches(&g, 16, 10000);
+	}
+	emit(&g, i_type(0x09, 0, R_V0, 10));                             /* ADDIU $v0, $0, 10 */
+	emit(&g, 0x0000000c);                                            /* SYSCALL */
+	g.executed += 2;
+
+	if (out != NULL && (fp = fopen(out, "w")) == NULL) {
+		fprintf(stderr, "Error: Can't create %s\n", out);
+		return 1;
+	}
+	for (i = 0; i < (int)g.count; i++) {
+		fprintf(fp, "%08X\n", g.words[i]);
+	}
+	if (fp != stdout ? fclose(fp) != 0 : fflush(fp) != 0) {
+		fprintf(stderr, "Error: Can't write %s\n", out != NULL ? out : "standard output");
+		return 1;
+	}
+	fprintf(stderr, "%u words (%u KB of text), about %llu instructions\n", g.count, g.count / 256,
+		(unsigned long long)g.executed);
+	free(g.words);
+	return 0;
+}
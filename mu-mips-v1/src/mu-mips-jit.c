@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* x86-64 dynamic binary translator.                                                                 */
+/*                                                                                                                     */
+/* Compiles a translated_block_t into host code in the machine's own */
+/* mmap'd executable cache. Generated code keeps every guest        */
+/* register in m->cpu (rbx holds the machine), inlines ALU ops, branches */
+/* and the TLB hit path of LW/SW, and calls the interpreter       */
+/* handler for everything else (SYSCALL, DIV, sub-word memory ops  */
+/* and TLB misses). A block returns the number of instructions it */
+/* executed, which is short of tb->count only when a store          */
+/* rewrote cached code and the rest of the block is stale.             */
+/***************************************************************/
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+#define JIT_CACHE_SIZE (16u << 20)
+#define JIT_MAX_INSN_BYTES 256      /* worst case for any one guest instruction */
+
+/* x86 register numbers used by the emitter */
+#define X_EAX 0
+#define X_ECX 1
+#define X_EDX 2
+
+/* one per machine; blocks embed that machine's TLB and counter addresses */
+struct jit_cache {
+	uint8_t *base;
+	uint32_t used;
+	uint32_t blocks;
+};
+
+#define REG_DISP(r) ((int32_t)(offsetof(mips_machine, cpu.REGS) + 4 * (r)))
+#define PC_DISP ((int32_t)offsetof(mips_machine, cpu.PC))
+#define HI_DISP ((int32_t)offsetof(mips_machine, cpu.HI))
+#define LO_DISP ((int32_t)offsetof(mips_machine, cpu.LO))
+
+_Static_assert(sizeof(tlb_entry_t) == 16 && offsetof(tlb_entry_t, host) == 8,
+	"inline TLB lookup assumes 16-byte entries with host at +8");
+
+/* write cursor of the block being compiled (compilation is per thread) */
+static __thread uint8_t *emit_p;
+
+static void emit8(uint8_t b) { *emit_p++ = b; }
+static void emit32(uint32_t v) { memcpy(emit_p, &v, 4); emit_p += 4; }
+static void emit64(uint64_t v) { memcpy(emit_p, &v, 8); emit_p += 8; }
+
+/* mov reg, [rbx + disp32] */
+static void emit_load(int reg, int32_t disp)
+{
+	emit8(0x8B); emit8(0x80 | (reg << 3) | 3); emit32(disp);
+}
+
+/* mov [rbx + disp32], reg */
+static void emit_store(int reg, int32_t disp)
+{
+	emit8(0x89); emit8(0x80 | (reg << 3) | 3); emit32(disp);
+}
+
+/* mov dword [rbx + disp32], imm32 */
+static void emit_store_imm(int32_t disp, uint32_t imm)
+{
+	emit8(0xC7); emit8(0x83); emit32(disp); emit32(imm);
+}
+
+/* mov reg, imm32 */
+static void emit_mov_imm(int reg, uint32_t imm)
+{
+	emit8(0xB8 + reg); emit32(imm);
+}
+
+/* <op> eax, ecx for a two-operand ALU opcode (add 01, sub 29, ...) */
+static void emit_alu_eax_ecx(uint8_t opcode)
+{
+	emit8(opcode); emit8(0xC8);
+}
+
+/* placeholder rel32 for a forward jump; returns where to patch */
+static uint8_t *emit_jcc32(uint8_t cc)
+{
+	uint8_t *patch;
+	if (cc == 0xE9) {
+		emit8(0xE9);
+	}
+	else {
+		emit8(0x0F); emit8(cc);
+	}
+	patch = emit_p;
+	emit32(0);
+	return patch;
+}
+
+static void patch_here(uint8_t *patch)
+{
+	uint32_t rel = (uint32_t)(emit_p - (patch + 4));
+	memcpy(patch, &rel, 4);
+}
+
+/* call the interpreter handler for one instruction */
+static void emit_helper(const block_insn_t *insn, uint32_t pc)
+{
+	emit_store_imm(PC_DISP, pc);                       /* handlers read cpu->PC */
+	emit8(0x48); emit8(0x89); emit8(0xDF);             /* mov rdi, rbx */
+	emit8(0x48); emit8(0xBE); emit64((uintptr_t)&insn->d); /* mov rsi, &d */
+	emit8(0x48); emit8(0xB8); emit64((uintptr_t)insn->fn);  /* mov rax, fn */
+	emit8(0xFF); emit8(0xD0);                          /* call rax */
+}
+
+/* after a store handler: leave the block if cached code was rewritten */
+static void emit_code_check(mips_machine *m, uint32_t executed)
+{
+	emit8(0x8B); emit8(0x83); emit32(offsetof(mips_machine, code_generation)); /* mov eax, [rbx+gen] */
+	emit8(0x3D); emit32(m->code_generation);          /* cmp eax, gen */
+	emit8(0x74); emit8(7);                             /* je +7 */
+	emit_mov_imm(X_EAX, executed);                     /* mov eax, executed */
+	emit8(0x5B);                                       /* pop rbx */
+	emit8(0xC3);                                       /* ret */
+}
+
+/* ecx = page offset, rdx = &tlb[index] for the guest address in eax; */
+/* returns the two patch sites that jump to the miss path                 */
+static void emit_tlb_probe(tlb_entry_t *tlb, uint8_t **miss_tag, uint8_t **miss_offset)
+{
+	emit8(0x89); emit8(0xC1);                          /* mov ecx, eax */
+	emit8(0xC1); emit8(0xE9); emit8(PAGE_SHIFT);       /* shr ecx, PAGE_SHIFT */
+	emit8(0x81); emit8(0xE1); emit32(TLB_SIZE - 1);    /* and ecx, TLB_SIZE-1 */
+	emit8(0xC1); emit8(0xE1); emit8(4);                /* shl ecx, 4 */
+	emit8(0x48); emit8(0xBA); emit64((uintptr_t)tlb);  /* mov rdx, tlb */
+	emit8(0x48); emit8(0x01); emit8(0xCA);             /* add rdx, rcx */
+	emit8(0x89); emit8(0xC1);                          /* mov ecx, eax */
+	emit8(0x81); emit8(0xE1); emit32(~PAGE_MASK);      /* and ecx, ~PAGE_MASK */
+	emit8(0x3B); emit8(0x0A);                          /* cmp ecx, [rdx] */
+	*miss_tag = emit_jcc32(0x85);                      /* jne miss */
+	emit8(0x89); emit8(0xC1);                          /* mov ecx, eax */
+	emit8(0x81); emit8(0xE1); emit32(PAGE_MASK);       /* and ecx, PAGE_MASK */
+	emit8(0x81); emit8(0xF9); emit32(PAGE_SIZE - 4);   /* cmp ecx, PAGE_SIZE-4 */
+	*miss_offset = emit_jcc32(0x87);                   /* ja miss */
+	emit8(0x48); emit8(0x8B); emit8(0x52); emit8(8);   /* mov rdx, [rdx+8] */
+}
+
+static void emit_tlb_hit_count()
+{
+	emit8(0x48); emit8(0x83); emit8(0x83); emit32(offsetof(mips_machine, tlb.hits)); emit8(1); /* add qword [rbx+hits], 1 */
+}
+
+/* LW/SW: inline TLB hit path, interpreter handler on a miss */
+static void emit_word_access(mips_machine *m, const block_insn_t *insn, uint32_t pc, int store, uint32_t executed)
+{
+	uint8_t *miss_tag, *miss_offset, *done;
+
+	emit_load(X_EAX, REG_DISP(insn->d.rs));
+	emit8(0x05); emit32(insn->d.imm);                  /* add eax, imm */
+	emit_tlb_probe(store ? m->tlb.write : m->tlb.read, &miss_tag, &miss_offset);
+	if (store) {
+		emit_load(X_EAX, REG_DISP(insn->d.rt));
+		emit8(0x89); emit8(0x04); emit8(0x0A);         /* mov [rdx+rcx], eax */
+	}
+	else {
+		emit8(0x8B); emit8(0x04); emit8(0x0A);         /* mov eax, [rdx+rcx] */
+		emit_store(X_EAX, REG_DISP(insn->d.rt));
+	}
+	emit_tlb_hit_count();
+	done = emit_jcc32(0xE9);
+
+	patch_here(miss_tag);
+	patch_here(miss_offset);
+	emit_helper(insn, pc);
+	if (store) {
+		emit_code_check(m, executed);
+	}
+	patch_here(done);
+}
+
+/* ecx = fall-through, edx = taken, then PC = cmov<cc> ? edx : ecx */
+static void emit_branch_cmov(uint8_t cc, uint32_t pc, uint32_t target)
+{
+	emit_mov_imm(X_ECX, pc + 4);
+	emit_mov_imm(X_EDX, target);
+	emit8(0x0F); emit8(cc); emit8(0xCA);               /* cmov<cc> ecx, edx */
+	emit_store(X_ECX, PC_DISP);
+}
+
+/* Rd = Rs <alu> Rt */
+static void emit_rrr(uint8_t opcode, const decoded_inst_t *d)
+{
+	emit_load(X_EAX, REG_DISP(d->rs));
+	emit_load(X_ECX, REG_DISP(d->rt));
+	emit_alu_eax_ecx(opcode);
+	emit_store(X_EAX, REG_DISP(d->rd));
+}
+
+/* Rt = Rs <alu> imm (add 05, and 25, or 0D, xor 35) */
+static void emit_rri(uint8_t opcode, const decoded_inst_t *d)
+{
+	emit_load(X_EAX, REG_DISP(d->rs));
+	emit8(opcode); emit32(d->imm);
+	emit_store(X_EAX, REG_DISP(d->rt));
+}
+
+/***************************************************************/
+/* Emit one guest instruction. Returns TRUE if it set cpu->PC.      */
+/***************************************************************/
+static int emit_insn(mips_machine *m, const block_insn_t *insn, uint32_t pc, uint32_t executed)
+{
+	const decoded_inst_t *d = &insn->d;
+
+	switch (d->op) {
+		case OP_NOP:
+			return FALSE;
+		case OP_SLL:
+		case OP_SRL:
+		case OP_SRA: /* the interpreter's SRA is a logical shift as well */
+			emit_load(X_EAX, REG_DISP(d->rt));
+			emit8(0xC1); emit8(d->op == OP_SLL ? 0xE0 : 0xE8); emit8(d->sa);
+			emit_store(X_EAX, REG_DISP(d->rd));
+			return FALSE;
+		case OP_ADD:
+		case OP_ADDU:
+			emit_rrr(0x01, d);
+			return FALSE;
+		case OP_SUB:
+		case OP_SUBU:
+			emit_rrr(0x29, d);
+			return FALSE;
+		case OP_AND:
+			emit_rrr(0x21, d);
+			return FALSE;
+		case OP_OR:
+			emit_rrr(0x09, d);
+			return FALSE;
+		case OP_XOR:
+			emit_rrr(0x31, d);
+			return FALSE;
+		case OP_NOR:
+			emit_load(X_EAX, REG_DISP(d->rs));
+			emit_load(X_ECX, REG_DISP(d->rt));
+			emit_alu_eax_ecx(0x09);
+			emit8(0xF7); emit8(0xD0);                  /* not eax */
+			emit_store(X_EAX, REG_DISP(d->rd));
+			return FALSE;
+		case OP_SLT: /* unsigned, as in the interpreter */
+			emit_load(X_EAX, REG_DISP(d->rs));
+			emit_load(X_ECX, REG_DISP(d->rt));
+			emit_alu_eax_ecx(0x39);                    /* cmp eax, ecx */
+			emit8(0x0F); emit8(0x92); emit8(0xC0);     /* setb al */
+			emit8(0x0F); emit8(0xB6); emit8(0xC0);     /* movzx eax, al */
+			emit_store(X_EAX, REG_DISP(d->rd));
+			return FALSE;
+		case OP_ADDI:
+		case OP_ADDIU:
+			emit_rri(0x05, d);
+			return FALSE;
+		case OP_ANDI:
+			emit_rri(0x25, d);
+			return FALSE;
+		case OP_ORI:
+			emit_rri(0x0D, d);
+			return FALSE;
+		case OP_XORI:
+			emit_rri(0x35, d);
+			return FALSE;
+		case OP_SLTI: /* sign of rs - imm, as in the interpreter */
+			emit_load(X_EAX, REG_DISP(d->rs));
+			emit8(0x2D); emit32(d->imm);               /* sub eax, imm */
+			emit8(0x0F); emit8(0x98); emit8(0xC0);     /* sets al */
+			emit8(0x0F); emit8(0xB6); emit8(0xC0);     /* movzx eax, al */
+			emit_store(X_EAX, REG_DISP(d->rt));
+			return FALSE;
+		case OP_LUI:
+			emit_store_imm(REG_DISP(d->rt), d->imm);
+			return FALSE;
+		case OP_MFHI:
+			emit_load(X_EAX, HI_DISP);
+			emit_store(X_EAX, REG_DISP(d->rd));
+			return FALSE;
+		case OP_MFLO:
+			emit_load(X_EAX, LO_DISP);
+			emit_store(X_EAX, REG_DISP(d->rd));
+			return FALSE;
+		case OP_MTHI:
+			emit_load(X_EAX, REG_DISP(d->rs));
+			emit_store(X_EAX, HI_DISP);
+			return FALSE;
+		case OP_MTLO:
+			emit_load(X_EAX, REG_DISP(d->rs));
+			emit_store(X_EAX, LO_DISP);
+			return FALSE;
+		case OP_MULT:
+		case OP_MULTU:
+			emit_load(X_EAX, REG_DISP(d->rs));
+			emit_load(X_ECX, REG_DISP(d->rt));
+			emit8(0xF7); emit8(d->op == OP_MULT ? 0xE9 : 0xE1); /* imul/mul ecx */
+			emit_store(X_EAX, LO_DISP);
+			emit_store(X_EDX, HI_DISP);
+			return FALSE;
+		case OP_LW:
+			emit_word_access(m, insn, pc, FALSE, executed);
+			return FALSE;
+		case OP_SW:
+			emit_word_access(m, insn, pc, TRUE, executed);
+			return FALSE;
+		case OP_SB:
+		case OP_SH:
+			emit_helper(insn, pc);
+			emit_code_check(m, executed);
+			return FALSE;
+		case OP_J:
+			emit_store_imm(PC_DISP, d->target);
+			return TRUE;
+		case OP_JAL:
+			emit_store_imm(REG_DISP(31), pc + 4);
+			emit_store_imm(PC_DISP, d->target);
+			return TRUE;
+		case OP_JR:
+			emit_load(X_EAX, REG_DISP(d->rs));
+			emit_store(X_EAX, PC_DISP);
+			return TRUE;
+		case OP_JALR:
+			emit_load(X_EAX, REG_DISP(d->rs));
+			emit_store_imm(REG_DISP(d->rd), pc + 4);
+			emit_store(X_EAX, PC_DISP);
+			return TRUE;
+		case OP_BEQ:
+		case OP_BNE:
+			emit_load(X_EAX, REG_DISP(d->rs));
+			emit8(0x3B); emit8(0x83); emit32(REG_DISP(d->rt)); /* cmp eax, [rt] */
+			emit_branch_cmov(d->op == OP_BEQ ? 0x44 : 0x45, pc, d->target);
+			return TRUE;
+		case OP_BLTZ:
+		case OP_BGEZ:
+		case OP_BLEZ:
+			emit_load(X_EAX, REG_DISP(d->rs));
+			emit8(0x85); emit8(0xC0);                  /* test eax, eax */
+			emit_branch_cmov(d->op == OP_BLTZ ? 0x48 : d->op == OP_BGEZ ? 0x49 : 0x4E, pc, d->target);
+			return TRUE;
+		case OP_BGTZ: /* the interpreter's condition holds for every value */
+			emit_store_imm(PC_DISP, d->target);
+			return TRUE;
+		case OP_SYSCALL:
+			emit_helper(insn, pc);
+			return TRUE;
+		default:
+			/* LB, LH, DIV, DIVU, unimplemented: run the handler */
+			emit_helper(insn, pc);
+			return FALSE;
+	}
+}
+
+/***************************************************************/
+/* Compile tb into the code cache. Returns NULL when the cache is  */
+/* full; the caller flushes the block cache (and with it this one). */
+/***************************************************************/
+native_block_t jit_compile(mips_machine *m, translated_block_t *tb)
+{
+	struct jit_cache *jit = m->jit;
+	uint8_t *start;
+	uint32_t i, pc = tb->pc;
+	int pc_set = FALSE;
+
+	if (jit == NULL) {
+		jit = m->jit = calloc(1, sizeof(struct jit_cache));
+		if (jit == NULL) {
+			printf("Error: Out of memory allocating JIT code cache\n");
+			exit(-1);
+		}
+		jit->base = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (jit->base == MAP_FAILED) {
+			printf("Error: Can't map JIT code cache\n");
+			exit(-1);
+		}
+	}
+	if (jit->used + (tb->count + 1) * JIT_MAX_INSN_BYTES > JIT_CACHE_SIZE) {
+		return NULL;
+	}
+
+	start = emit_p = jit->base + jit->used;
+	emit8(0x53);                                       /* push rbx */
+	emit8(0x48); emit8(0x89); emit8(0xFB);             /* mov rbx, rdi */
+	for (i = 0; i < tb->count; i++, pc += 4) {
+		pc_set = emit_insn(m, &tb->insns[i], pc, i + 1);
+	}
+	if (!pc_set) {
+		emit_store_imm(PC_DISP, pc);
+	}
+	emit_mov_imm(X_EAX, tb->count);
+	emit8(0x5B);                                       /* pop rbx */
+	emit8(0xC3);                                       /* ret */
+
+	jit->used = (emit_p - jit->base + 15) & ~15u;
+	jit->blocks++;
+	return (native_block_t)start;
+}
+
+/***************************************************************/
+/* Discard all generated code                                                                         */
+/***************************************************************/
+void jit_reset(mips_machine *m)
+{
+	if (m->jit != NULL) {
+		m->jit->used = 0;
+		m->jit->blocks = 0;
+	}
+}
+
+/***************************************************************/
+/* Unmap the machine's code cache                                                                  */
+/***************************************************************/
+void jit_release(mips_machine *m)
+{
+	if (m->jit != NULL) {
+		munmap(m->jit->base, JIT_CACHE_SIZE);
+		free(m->jit);
+		m->jit = NULL;
+	}
+}
+
+int jit_available()
+{
+	return TRUE;
+}
+
+#else
+
+native_block_t jit_compile(mips_machine *m, translated_block_t *tb)
+{
+	(void)m;
+	(void)tb;
+	return NULL;
+}
+
+void jit_reset(mips_machine *m)
+{
+	(void)m;
+}
+
+void jit_release(mips_machine *m)
+{
+	(void)m;
+}
+
+int jit_available()
+{
+	return FALSE;
+}
+
+#endif
@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Lockstep (SIMD) execution.                                                                           */
+/*                                                                                                                     */
+/* Runs many machines loaded with the same program as one group.    */
+/* The group keeps every lane's registers in structure-of-arrays     */
+/* vectors (8 lanes of 32 bits, one AVX2 register) and executes each */
+/* decoded instruction once for all lanes whose PC it is, selected  */
+/* by a lane mask. Each step runs the lowest PC among live lanes, so  */
+/* lanes that took different sides of a branch reconverge where the  */
+/* paths meet. Guest memory stays per lane (each lane is a machine); */
+/* loads and stores walk the active lanes one by one.                   */
+/*                                                                                                                     */
+/* A group whose lanes stay spread over many PCs is split by PC into */
+/* smaller groups; lanes left on their own, lanes that store into   */
+/* the text segment, and lanes that jump outside it are ejected and  */
+/* finish on their machine's scalar engine. Either way every lane     */
+/* ends in exactly the state a scalar run would leave.                  */
+/***************************************************************/
+
+#define LS_VEC_BYTES 32
+#define LS_VEC_LANES (LS_VEC_BYTES / 4)
+#define LS_MAX_VECS (LOCKSTEP_MAX_LANES / LS_VEC_LANES)
+
+#define LS_WINDOW 256                 /* steps between divergence checks */
+#define LS_MIN_LANES 4                /* smaller groups run scalar */
+#define LS_DECODE_SIZE 1024
+#define LS_TLB_SIZE 4                 /* per-lane pages cached by the group */
+
+typedef uint32_t ls_vec __attribute__((vector_size(LS_VEC_BYTES)));
+typedef int32_t ls_svec __attribute__((vector_size(LS_VEC_BYTES)));
+
+/* clone the hot loop for AVX2 hosts, falling back to SSE2 */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define LS_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LS_TARGETS
+#endif
+
+typedef struct {
+	uint32_t pc;                  /* 1 (unaligned) when empty */
+	decoded_inst_t d;
+} ls_decoded_t;
+
+/* Lanes' own TLBs sit at the same offset of page-aligned machines, */
+/* so probing 64 of them in a row thrashes a few cache sets; the group */
+/* keeps a small copy per lane, packed together.                              */
+typedef struct {
+	tlb_entry_t read[LS_TLB_SIZE];
+	tlb_entry_t write[LS_TLB_SIZE];
+	uint64_t hits;                /* added to the machine's count on store */
+} ls_tlb_t;
+
+typedef struct {
+	ls_vec regs[MIPS_REGS][LS_MAX_VECS];
+	ls_vec hi[LS_MAX_VECS], lo[LS_MAX_VECS], pc[LS_MAX_VECS];
+	ls_vec left[LS_MAX_VECS];     /* instructions before the lane's max */
+	ls_vec max[LS_MAX_VECS];
+	ls_vec live[LS_MAX_VECS];     /* all ones while the lane still runs here */
+	ls_vec halted[LS_MAX_VECS];   /* all ones once SYSCALL 10 stopped the lane */
+	mips_machine *lane[LOCKSTEP_MAX_LANES];
+	uint64_t ejected;             /* lanes finished on their own machine */
+	uint32_t lanes, vecs;
+	ls_tlb_t tlb[LOCKSTEP_MAX_LANES];
+	ls_decoded_t decoded[LS_DECODE_SIZE];
+} ls_group_t;
+
+#define LANE(vecs, l) ((vecs)[(l) / LS_VEC_LANES][(l) % LS_VEC_LANES])
+#define BLEND(dst, val, mask) ((dst) = ((val) & (mask)) | ((dst) & ~(mask)))
+
+static void group_run(ls_group_t *g);
+
+/***************************************************************/
+/* Lane memory access: hits in the group's copy of the lane's TLB   */
+/* are served inline, misses go through the machine and refill it     */
+/***************************************************************/
+static inline uint32_t lane_read(ls_group_t *g, uint32_t l, uint32_t address)
+{
+	tlb_entry_t *entry = &g->tlb[l].read[(address >> PAGE_SHIFT) & (LS_TLB_SIZE - 1)];
+	const tlb_entry_t *refill;
+	uint32_t offset = address & PAGE_MASK, value;
+
+	if (entry->tag == (address & ~PAGE_MASK) && offset <= PAGE_SIZE - 4) {
+		g->tlb[l].hits++;
+		memcpy(&value, entry->host + offset, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		value = __builtin_bswap32(value);
+#endif
+		return value;
+	}
+	value = mem_read_32(g->lane[l], address);
+	refill = &g->lane[l]->tlb.read[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+	if (refill->tag == (address & ~PAGE_MASK)) {
+		*entry = *refill;
+	}
+	return value;
+}
+
+static inline void lane_write(ls_group_t *g, uint32_t l, uint32_t address, uint32_t value)
+{
+	tlb_entry_t *entry = &g->tlb[l].write[(address >> PAGE_SHIFT) & (LS_TLB_SIZE - 1)];
+	const tlb_entry_t *refill;
+	uint32_t offset = address & PAGE_MASK;
+
+	if (entry->tag == (address & ~PAGE_MASK) && offset <= PAGE_SIZE - 4) {
+		g->tlb[l].hits++;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		value = __builtin_bswap32(value);
+#endif
+		memcpy(entry->host + offset, &value, 4);
+		return;
+	}
+	mem_write_32(g->lane[l], address, value);
+	/* the miss may have replaced a zero-page read mapping */
+	g->tlb[l].read[(address >> PAGE_SHIFT) & (LS_TLB_SIZE - 1)].tag = TLB_INVALID;
+	refill = &g->lane[l]->tlb.write[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+	if (refill->tag == (address & ~PAGE_MASK)) {
+		*entry = *refill;
+	}
+}
+
+/***************************************************************/
+/* Copy machines[0..n) into a fresh group                                                        */
+/***************************************************************/
+static ls_group_t *group_load(mips_machine **machines, const uint32_t *max, uint32_t n)
+{
+	ls_group_t *g;
+	uint32_t l, r;
+	int live;
+
+	if (posix_memalign((void **)&g, LS_VEC_BYTES, sizeof(ls_group_t)) != 0) {
+		printf("Error: Out of memory allocating lockstep group\n");
+		exit(-1);
+	}
+	memset(g, 0, sizeof(ls_group_t));
+	g->lanes = n;
+	g->vecs = (n + LS_VEC_LANES - 1) / LS_VEC_LANES;
+	for (l = 0; l < LS_DECODE_SIZE; l++) {
+		g->decoded[l].pc = 1;
+	}
+	for (l = 0; l < n; l++) {
+		for (r = 0; r < LS_TLB_SIZE; r++) {
+			g->tlb[l].read[r].tag = TLB_INVALID;
+			g->tlb[l].write[r].tag = TLB_INVALID;
+		}
+	}
+	for (l = 0; l < n; l++) {
+		mips_machine *m = machines[l];
+		g->lane[l] = m;
+		for (r = 0; r < MIPS_REGS; r++) {
+			LANE(g->regs[r], l) = m->cpu.REGS[r];
+		}
+		LANE(g->hi, l) = m->cpu.HI;
+		LANE(g->lo, l) = m->cpu.LO;
+		LANE(g->pc, l) = m->cpu.PC;
+		live = m->run_flag && m->instruction_count < max[l];
+		/* a lane already at its limit keeps its count (max - 0) */
+		LANE(g->max, l) = live ? max[l] : m->instruction_count;
+		LANE(g->left, l) = live ? max[l] - m->instruction_count : 0;
+		LANE(g->live, l) = live ? UINT32_MAX : 0;
+		LANE(g->halted, l) = m->run_flag ? 0 : UINT32_MAX;
+	}
+	return g;
+}
+
+/***************************************************************/
+/* Write lane l back to its machine                                                                    */
+/***************************************************************/
+static void lane_store(ls_group_t *g, uint32_t l)
+{
+	mips_machine *m = g->lane[l];
+	uint32_t r;
+
+	for (r = 0; r < MIPS_REGS; r++) {
+		m->cpu.REGS[r] = LANE(g->regs[r], l);
+	}
+	m->cpu.HI = LANE(g->hi, l);
+	m->cpu.LO = LANE(g->lo, l);
+	m->cpu.PC = LANE(g->pc, l);
+	m->instruction_count = LANE(g->max, l) - LANE(g->left, l);
+	m->run_flag = LANE(g->halted, l) ? FALSE : TRUE;
+	m->tlb.hits += g->tlb[l].hits;
+	g->tlb[l].hits = 0;
+}
+
+/***************************************************************/
+/* Run a machine on its own engine until it halts or reaches max       */
+/***************************************************************/
+static void run_scalar(mips_machine *m, uint32_t max)
+{
+	while (m->run_flag && m->instruction_count < max) {
+		run_cycles(m, max - m->instruction_count);
+	}
+}
+
+/***************************************************************/
+/* Take lane l out of the group and finish it scalar                        */
+/***************************************************************/
+static void lane_eject(ls_group_t *g, uint32_t l)
+{
+	lane_store(g, l);
+	LANE(g->live, l) = 0;
+	g->ejected |= 1ull << l;
+	run_scalar(g->lane[l], LANE(g->max, l));
+}
+
+/***************************************************************/
+/* Decoded instruction at pc, read from the first lane still here.   */
+/* Those lanes hold the same text (a lane that stores into text is  */
+/* ejected), so one copy serves the group.                                     */
+/***************************************************************/
+static const decoded_inst_t *group_decode(ls_group_t *g, uint32_t pc)
+{
+	ls_decoded_t *e = &g->decoded[(pc >> 2) & (LS_DECODE_SIZE - 1)];
+	if (e->pc != pc) {
+		decode_instruction(mem_read_32(g->lane[__builtin_ctzll(~g->ejected)], pc), pc, &e->d);
+		e->pc = pc;
+	}
+	return &e->d;
+}
+
+/***************************************************************/
+/* Split by PC: regroup live lanes that share a PC, finish the rest  */
+/* scalar                                                                                                               */
+/***************************************************************/
+static void group_split(ls_group_t *g)
+{
+	mips_machine *machines[LOCKSTEP_MAX_LANES];
+	uint32_t max[LOCKSTEP_MAX_LANES];
+	uint64_t pending = 0;
+	uint32_t l, k, n, pc;
+	ls_group_t *sub;
+
+	for (l = 0; l < g->lanes; l++) {
+		if (!(g->ejected & (1ull << l))) {
+			lane_store(g, l);
+			if (LANE(g->live, l)) {
+				pending |= 1ull << l;
+			}
+		}
+	}
+	while (pending != 0) {
+		l = __builtin_ctzll(pending);
+		pc = LANE(g->pc, l);
+		n = 0;
+		for (k = l; k < g->lanes; k++) {
+			if ((pending & (1ull << k)) && LANE(g->pc, k) == pc) {
+				machines[n] = g->lane[k];
+				max[n++] = LANE(g->max, k);
+				pending &= ~(1ull << k);
+			}
+		}
+		if (n < LS_MIN_LANES) {
+			for (k = 0; k < n; k++) {
+				run_scalar(machines[k], max[k]);
+			}
+			continue;
+		}
+		sub = group_load(machines, max, n);
+		group_run(sub);
+		free(sub);
+	}
+}
+
+/***************************************************************/
+/* Per-step window statistics and the lowest live PC, gathered while */
+/* the step retires each vector                                                                   */
+/***************************************************************/
+typedef struct {
+	ls_vec active;                /* lanes that executed this window, summed over vectors */
+	ls_vec live;                  /* lanes that could have */
+	ls_vec low;                   /* per slot, lowest PC of a live lane (else all ones) */
+} ls_scan_t;
+
+#define LS_SPLAT(x) ((ls_vec){ 0 } + (uint32_t)(x))
+
+/* Every step loads a vector's lane state into locals once and stores */
+/* it once: going back through g between the op and the bookkeeping  */
+/* would put a store-to-load forward on every vector.                       */
+
+/* lanes of vector v at the step's PC into m */
+#define LS_BEGIN(v) \
+		live_ = g->live[v]; \
+		pc_ = g->pc[v]; \
+		left_ = g->left[v]; \
+		m = live_ & (ls_vec)(pc_ == pcv)
+
+/* count the lanes in m, drop lanes at their limit, fold into the scan */
+#define LS_END(v) do { \
+		ls_vec cand_, lt_; \
+		left_ += m; \
+		live_ &= (ls_vec)(left_ != 0); \
+		g->pc[v] = pc_; \
+		g->left[v] = left_; \
+		g->live[v] = live_; \
+		active -= m; \
+		lives -= live_; \
+		cand_ = pc_ | ~live_; \
+		lt_ = (ls_vec)(cand_ < low); \
+		BLEND(low, cand_, lt_); \
+	} while (0)
+
+/* dst = expr for the lanes at the PC, which then fall through */
+#define LS_VECTOR_OP(dst, expr) \
+	for (v = 0; v < vecs; v++) { \
+		ls_vec value_; \
+		LS_BEGIN(v); \
+		value_ = (expr); \
+		BLEND(pc_, next, m); \
+		LS_END(v); \
+		BLEND(dst, value_, m); \
+	}
+
+/* the PC's lanes go to taken (condition all ones) or fall through */
+#define LS_BRANCH_OP(cond) \
+	for (v = 0; v < vecs; v++) { \
+		ls_vec dest_ = next; \
+		LS_BEGIN(v); \
+		BLEND(dest_, taken, cond); \
+		BLEND(pc_, dest_, m); \
+		LS_END(v); \
+	}
+
+/***************************************************************/
+/* Lowest PC among live lanes, in s->low as a step leaves it              */
+/***************************************************************/
+static void group_scan(ls_group_t *g, ls_scan_t *s)
+{
+	ls_vec cand, lt;
+	uint32_t v;
+
+	s->low = LS_SPLAT(UINT32_MAX);
+	for (v = 0; v < g->vecs; v++) {
+		cand = g->pc[v] | ~g->live[v];
+		lt = (ls_vec)(cand < s->low);
+		BLEND(s->low, cand, lt);
+	}
+}
+
+/***************************************************************/
+static inline __attribute__((always_inline)) uint32_t vec_min(ls_vec x)
+{
+	ls_vec y, lt;
+
+	y = __builtin_shuffle(x, (ls_vec){ 4, 5, 6, 7, 0, 1, 2, 3 });
+	lt = (ls_vec)(y < x);
+	BLEND(x, y, lt);
+	y = __builtin_shuffle(x, (ls_vec){ 2, 3, 0, 1, 6, 7, 4, 5 });
+	lt = (ls_vec)(y < x);
+	BLEND(x, y, lt);
+	y = __builtin_shuffle(x, (ls_vec){ 1, 0, 3, 2, 5, 4, 7, 6 });
+	lt = (ls_vec)(y < x);
+	BLEND(x, y, lt);
+	return x[0];
+}
+
+/***************************************************************/
+/* Execute d at pc for every live lane whose PC it is, in one pass    */
+/* that also retires the lanes and rescans for the next PC. Returns */
+/* the lanes that stored into the text segment (they must leave).    */
+/***************************************************************/
+static inline __attribute__((always_inline)) uint64_t group_step(ls_group_t *g,
+	const decoded_inst_t *d, uint32_t pc, ls_scan_t *s)
+{
+	/* locals: stores to the lanes may alias the decoded record */
+	const uint32_t rs = d->rs, rt = d->rt, rd = d->rd, sa = d->sa;
+	const uint32_t imm = d->imm, op = d->op, vecs = g->vecs;
+	const ls_vec pcv = LS_SPLAT(pc), next = LS_SPLAT(pc + 4), taken = LS_SPLAT(d->target);
+	ls_vec (*R)[LS_MAX_VECS] = g->regs;
+	ls_vec m, cond, live_, pc_, left_;
+	ls_vec low = LS_SPLAT(UINT32_MAX);
+	ls_vec active = s->active, lives = s->live;
+	uint64_t text_stores = 0;
+	uint32_t v, k, l, addr, data;
+
+	switch (op) {
+		case OP_NOP:
+			LS_BRANCH_OP(LS_SPLAT(0));
+			break;
+		case OP_SLL:
+			LS_VECTOR_OP(R[rd][v], R[rt][v] << sa);
+			break;
+		case OP_SRL:
+		case OP_SRA: /* logical, as in the interpreter */
+			LS_VECTOR_OP(R[rd][v], R[rt][v] >> sa);
+			break;
+		case OP_ADD:
+		case OP_ADDU:
+			LS_VECTOR_OP(R[rd][v], R[rs][v] + R[rt][v]);
+			break;
+		case OP_SUB:
+		case OP_SUBU:
+			LS_VECTOR_OP(R[rd][v], R[rs][v] - R[rt][v]);
+			break;
+		case OP_AND:
+			LS_VECTOR_OP(R[rd][v], R[rs][v] & R[rt][v]);
+			break;
+		case OP_OR:
+			LS_VECTOR_OP(R[rd][v], R[rs][v] | R[rt][v]);
+			break;
+		case OP_XOR:
+			LS_VECTOR_OP(R[rd][v], R[rs][v] ^ R[rt][v]);
+			break;
+		case OP_NOR:
+			LS_VECTOR_OP(R[rd][v], ~(R[rs][v] | R[rt][v]));
+			break;
+		case OP_SLT: /* unsigned, as in the interpreter */
+			LS_VECTOR_OP(R[rd][v], (ls_vec)(R[rs][v] < R[rt][v]) & 1);
+			break;
+		case OP_MFHI:
+			LS_VECTOR_OP(R[rd][v], g->hi[v]);
+			break;
+		case OP_MFLO:
+			LS_VECTOR_OP(R[rd][v], g->lo[v]);
+			break;
+		case OP_MTHI:
+			LS_VECTOR_OP(g->hi[v], R[rs][v]);
+			break;
+		case OP_MTLO:
+			LS_VECTOR_OP(g->lo[v], R[rs][v]);
+			break;
+		case OP_ADDI:
+		case OP_ADDIU:
+			LS_VECTOR_OP(R[rt][v], R[rs][v] + imm);
+			break;
+		case OP_SLTI: /* sign of rs - imm, as in the interpreter */
+			LS_VECTOR_OP(R[rt][v], (ls_vec)((ls_svec)(R[rs][v] - imm) < 0) & 1);
+			break;
+		case OP_ANDI:
+			LS_VECTOR_OP(R[rt][v], R[rs][v] & imm);
+			break;
+		case OP_ORI:
+			LS_VECTOR_OP(R[rt][v], R[rs][v] | imm);
+			break;
+		case OP_XORI:
+			LS_VECTOR_OP(R[rt][v], R[rs][v] ^ imm);
+			break;
+		case OP_LUI:
+			LS_VECTOR_OP(R[rt][v], LS_SPLAT(imm));
+			break;
+		case OP_J:
+			LS_BRANCH_OP(LS_SPLAT(UINT32_MAX));
+			break;
+		case OP_JAL:
+			for (v = 0; v < vecs; v++) {
+				LS_BEGIN(v);
+				BLEND(pc_, taken, m);
+				LS_END(v);
+				BLEND(R[31][v], next, m);
+			}
+			break;
+		case OP_JR:
+			for (v = 0; v < vecs; v++) {
+				LS_BEGIN(v);
+				BLEND(pc_, R[rs][v], m);
+				LS_END(v);
+			}
+			break;
+		case OP_JALR:
+			for (v = 0; v < vecs; v++) {
+				LS_BEGIN(v);
+				BLEND(pc_, R[rs][v], m);
+				LS_END(v);
+				BLEND(R[rd][v], next, m);
+			}
+			break;
+		case OP_BEQ:
+			LS_BRANCH_OP((ls_vec)(R[rs][v] == R[rt][v]));
+			break;
+		case OP_BNE:
+			LS_BRANCH_OP((ls_vec)(R[rs][v] != R[rt][v]));
+			break;
+		case OP_BLTZ:
+			LS_BRANCH_OP((ls_vec)((ls_svec)R[rs][v] < 0));
+			break;
+		case OP_BGEZ:
+			LS_BRANCH_OP((ls_vec)((ls_svec)R[rs][v] >= 0));
+			break;
+		case OP_BLEZ:
+			LS_BRANCH_OP((ls_vec)((ls_svec)R[rs][v] <= 0));
+			break;
+		case OP_BGTZ: /* the interpreter's condition holds for every value */
+			LS_BRANCH_OP(LS_SPLAT(UINT32_MAX));
+			break;
+		case OP_SYSCALL:
+			for (v = 0; v < vecs; v++) {
+				LS_BEGIN(v);
+				cond = (ls_vec)(R[2][v] == 0xa) & m;
+				g->halted[v] |= cond;
+				live_ &= ~cond;
+				BLEND(pc_, next, m);
+				LS_END(v);
+			}
+			break;
+		default:
+			/* memory, multiply/divide, unimplemented: lane by lane */
+			for (v = 0; v < vecs; v++) {
+				LS_BEGIN(v);
+				for (k = 0; k < LS_VEC_LANES; k++) {
+					if (!m[k]) {
+						continue;
+					}
+					l = v * LS_VEC_LANES + k;
+					addr = R[rs][v][k] + imm;
+					switch (op) {
+						case OP_LB:
+							data = lane_read(g, l, BYTE_ADDRESS(g->lane[l], addr));
+							R[rt][v][k] = (data & 0x80) ? (data | 0xFFFFFF00) : (data & 0xFF);
+							break;
+						case OP_LH:
+							data = lane_read(g, l, HALF_ADDRESS(g->lane[l], addr));
+							R[rt][v][k] = (data & 0x8000) ? (data | 0xFFFF0000) : (data & 0xFFFF);
+							break;
+						case OP_LW:
+							R[rt][v][k] = lane_read(g, l, addr);
+							break;
+						case OP_SB:
+						case OP_SH:
+						case OP_SW:
+							data = R[rt][v][k];
+							if (op != OP_SW) {
+								uint32_t keep = op == OP_SB ? 0xFFFFFF00 : 0xFFFF0000;
+								addr = op == OP_SB ? BYTE_ADDRESS(g->lane[l], addr) : HALF_ADDRESS(g->lane[l], addr);
+								data = (lane_read(g, l, addr) & keep) | (data & ~keep);
+							}
+							lane_write(g, l, addr, data);
+							if ((uint32_t)(addr + 3 - MEM_TEXT_BEGIN) < TEXT_SIZE + 3) {
+								text_stores |= 1ull << l;
+							}
+							break;
+						default: {
+							/* run the interpreter handler on the lane's machine */
+							mips_machine *lm = g->lane[l];
+							lm->cpu.PC = pc;
+							lm->cpu.REGS[rs] = R[rs][v][k];
+							lm->cpu.REGS[rt] = R[rt][v][k];
+							lm->cpu.REGS[rd] = R[rd][v][k];
+							lm->cpu.HI = g->hi[v][k];
+							lm->cpu.LO = g->lo[v][k];
+							OP_FUNCS[op](lm, d);
+							R[rd][v][k] = lm->cpu.REGS[rd];
+							R[rt][v][k] = lm->cpu.REGS[rt];
+							g->hi[v][k] = lm->cpu.HI;
+							g->lo[v][k] = lm->cpu.LO;
+							break;
+						}
+					}
+				}
+				BLEND(pc_, next, m);
+				LS_END(v);
+			}
+			break;
+	}
+	s->low = low;
+	s->active = active;
+	s->live = lives;
+	return text_stores;
+}
+
+/***************************************************************/
+/* Run the group until every lane has halted, reached its limit,   */
+/* been ejected or been handed to a split group                            */
+/***************************************************************/
+LS_TARGETS
+static void group_run(ls_group_t *g)
+{
+	ls_scan_t s;
+	const decoded_inst_t *d;
+	uint64_t text_stores, active, live;
+	uint32_t k, l, pc, steps = 0;
+
+	memset(&s, 0, sizeof(s));
+	group_scan(g, &s);
+	for (;;) {
+		pc = UINT32_MAX;
+		for (k = 0; k < LS_VEC_LANES; k++) {
+			pc = s.low[k] < pc ? s.low[k] : pc;
+		}
+		if (pc == UINT32_MAX) {
+			/* no lane left, or only lanes that ran off the address space */
+			for (l = 0; l < g->lanes && !LANE(g->live, l); l++) {
+			}
+			if (l == g->lanes) {
+				break;
+			}
+		}
+
+		if (pc - MEM_TEXT_BEGIN >= TEXT_SIZE || (pc & 0x3) != 0) {
+			/* outside the shared text: lanes may see different code */
+			for (l = 0; l < g->lanes; l++) {
+				if (LANE(g->live, l) && LANE(g->pc, l) == pc) {
+					lane_eject(g, l);
+				}
+			}
+			group_scan(g, &s);
+			continue;
+		}
+
+		d = group_decode(g, pc);
+		text_stores = group_step(g, d, pc, &s);
+		if (text_stores != 0) {
+			for (; text_stores != 0; text_stores &= text_stores - 1) {
+				lane_eject(g, __builtin_ctzll(text_stores));
+			}
+			group_scan(g, &s);
+		}
+
+		if (++steps == LS_WINDOW) {
+			/* split when under half the live lanes did useful work */
+			active = live = 0;
+			for (k = 0; k < LS_VEC_LANES; k++) {
+				active += s.active[k];
+				live += s.live[k];
+			}
+			if (active * 2 < live) {
+				group_split(g);
+				return;
+			}
+			steps = 0;
+			s.active = s.live = LS_SPLAT(0);
+		}
+	}
+
+	for (l = 0; l < g->lanes; l++) {
+		if (!(g->ejected & (1ull << l))) {
+			lane_store(g, l);
+		}
+	}
+}
+
+/***************************************************************/
+/* Run machines[0..n), all loaded with the same program, until each */
+/* halts or its instruction count reaches max[i]. Final machine state */
+/* is identical to running each one on its own.                              */
+/***************************************************************/
+void lockstep_run(mips_machine **machines, const uint32_t *max, uint32_t n)
+{
+	ls_group_t *g;
+	uint32_t i, chunk;
+
+	for (i = 0; i < n; i += chunk) {
+		chunk = n - i < LOCKSTEP_MAX_LANES ? n - i : LOCKSTEP_MAX_LANES;
+		if (chunk < LS_MIN_LANES) {
+			for (; chunk > 0; chunk--, i++) {
+				run_scalar(machines[i], max[i]);
+			}
+			break;
+		}
+		g = group_load(machines + i, max + i, chunk);
+		group_run(g);
+		free(g);
+	}
+}
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/* --save: checkpoint the interactive machine when the simulator exits */
+static mips_machine *save_machine;
+static const char *save_path;
+
+static void save_at_exit()
+{
+	checkpoint_save(save_machine, save_path);
+}
+
+/* --record: close the replay log (final state hash) at exit */
+static mips_machine *record_machine;
+
+static void record_at_exit()
+{
+	record_stop(record_machine);
+}
+
+/* trace binary/packed: drain and close the trace file at exit */
+static mips_machine *trace_machine;
+
+static void trace_at_exit()
+{
+	btrace_close(trace_machine);
+}
+
+/* --profile: write the callgrind profile at exit */
+static mips_machine *profile_machine;
+static const char *profile_path;
+
+static void profile_at_exit()
+{
+	profile_save(profile_machine, profile_path);
+}
+
+/* --stats: write the statistics as JSON at exit */
+static mips_machine *stats_machine;
+static const char *stats_path;
+
+static void stats_at_exit()
+{
+	stats_save_json(stats_machine, stats_path);
+}
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[]) {                              
+	int i;
+	const char *input = NULL, *aot_output = NULL;
+	const char *batch_manifest = NULL, *batch_out = "batch-out";
+	const char *restore_path = NULL, *record_path = NULL, *replay_path = NULL;
+	int engine_set = FALSE;
+	int batch_threads = 0, batch_lockstep = 0;
+	mips_machine *machine;
+
+	printf("\n**************************\n");
+	printf("Welcome to MU-MIPS SIM...\n");
+	printf("**************************\n\n");
+	
+	machine = machine_create();
+	machine->trace_level = TRACE_FULL;
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--trace=binary:", 15) == 0 || strncmp(argv[i], "--trace=packed:", 15) == 0) {
+			if (set_binary_trace(machine, argv[i] + 15, argv[i][8] == 'p') != 0) {
+				exit(1);
+			}
+		}
+		else if (strncmp(argv[i], "--trace=", 8) == 0) {
+			if (set_trace_level(machine, argv[i] + 8) != 0) {
+				printf("Error: Invalid trace level %s (use off, pc, full, binary:<file> or packed:<file>).\n\n", argv[i] + 8);
+				exit(1);
+			}
+		}
+		else if (strncmp(argv[i], "--engine=", 9) == 0) {
+			if (set_engine(machine, argv[i] + 9) != 0) {
+				printf("Error: Invalid engine %s (use switch, threaded, block or jit).\n\n", argv[i] + 9);
+				exit(1);
+			}
+			engine_set = TRUE;
+		}
+		else if (strncmp(argv[i], "--aot=", 6) == 0) {
+			aot_output = argv[i] + 6;
+		}
+		else if (strncmp(argv[i], "--batch=", 8) == 0) {
+			batch_manifest = argv[i] + 8;
+		}
+		else if (strncmp(argv[i], "--save=", 7) == 0) {
+			save_path = argv[i] + 7;
+		}
+		else if (strncmp(argv[i], "--restore=", 10) == 0) {
+			restore_path = argv[i] + 10;
+		}
+		else if (strncmp(argv[i], "--stats=", 8) == 0) {
+			stats_path = argv[i] + 8;
+		}
+		else if (strncmp(argv[i], "--profile=", 10) == 0) {
+			profile_path = argv[i] + 10;
+		}
+		else if (strncmp(argv[i], "--record=", 9) == 0) {
+			record_path = argv[i] + 9;
+		}
+		else if (strncmp(argv[i], "--replay=", 9) == 0) {
+			replay_path = argv[i] + 9;
+		}
+		else if (strncmp(argv[i], "--out=", 6) == 0) {
+			batch_out = argv[i] + 6;
+		}
+		else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+			batch_threads = atoi(argv[i] + 7);
+		}
+		else if (strcmp(argv[i], "--verbose") == 0) {
+			machine->verbose = TRUE;
+		}
+		else if (strcmp(argv[i], "--lockstep") == 0) {
+			batch_lockstep = LOCKSTEP_MAX_LANES;
+		}
+		else if (strncmp(argv[i], "--lockstep=", 11) == 0) {
+			batch_lockstep = atoi(argv[i] + 11);
+			if (batch_lockstep < 1 || batch_lockstep > LOCKSTEP_MAX_LANES) {
+				printf("Error: Invalid lockstep width %s (use 1 to %d).\n\n", argv[i] + 11, LOCKSTEP_MAX_LANES);
+				exit(1);
+			}
+		}
+		else {
+			input = argv[i];
+		}
+	}
+
+	trace_machine = machine;
+	atexit(trace_at_exit);
+
+	if (batch_manifest != NULL) {
+		exit(batch_run(batch_manifest, batch_out, batch_threads, machine->engine, batch_lockstep) == 0 ? 0 : 1);
+	}
+
+	if (replay_path != NULL) {
+		/* the log names its program or checkpoint; run it as fast as we can */
+		if (!engine_set) {
+			machine->engine = jit_available() ? ENGINE_JIT : ENGINE_BLOCK;
+		}
+		exit(replay_run(machine, replay_path) == 0 ? 0 : 1);
+	}
+
+	if (input == NULL && restore_path == NULL) {
+		printf("Error: You should provide input file.\nUsage: %s [--trace=off|pc|full|binary:<file>|packed:<file>] [--engine=switch|threaded|block|jit] [--aot=<out.c>] [--save=<checkpoint>] [--record=<log>] [--profile=<callgrind.out>] [--stats=<json|->] [--verbose] <input program (.in or ELF)> \n"
+			"       %s [options] --restore=<checkpoint>\n"
+			"       %s [--engine=...] --replay=<log>\n"
+			"       %s [--engine=...] --batch=<manifest> [--jobs=<threads>] [--lockstep[=<lanes>]] [--out=<dir>]\n\n", argv[0], argv[0], argv[0], argv[0]);
+		exit(1);
+	}
+
+	if (restore_path != NULL) {
+		/* the checkpoint carries its program (and file name for reset) */
+		if (checkpoint_restore(machine, restore_path) != 0) {
+			exit(-1);
+		}
+	}
+	else {
+		if (set_prog_file(machine, input) != 0) {
+			printf("Error: Program file name too long: %s\n\n", input);
+			exit(1);
+		}
+		if (load_program(machine) != 0) {
+			exit(-1);
+		}
+	}
+	if (aot_output != NULL) {
+		exit(aot_translate(machine, aot_output) == 0 ? 0 : 1);
+	}
+	if (save_path != NULL) {
+		save_machine = machine;
+		atexit(save_at_exit);
+	}
+	history_enable(machine);
+	if (stats_path != NULL) {
+		stats_machine = machine;
+		atexit(stats_at_exit);
+	}
+	if (profile_path != NULL) {
+		profile_start(machine);
+		profile_machine = machine;
+		atexit(profile_at_exit);
+	}
+	if (record_path != NULL) {
+		if (record_start(machine, record_path, restore_path) != 0) {
+			exit(-1);
+		}
+		record_machine = machine;
+		atexit(record_at_exit);
+	}
+	help();
+	while (1){
+		handle_command(machine);
+	}
+	return 0;
+}
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Guest profiler reports.                                                                                */
+/*                                                                                                                     */
+/* Counting happens inline in the interpreter (profile_count in       */
+/* mu-mips.c); this file keeps the call arcs and writes the results.  */
+/* Functions are the PC profiling started at plus every call target  */
+/* seen; an instruction belongs to the nearest function at or below  */
+/* it (named by ELF symbols when the program has them). profile_save */
+/* writes callgrind format (callgrind_annotate, kcachegrind) with one */
+/* cost line per instruction, each preceded by a comment with its      */
+/* disassembly.                                                                                          */
+/***************************************************************/
+
+#define PROFILE_DEFAULT_TOP 10
+#define PROFILE_NAME_MAX 256            /* function names: symbol+offset */
+
+typedef struct {
+	uint32_t pc;
+	uint64_t count;
+} profile_hit_t;
+
+typedef struct {
+	uint32_t entry;
+	uint64_t self, calls, inclusive;
+} profile_fn_t;
+
+static profile_t *profile_get(mips_machine *m)
+{
+	if (m->profile == NULL) {
+		m->profile = calloc(1, sizeof(profile_t));
+		if (m->profile == NULL) {
+			printf("Error: Out of memory starting the profiler\n");
+			exit(-1);
+		}
+	}
+	return m->profile;
+}
+
+/***************************************************************/
+/* Start (or resume) counting m's instructions                                         */
+/***************************************************************/
+void profile_start(mips_machine *m)
+{
+	profile_t *p = profile_get(m);
+
+	if (p->total == 0) {
+		p->root = m->cpu.PC;
+	}
+	p->on = TRUE;
+}
+
+/***************************************************************/
+/* Stop counting; the counts are kept for reports                               */
+/***************************************************************/
+void profile_stop(mips_machine *m)
+{
+	if (m->profile != NULL) {
+		m->profile->on = FALSE;
+	}
+}
+
+/***************************************************************/
+/* Drop all counts, arcs and frames (counting stays on or off)          */
+/***************************************************************/
+void profile_clear(mips_machine *m)
+{
+	profile_t *p = m->profile;
+	uint32_t i;
+
+	if (p == NULL) {
+		return;
+	}
+	for (i = 0; i < TEXT_PAGES; i++) {
+		free(p->counts[i]);
+		p->counts[i] = NULL;
+	}
+	free(p->arcs);
+	free(p->stack);
+	p->arcs = NULL;
+	p->stack = NULL;
+	p->num_arcs = p->arc_capacity = 0;
+	p->depth = p->stack_capacity = 0;
+	p->total = p->outside = 0;
+	p->root = m->cpu.PC;
+}
+
+void profile_release(mips_machine *m)
+{
+	profile_clear(m);
+	free(m->profile);
+	m->profile = NULL;
+}
+
+/***************************************************************/
+/* Count pc whose counter page isn't allocated yet, or that lies      */
+/* outside the text segment                                                                       */
+/***************************************************************/
+void profile_miss(mips_machine *m, uint32_t pc)
+{
+	profile_t *p = m->profile;
+	uint32_t index = (pc - MEM_TEXT_BEGIN) >> 2;
+
+	if (index >= TEXT_SIZE / 4) {
+		p->outside++;
+		return;
+	}
+	p->counts[index / PROFILE_PAGE_SLOTS] = calloc(PROFILE_PAGE_SLOTS, sizeof(uint64_t));
+	if (p->counts[index / PROFILE_PAGE_SLOTS] == NULL) {
+		printf("Error: Out of memory profiling\n");
+		exit(-1);
+	}
+	p->counts[index / PROFILE_PAGE_SLOTS][index % PROFILE_PAGE_SLOTS]++;
+}
+
+static inline uint32_t arc_hash(uint32_t site, uint32_t callee)
+{
+	return (site * 0x9e3779b1u) ^ (callee * 0x85ebca6bu);
+}
+
+/***************************************************************/
+/* The arc (site, callee), added if new                                                       */
+/***************************************************************/
+static profile_arc_t *arc_find(profile_t *p, uint32_t site, uint32_t callee)
+{
+	profile_arc_t *old = p->arcs, *arc;
+	uint32_t capacity = p->arc_capacity, i, h;
+
+	if (2 * (p->num_arcs + 1) > p->arc_capacity) {
+		p->arc_capacity = capacity ? capacity * 2 : 256;
+		p->arcs = calloc(p->arc_capacity, sizeof(profile_arc_t));
+		if (p->arcs == NULL) {
+			printf("Error: Out of memory profiling\n");
+			exit(-1);
+		}
+		for (i = 0; i < capacity; i++) {
+			if (old[i].calls != 0) {
+				for (h = arc_hash(old[i].site, old[i].callee); p->arcs[h & (p->arc_capacity - 1)].calls != 0; h++);
+				p->arcs[h & (p->arc_capacity - 1)] = old[i];
+			}
+		}
+		free(old);
+	}
+	for (h = arc_hash(site, callee); ; h++) {
+		arc = &p->arcs[h & (p->arc_capacity - 1)];
+		if (arc->calls == 0) {
+			arc->site = site;
+			arc->callee = callee;
+			p->num_arcs++;
+			return arc;
+		}
+		if (arc->site == site && arc->callee == callee) {
+			return arc;
+		}
+	}
+}
+
+/***************************************************************/
+/* After the JAL/JALR/JR $31 d at pc ran: push or pop call frames     */
+/***************************************************************/
+void profile_branch(mips_machine *m, const decoded_inst_t *d, uint32_t pc)
+{
+	profile_t *p = m->profile;
+	profile_frame_t *frame;
+	uint32_t i;
+
+	if (d->op == OP_JR) {
+		/* return to the innermost frame expecting this address; frames */
+		/* above it were left without a return (longjmp-style)               */
+		for (i = p->depth; i > 0 && p->stack[i - 1].ret != m->cpu.PC; i--);
+		if (i == 0) {
+			return;
+		}
+		while (p->depth >= i) {
+			frame = &p->stack[--p->depth];
+			arc_find(p, frame->site, frame->callee)->inclusive += p->total - frame->start;
+		}
+		return;
+	}
+
+	arc_find(p, pc, m->cpu.PC)->calls++;
+	if (p->depth == p->stack_capacity) {
+		if (p->depth == PROFILE_MAX_DEPTH) {
+			memmove(p->stack, p->stack + PROFILE_MAX_DEPTH / 2, PROFILE_MAX_DEPTH / 2 * sizeof(profile_frame_t));
+			p->depth -= PROFILE_MAX_DEPTH / 2;
+		}
+		else {
+			p->stack_capacity = p->stack_capacity ? p->stack_capacity * 2 : 64;
+			p->stack = realloc(p->stack, p->stack_capacity * sizeof(profile_frame_t));
+			if (p->stack == NULL) {
+				printf("Error: Out of memory profiling\n");
+				exit(-1);
+			}
+		}
+	}
+	frame = &p->stack[p->depth++];
+	frame->ret = pc + 4;
+	frame->site = pc;
+	frame->callee = m->cpu.PC;
+	frame->start = p->total;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int compare_arc_site(const void *a, const void *b)
+{
+	const profile_arc_t *x = a, *y = b;
+	return x->site != y->site ? (x->site < y->site ? -1 : 1) : compare_u32(&x->callee, &y->callee);
+}
+
+static int compare_hit_count(const void *a, const void *b)
+{
+	const profile_hit_t *x = a, *y = b;
+	return x->count != y->count ? (x->count > y->count ? -1 : 1) : compare_u32(&x->pc, &y->pc);
+}
+
+static int compare_fn_self(const void *a, const void *b)
+{
+	const profile_fn_t *x = a, *y = b;
+	return x->self != y->self ? (x->self > y->self ? -1 : 1) : compare_u32(&x->entry, &y->entry);
+}
+
+/***************************************************************/
+/* The profile gathered into sorted arrays: executed PCs (by address), */
+/* arcs (by call site, with frames still open counted up to now) and  */
+/* functions (by entry)                                                                               */
+/***************************************************************/
+typedef struct {
+	profile_hit_t *hits;
+	uint32_t num_hits;
+	profile_arc_t *arcs;
+	uint32_t num_arcs;
+	profile_fn_t *fns;
+	uint32_t num_fns;
+} profile_view_t;
+
+/* index of the function pc belongs to */
+static uint32_t fn_of(const profile_view_t *v, uint32_t pc)
+{
+	uint32_t lo = 0, hi = v->num_fns, mid;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (v->fns[mid].entry <= pc) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void profile_view(profile_t *p, profile_view_t *v)
+{
+	uint32_t *entries, i, j, n, page;
+	profile_arc_t *arc;
+
+	memset(v, 0, sizeof(*v));
+	for (page = 0; page < TEXT_PAGES; page++) {
+		for (i = 0; p->counts[page] != NULL && i < PROFILE_PAGE_SLOTS; i++) {
+			v->num_hits += p->counts[page][i] != 0;
+		}
+	}
+	v->hits = malloc((v->num_hits + 1) * sizeof(profile_hit_t));
+	v->arcs = malloc((p->num_arcs + 1) * sizeof(profile_arc_t));
+	entries = malloc((p->num_arcs + 1) * sizeof(uint32_t));
+	v->fns = calloc(p->num_arcs + 1, sizeof(profile_fn_t));
+	if (v->hits == NULL || v->arcs == NULL || entries == NULL || v->fns == NULL) {
+		printf("Error: Out of memory writing the profile\n");
+		exit(-1);
+	}
+	for (n = 0, page = 0; page < TEXT_PAGES; page++) {
+		for (i = 0; p->counts[page] != NULL && i < PROFILE_PAGE_SLOTS; i++) {
+			if (p->counts[page][i] != 0) {
+				v->hits[n].pc = MEM_TEXT_BEGIN + 4 * (page * PROFILE_PAGE_SLOTS + i);
+				v->hits[n++].count = p->counts[page][i];
+			}
+		}
+	}
+
+	for (i = 0; i < p->arc_capacity; i++) {
+		if (p->arcs[i].calls != 0) {
+			v->arcs[v->num_arcs++] = p->arcs[i];
+		}
+	}
+	qsort(v->arcs, v->num_arcs, sizeof(profile_arc_t), compare_arc_site);
+	for (i = 0; i < p->depth; i++) {
+		arc = bsearch(&(profile_arc_t){ p->stack[i].site, p->stack[i].callee, 0, 0 }, v->arcs, v->num_arcs,
+			sizeof(profile_arc_t), compare_arc_site);
+		arc->inclusive += p->total - p->stack[i].start;
+	}
+
+	entries[0] = p->root;
+	for (i = 0; i < v->num_arcs; i++) {
+		entries[i + 1] = v->arcs[i].callee;
+	}
+	qsort(entries, v->num_arcs + 1, sizeof(uint32_t), compare_u32);
+	for (i = 0; i <= v->num_arcs; i++) {
+		if (v->num_fns == 0 || entries[i] != v->fns[v->num_fns - 1].entry) {
+			v->fns[v->num_fns++].entry = entries[i];
+		}
+	}
+	free(entries);
+
+	for (i = 0; i < v->num_hits; i++) {
+		v->fns[fn_of(v, v->hits[i].pc)].self += v->hits[i].count;
+	}
+	for (i = 0; i < v->num_arcs; i++) {
+		j = fn_of(v, v->arcs[i].callee);
+		v->fns[j].calls += v->arcs[i].calls;
+		v->fns[j].inclusive += v->arcs[i].inclusive;
+	}
+}
+
+static void profile_view_free(profile_view_t *v)
+{
+	free(v->hits);
+	free(v->arcs);
+	free(v->fns);
+}
+
+/***************************************************************/
+/* Print the hottest top functions and instructions of m's profile   */
+/***************************************************************/
+void profile_report(mips_machine *m, uint32_t top)
+{
+	profile_t *p = m->profile;
+	profile_view_t v;
+	uint32_t i;
+	char name[PROFILE_NAME_MAX];
+
+	if (p == NULL || p->total == 0) {
+		printf("No profile (profile on, then run).\n\n");
+		return;
+	}
+	if (top == 0) {
+		top = PROFILE_DEFAULT_TOP;
+	}
+	profile_view(p, &v);
+	printf("Profile: %llu instructions, %u functions, %u call arcs", (unsigned long long)p->total, v.num_fns, v.num_arcs);
+	if (p->outside != 0) {
+		printf(", %llu outside the text segment", (unsigned long long)p->outside);
+	}
+	printf("%s\n", p->on ? "" : " (stopped)");
+
+	qsort(v.fns, v.num_fns, sizeof(profile_fn_t), compare_fn_self);
+	printf("-------------------------------------\n");
+	printf("%12s %7s %10s %12s  Function\n", "Self", "%", "Calls", "Inclusive");
+	for (i = 0; i < v.num_fns && i < top && v.fns[i].self != 0; i++) {
+		printf("%12llu %6.2f%% %10llu %12llu  0x%08x", (unsigned long long)v.fns[i].self,
+			100.0 * v.fns[i].self / p->total, (unsigned long long)v.fns[i].calls,
+			(unsigned long long)v.fns[i].inclusive, v.fns[i].entry);
+		printf(m->num_symbols ? " %s\n" : "\n", symbol_format(m, v.fns[i].entry, name, sizeof(name)));
+	}
+
+	qsort(v.hits, v.num_hits, sizeof(profile_hit_t), compare_hit_count);
+	printf("-------------------------------------\n");
+	printf("%12s %7s  Instruction\n", "Count", "%");
+	for (i = 0; i < v.num_hits && i < top; i++) {
+		printf("%12llu %6.2f%%  [0x%08x]\t", (unsigned long long)v.hits[i].count,
+			100.0 * v.hits[i].count / p->total, v.hits[i].pc);
+		if (m->num_symbols) {
+			printf("%s\t", symbol_format(m, v.hits[i].pc, name, sizeof(name)));
+		}
+		print_instruction(m, v.hits[i].pc);
+	}
+	printf("\n");
+	profile_view_free(&v);
+}
+
+/***************************************************************/
+/* Write m's profile to path in callgrind format; returns 0 or -1   */
+/***************************************************************/
+int profile_save(mips_machine *m, const char *path)
+{
+	profile_t *p = m->profile;
+	profile_view_t v;
+	FILE *fp;
+	uint32_t fn, hit = 0, arc = 0;
+	char name[PROFILE_NAME_MAX];
+	int r;
+
+	if (p == NULL) {
+		printf("No profile (profile on, then run).\n\n");
+		return -1;
+	}
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		printf("Error: Can't create profile %s\n", path);
+		return -1;
+	}
+	profile_view(p, &v);
+	fprintf(fp, "# callgrind format\n");
+	fprintf(fp, "version: 1\ncreator: mu-mips\ncmd: %s\n", m->prog_file);
+	fprintf(fp, "positions: instr\nevents: Ir\n");
+	fprintf(fp, "summary: %llu\n\n", (unsigned long long)p->total);
+	fprintf(fp, "ob=%s\nfl=%s\n", m->prog_file, m->prog_file);
+
+	/* hits and arcs are sorted by address, so both walk the functions in order */
+	for (fn = 0; fn < v.num_fns; fn++) {
+		if (v.fns[fn].self == 0 && (arc >= v.num_arcs || fn_of(&v, v.arcs[arc].site) != fn)) {
+			continue;
+		}
+		fprintf(fp, "\nfn=%s\n", symbol_format(m, v.fns[fn].entry, name, sizeof(name)));
+		while ((hit < v.num_hits && fn_of(&v, v.hits[hit].pc) == fn)
+				|| (arc < v.num_arcs && fn_of(&v, v.arcs[arc].site) == fn)) {
+			if (hit < v.num_hits && fn_of(&v, v.hits[hit].pc) == fn
+					&& (arc >= v.num_arcs || fn_of(&v, v.arcs[arc].site) != fn || v.hits[hit].pc <= v.arcs[arc].site)) {
+				fprintf(fp, "# ");
+				fprint_instruction_word(fp, v.hits[hit].pc, mem_read_32(m, v.hits[hit].pc));
+				fprintf(fp, "0x%x %llu\n", v.hits[hit].pc, (unsigned long long)v.hits[hit].count);
+				hit++;
+			}
+			else {
+				fprintf(fp, "cfn=%s\ncalls=%llu 0x%x\n0x%x %llu\n",
+					symbol_format(m, v.fns[fn_of(&v, v.arcs[arc].callee)].entry, name, sizeof(name)),
+					(unsigned long long)v.arcs[arc].calls, v.arcs[arc].callee, v.arcs[arc].site,
+					(unsigned long long)v.arcs[arc].inclusive);
+				arc++;
+			}
+		}
+	}
+	fprintf(fp, "\ntotals: %llu\n", (unsigned long long)p->total);
+	r = fclose(fp);
+	if (r != 0) {
+		printf("Error: Can't write profile %s\n", path);
+	}
+	else if (!m->quiet) {
+		printf("Profile written to %s: %llu instructions, %u functions, %u call arcs.\n\n",
+			path, (unsigned long long)p->total, v.num_fns, v.num_arcs);
+	}
+	profile_view_free(&v);
+	return r == 0 ? 0 : -1;
+}
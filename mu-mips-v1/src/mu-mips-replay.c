@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Record/replay log.                                                                                            */
+/*                                                                                                                     */
+/* A recorded session logs everything that changes the machine from */
+/* outside the program (input/high/low, reset, restore) together with */
+/* state hashes (see state_hash) taken every REPLAY_HASH_INTERVAL     */
+/* instructions, when the program halts and at exit. Replay starts   */
+/* from the same program or checkpoint, runs untraced on the fastest  */
+/* engine up to each event's instruction count, applies the event   */
+/* and checks every hash, so a run can be reproduced and verified   */
+/* without the per-instruction trace. New input sources (such as    */
+/* syscall input data) get their own event type.                            */
+/*                                                                                                                     */
+/* Little-endian throughout:                                                                            */
+/*   header: "MUMIPSRL", u32 version, u32 hash interval,                  */
+/*           u32 start (REPLAY_START_*), u32 length, start path          */
+/*   events: u8 type, u8 register, u16 path length, u32 instruction */
+/*           count, u64 value (register value or state hash), path    */
+/* RESET and RESTORE events carry the hash of the state they leave  */
+/* and are applied without running to their count. A REWIND event   */
+/* (rstep/rcontinue) moves to its count, back through the history  */
+/* or forward, and carries the hash of the state there.                  */
+/***************************************************************/
+
+#define REPLAY_MAGIC "MUMIPSRL"
+#define REPLAY_VERSION 1
+#define REPLAY_EVENT_BYTES 16
+
+enum { REPLAY_START_PROGRAM, REPLAY_START_CHECKPOINT };
+
+static const char *const REPLAY_EVENT_NAME[] = { "input", "high", "low", "reset", "restore", "hash", "end", "rewind" };
+
+typedef struct replay_log {
+	FILE *fp;
+	char *path;
+	uint32_t events;
+} replay_log_t;
+
+typedef struct {
+	uint8_t type, reg;
+	uint16_t length;
+	uint32_t count;
+	uint64_t value;
+	char path[PROG_FILE_MAX];
+} replay_event_t;
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/***************************************************************/
+/* Append one event; exits if the log can't be written                      */
+/***************************************************************/
+static void record_write(replay_log_t *log, int type, uint32_t reg, uint32_t count, uint64_t value, const char *path)
+{
+	uint8_t buf[REPLAY_EVENT_BYTES];
+	size_t length = path != NULL ? strlen(path) : 0;
+
+	buf[0] = type;
+	buf[1] = reg;
+	buf[2] = length;
+	buf[3] = length >> 8;
+	put_le32(buf + 4, count);
+	put_le32(buf + 8, (uint32_t)value);
+	put_le32(buf + 12, (uint32_t)(value >> 32));
+	if (fwrite(buf, sizeof(buf), 1, log->fp) != 1
+			|| (length > 0 && fwrite(path, length, 1, log->fp) != 1)
+			|| fflush(log->fp) != 0) {
+		printf("Error: Can't write replay log %s\n", log->path);
+		exit(-1);
+	}
+	log->events++;
+}
+
+/***************************************************************/
+/* Start recording m, which was just loaded from its program file or */
+/* (checkpoint != NULL) restored from a checkpoint, into path;            */
+/* returns 0, or -1 if the log can't be created                                */
+/***************************************************************/
+int record_start(mips_machine *m, const char *path, const char *checkpoint)
+{
+	replay_log_t *log;
+	const char *start = checkpoint != NULL ? checkpoint : m->prog_file;
+	uint8_t header[24];
+	size_t length = strlen(start);
+
+	log = calloc(1, sizeof(replay_log_t));
+	if (log == NULL || (log->path = strdup(path)) == NULL) {
+		printf("Error: Out of memory starting replay log\n");
+		exit(-1);
+	}
+	log->fp = fopen(path, "wb");
+	if (log->fp == NULL) {
+		printf("Error: Can't create replay log %s\n", path);
+		free(log->path);
+		free(log);
+		return -1;
+	}
+	memcpy(header, REPLAY_MAGIC, 8);
+	put_le32(header + 8, REPLAY_VERSION);
+	put_le32(header + 12, REPLAY_HASH_INTERVAL);
+	put_le32(header + 16, checkpoint != NULL ? REPLAY_START_CHECKPOINT : REPLAY_START_PROGRAM);
+	put_le32(header + 20, length);
+	if (fwrite(header, sizeof(header), 1, log->fp) != 1 || fwrite(start, length, 1, log->fp) != 1) {
+		printf("Error: Can't write replay log %s\n", path);
+		exit(-1);
+	}
+	m->record = log;
+	record_write(log, REPLAY_HASH, 0, m->instruction_count, state_hash(m), NULL);
+	return 0;
+}
+
+/***************************************************************/
+/* Log an event of m that just happened (no-op unless recording):  */
+/* INPUT/HIGH/LOW with the value set, HASH/END with the current      */
+/* state, RESET/RESTORE (path: the checkpoint)/REWIND with the state */
+/* they left                                                                                                      */
+/***************************************************************/
+void record_event(mips_machine *m, int type, uint32_t reg, uint32_t value, const char *path)
+{
+	uint64_t v = value;
+
+	if (m->record == NULL) {
+		return;
+	}
+	if (type != REPLAY_INPUT && type != REPLAY_HI && type != REPLAY_LO) {
+		v = state_hash(m);
+	}
+	record_write(m->record, type, reg, m->instruction_count, v, path);
+}
+
+/***************************************************************/
+/* Instructions run_cycles may execute before the next hash point  */
+/***************************************************************/
+uint32_t record_budget(mips_machine *m, uint32_t budget)
+{
+	uint32_t left = REPLAY_HASH_INTERVAL - m->instruction_count % REPLAY_HASH_INTERVAL;
+	return budget < left ? budget : left;
+}
+
+/***************************************************************/
+/* After run_cycles executed some instructions: hash at a hash point */
+/* or when the program has just halted                                                  */
+/***************************************************************/
+void record_ran(mips_machine *m, uint32_t executed)
+{
+	if (executed > 0 && (m->instruction_count % REPLAY_HASH_INTERVAL == 0 || !m->run_flag)) {
+		record_event(m, REPLAY_HASH, 0, 0, NULL);
+	}
+}
+
+/***************************************************************/
+/* Log the final state and close the log                                                    */
+/***************************************************************/
+void record_stop(mips_machine *m)
+{
+	replay_log_t *log = m->record;
+
+	if (log == NULL) {
+		return;
+	}
+	record_event(m, REPLAY_END, 0, 0, NULL);
+	m->record = NULL;
+	if (fclose(log->fp) != 0) {
+		printf("Error: Can't write replay log %s\n", log->path);
+	}
+	else if (!m->quiet) {
+		printf("Replay log written to %s: %u events.\n\n", log->path, log->events);
+	}
+	free(log->path);
+	free(log);
+}
+
+/***************************************************************/
+/* Read the next event; 1 if read, 0 at end of log, -1 if truncated  */
+/***************************************************************/
+static int replay_read(FILE *fp, replay_event_t *ev)
+{
+	uint8_t buf[REPLAY_EVENT_BYTES];
+	size_t n = fread(buf, 1, sizeof(buf), fp);
+
+	if (n == 0) {
+		return 0;
+	}
+	if (n != sizeof(buf) || buf[0] > REPLAY_REWIND) {
+		return -1;
+	}
+	ev->type = buf[0];
+	ev->reg = buf[1];
+	ev->length = buf[2] | (buf[3] << 8);
+	ev->count = get_le32(buf + 4);
+	ev->value = get_le32(buf + 8) | ((uint64_t)get_le32(buf + 12) << 32);
+	if (ev->length >= PROG_FILE_MAX || (ev->type == REPLAY_INPUT && (ev->reg == 0 || ev->reg >= MIPS_REGS))
+			|| fread(ev->path, 1, ev->length, fp) != ev->length) {
+		return -1;
+	}
+	ev->path[ev->length] = '\0';
+	return 1;
+}
+
+/***************************************************************/
+/* Replay the log in path on m (a fresh machine; its engine is used,  */
+/* trace is forced off) and verify every state hash. Returns 0 if the */
+/* whole log replayed and matched, -1 otherwise.                                  */
+/***************************************************************/
+int replay_run(mips_machine *m, const char *path)
+{
+	FILE *fp;
+	uint8_t header[24];
+	char start[PROG_FILE_MAX];
+	replay_event_t ev;
+	uint32_t length, kind, events = 0, hashes = 0;
+	uint64_t executed = 0, begin, hash;
+	struct timespec ts;
+	int r, failed = FALSE, ok = FALSE;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Error: Can't open replay log %s\n", path);
+		return -1;
+	}
+	length = 0;
+	if (fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, REPLAY_MAGIC, 8) != 0
+			|| get_le32(header + 8) != REPLAY_VERSION
+			|| (length = get_le32(header + 20)) >= PROG_FILE_MAX
+			|| fread(start, 1, length, fp) != length) {
+		printf("Error: %s is not a replay log\n", path);
+		fclose(fp);
+		return -1;
+	}
+	start[length] = '\0';
+	kind = get_le32(header + 16);
+
+	m->trace_level = TRACE_OFF;
+	m->quiet = TRUE;
+	if (kind == REPLAY_START_CHECKPOINT) {
+		r = checkpoint_restore(m, start);
+	}
+	else {
+		r = set_prog_file(m, start) == 0 ? load_program(m) : -1;
+	}
+	if (r != 0) {
+		printf("Error: Can't load %s to replay %s\n", start, path);
+		fclose(fp);
+		return -1;
+	}
+	/* the session may have stepped back through its history */
+	history_enable(m);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	begin = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	while ((r = replay_read(fp, &ev)) == 1) {
+		events++;
+		if (ev.type == REPLAY_REWIND && m->instruction_count > ev.count) {
+			failed = history_goto(m, ev.count) != 0;
+		}
+		else if (ev.type != REPLAY_RESET && ev.type != REPLAY_RESTORE) {
+			while (m->run_flag && m->instruction_count < ev.count) {
+				executed += run_cycles(m, ev.count - m->instruction_count);
+			}
+			if (m->instruction_count != ev.count) {
+				printf("Replay diverged: program halted at instruction %u before the %s event at %u\n\n",
+					m->instruction_count, REPLAY_EVENT_NAME[ev.type], ev.count);
+				break;
+			}
+		}
+		switch (ev.type) {
+			case REPLAY_INPUT:
+				m->cpu.REGS[ev.reg] = ev.value;
+				history_point(m);
+				continue;
+			case REPLAY_HI:
+				m->cpu.HI = ev.value;
+				history_point(m);
+				continue;
+			case REPLAY_LO:
+				m->cpu.LO = ev.value;
+				history_point(m);
+				continue;
+			case REPLAY_RESET:
+				failed = reset(m) != 0;
+				break;
+			case REPLAY_RESTORE:
+				failed = checkpoint_restore(m, ev.path) != 0;
+				break;
+		}
+		if (failed) {
+			printf("Replay stopped: %s at instruction %u failed\n\n", REPLAY_EVENT_NAME[ev.type], ev.count);
+			break;
+		}
+		hash = state_hash(m);
+		if (hash != ev.value) {
+			printf("Replay diverged: state hash %016llx after the %s event at instruction %u, log has %016llx\n\n",
+				(unsigned long long)hash, REPLAY_EVENT_NAME[ev.type], ev.count, (unsigned long long)ev.value);
+			break;
+		}
+		hashes++;
+		if (ev.type == REPLAY_END) {
+			ok = TRUE;
+			break;
+		}
+	}
+	if (r < 0) {
+		printf("Error: Replay log %s is truncated or corrupt after %u events\n\n", path, events);
+	}
+	else if (r == 0 && !ok) {
+		printf("Replay log %s ends without an end event (recording was cut short)\n\n", path);
+	}
+	fclose(fp);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	printf("Replayed %u events, %u state hashes verified, %llu instructions in %.3f ms: %s\n\n",
+		events, hashes, (unsigned long long)executed,
+		((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec - begin) / 1e6, ok ? "OK" : "FAILED");
+	return ok ? 0 : -1;
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Execution statistics reports (see stats_t): the stats command and */
+/* the JSON written at exit by --stats=<file>.                                    */
+/***************************************************************/
+
+#define MIPS_OP_NAME(name) #name,
+static const char *const OP_NAMES[NUM_OPS] = { MIPS_OPS(MIPS_OP_NAME) };
+
+/* MEM_REGIONS order, then addresses outside every region */
+static const char *const REGION_NAMES[NUM_MEM_REGION + 1] = { "text", "data", "kdata", "ktext", "none" };
+
+static int is_branch(int op)
+{
+	return op == OP_BLTZ || op == OP_BGEZ || op == OP_BEQ || op == OP_BNE || op == OP_BLEZ || op == OP_BGTZ;
+}
+
+/* guest million instructions per host second */
+static double mips_rate(uint64_t instructions, uint64_t ns)
+{
+	return ns != 0 ? instructions * 1e3 / ns : 0.0;
+}
+
+/***************************************************************/
+/* Print m's statistics                                                                                       */
+/***************************************************************/
+void stats_print(mips_machine *m)
+{
+	const stats_t *s = &m->stats;
+	uint64_t total = 0;
+	int i;
+
+	printf("-------------------------------------\n");
+	printf("Execution Statistics\n");
+	printf("-------------------------------------\n");
+	printf("# Instructions Executed\t: %u\n", m->instruction_count);
+	printf("Run calls\t: %llu\n", (unsigned long long)s->runs);
+	printf("Run instructions\t: %llu\n", (unsigned long long)s->run_instructions);
+	printf("Run host time\t: %.3f ms (%.0f ns per call)\n", s->run_ns / 1e6, s->runs ? (double)s->run_ns / s->runs : 0.0);
+	printf("Guest MIPS\t: %.2f (last run %.2f)\n", mips_rate(s->run_instructions, s->run_ns),
+		mips_rate(s->last_run_instructions, s->last_run_ns));
+	if (!STATS_ENABLED) {
+		printf("-------------------------------------\n");
+		printf("Op, branch and memory counters are not compiled in (make clean && make STATS=1).\n\n");
+		return;
+	}
+
+	for (i = 0; i < NUM_OPS; i++) {
+		total += s->ops[i];
+	}
+	printf("Counted instructions\t: %llu (switch interpreter)\n", (unsigned long long)total);
+	printf("-------------------------------------\n");
+	printf("[Op]\t[Count]\t[%%]\n");
+	for (i = 0; i < NUM_OPS; i++) {
+		if (s->ops[i] != 0) {
+			printf("%s\t%llu\t%.2f\n", OP_NAMES[i], (unsigned long long)s->ops[i], 100.0 * s->ops[i] / total);
+		}
+	}
+	printf("-------------------------------------\n");
+	printf("[Branch]\t[Taken]\t[Not taken]\n");
+	for (i = 0; i < NUM_OPS; i++) {
+		if (is_branch(i) && s->ops[i] != 0) {
+			printf("%s\t%llu\t%llu\n", OP_NAMES[i], (unsigned long long)s->taken[i],
+				(unsigned long long)(s->ops[i] - s->taken[i]));
+		}
+	}
+	printf("-------------------------------------\n");
+	printf("[Region]\t[Loads]\t[Stores]\n");
+	for (i = 0; i <= NUM_MEM_REGION; i++) {
+		printf("%s\t%llu\t%llu\n", REGION_NAMES[i], (unsigned long long)s->loads[i], (unsigned long long)s->stores[i]);
+	}
+	printf("mem_read_32 TLB misses\t: %llu\n", (unsigned long long)s->read_walks);
+	printf("-------------------------------------\n\n");
+}
+
+/***************************************************************/
+/* Write m's statistics to path ("-": standard output) as JSON;       */
+/* returns 0 or -1                                                                                          */
+/***************************************************************/
+int stats_save_json(mips_machine *m, const char *path)
+{
+	const stats_t *s = &m->stats;
+	FILE *fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+	const char *sep;
+	int i, r;
+
+	if (fp == NULL) {
+		printf("Error: Can't create statistics file %s\n", path);
+		return -1;
+	}
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"program\": \"");
+	for (i = 0; m->prog_file[i] != '\0'; i++) {
+		if (m->prog_file[i] == '"' || m->prog_file[i] == '\\') {
+			fputc('\\', fp);
+		}
+		fputc(m->prog_file[i], fp);
+	}
+	fprintf(fp, "\",\n");
+	fprintf(fp, "  \"instructions\": %u,\n", m->instruction_count);
+	fprintf(fp, "  \"runs\": { \"calls\": %llu, \"instructions\": %llu, \"host_ns\": %llu, \"ns_per_call\": %.1f, \"mips\": %.3f },\n",
+		(unsigned long long)s->runs, (unsigned long long)s->run_instructions, (unsigned long long)s->run_ns,
+		s->runs ? (double)s->run_ns / s->runs : 0.0, mips_rate(s->run_instructions, s->run_ns));
+	fprintf(fp, "  \"tlb\": { \"hits\": %llu, \"misses\": %llu },\n",
+		(unsigned long long)m->tlb.hits, (unsigned long long)m->tlb.misses);
+	fprintf(fp, "  \"counters\": %s", STATS_ENABLED ? "true" : "false");
+	if (STATS_ENABLED) {
+		fprintf(fp, ",\n  \"ops\": {");
+		for (i = 0, sep = ""; i < NUM_OPS; i++) {
+			if (s->ops[i] != 0) {
+				fprintf(fp, "%s \"%s\": %llu", sep, OP_NAMES[i], (unsigned long long)s->ops[i]);
+				sep = ",";
+			}
+		}
+		fprintf(fp, " },\n  \"branches\": {");
+		for (i = 0, sep = ""; i < NUM_OPS; i++) {
+			if (is_branch(i) && s->ops[i] != 0) {
+				fprintf(fp, "%s \"%s\": { \"taken\": %llu, \"not_taken\": %llu }", sep, OP_NAMES[i],
+					(unsigned long long)s->taken[i], (unsigned long long)(s->ops[i] - s->taken[i]));
+				sep = ",";
+			}
+		}
+		fprintf(fp, " },\n  \"loads\": {");
+		for (i = 0; i <= NUM_MEM_REGION; i++) {
+			fprintf(fp, "%s \"%s\": %llu", i ? "," : "", REGION_NAMES[i], (unsigned long long)s->loads[i]);
+		}
+		fprintf(fp, " },\n  \"stores\": {");
+		for (i = 0; i <= NUM_MEM_REGION; i++) {
+			fprintf(fp, "%s \"%s\": %llu", i ? "," : "", REGION_NAMES[i], (unsigned long long)s->stores[i]);
+		}
+		fprintf(fp, " },\n  \"read_tlb_misses\": %llu", (unsigned long long)s->read_walks);
+	}
+	fprintf(fp, "\n}\n");
+	r = fp == stdout ? fflush(fp) : fclose(fp);
+	if (r != 0) {
+		printf("Error: Can't write statistics file %s\n", path);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,861 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Binary trace.                                                                                                    */
+/*                                                                                                                     */
+/* At trace level binary the interpreter hands every executed        */
+/* instruction to btrace_emit, which fills one trace_record_t in a  */
+/* single-producer/single-consumer ring and publishes it with one   */
+/* release store. A writer thread polls the ring and drains it to    */
+/* the trace file in large fwrites, so the simulating thread never   */
+/* formats or does I/O; it only waits when the ring is full.             */
+/*                                                                                                                     */
+/* Raw file: "MUMIPSBT", u32 version, u32 record size, then the     */
+/* records in execution order, in host byte order.                            */
+/*                                                                                                                     */
+/* Packed file (little-endian): "MUMIPSTZ", u32 version, u32 chunk  */
+/* size in records, then chunks, then an index. Each chunk holds up */
+/* to TZ_CHUNK_RECORDS records delta-encoded (below) and deflated:  */
+/*   "TZCK", u32 records, u64 first record, u32 encoded bytes,       */
+/*   u32 deflated bytes, u32 first PC, u32 crc32 of the deflated data */
+/* Every chunk starts from a blank encoder state, so any chunk can  */
+/* be decoded on its own. The index lists (u64 first record, u64     */
+/* file offset) per chunk and ends with a footer: u64 index offset,  */
+/* u32 chunks, u32 0, "TZINDEX\0". A trace cut short has no index;  */
+/* readers then find the chunks by walking their headers.                */
+/*                                                                                                                     */
+/* Record encoding: a tag byte, then only what the tag announces:     */
+/*   TZ_PC    zigzag varint of PC - (previous PC + 4)                          */
+/*   TZ_WORD  u32 instruction word, when it differs from the last one */
+/*            seen at this PC (a small direct-mapped word cache)         */
+/*   TZ_DEST  destination, zigzag varint of new - old value (HI+LO:     */
+/*            LO then HI), only when the value changed                          */
+/*   TZ_MEM   access flags, zigzag varint of address - previous     */
+/*            address, and for stores a varint of the stored data;     */
+/*            a load's data is the value rt has after it                      */
+/* A fall-through instruction that changes nothing costs one byte    */
+/* before deflate.                                                                                          */
+/***************************************************************/
+
+#define BTRACE_MAGIC "MUMIPSBT"
+#define BTRACE_VERSION 1
+#define BTRACE_RING_RECORDS (1u << 18)          /* 6 MB of records */
+#define BTRACE_POLL_NS 100000                   /* writer sleep when the ring is empty */
+
+#define TZ_MAGIC "MUMIPSTZ"
+#define TZ_VERSION 1
+#define TZ_CHUNK_MAGIC "TZCK"
+#define TZ_INDEX_MAGIC "TZINDEX"
+#define TZ_CHUNK_RECORDS (1u << 16)
+#define TZ_CHUNK_HEADER 32
+#define TZ_FOOTER 24
+#define TZ_MAX_RECORD 34                        /* tag, pc, word, dest, two values, mem */
+#define TZ_WORD_CACHE 4096
+
+enum { TZ_PC = 0x01, TZ_WORD = 0x02, TZ_DEST = 0x04, TZ_MEM = 0x08 };
+
+/* encoder and decoder state, blank at the start of every chunk */
+typedef struct {
+	uint32_t next_pc;
+	uint32_t regs[TRACE_DEST_LO + 1];       /* GPRs, HI, LO */
+	uint32_t addr;
+	uint32_t cache_pc[TZ_WORD_CACHE], cache_word[TZ_WORD_CACHE];
+} tz_state_t;
+
+typedef struct btrace {
+	/* producer side (simulating thread) */
+	_Alignas(64) _Atomic uint64_t head;     /* records published */
+	uint64_t tail_seen;                     /* last tail read by the producer */
+	/* consumer side (writer thread) */
+	_Alignas(64) _Atomic uint64_t tail;     /* records written out */
+	_Atomic int stop;
+	int error;
+	FILE *fp;
+	char *path;
+	pthread_t writer;
+	/* packed format, all used by the writer thread only */
+	int packed;
+	tz_state_t tz;
+	uint8_t *chunk, *deflated;
+	uint32_t chunk_records, chunk_pc;
+	size_t chunk_bytes, deflated_capacity;
+	uint64_t records, offset;               /* records and bytes written so far */
+	uint64_t *index;                        /* first record, offset per chunk */
+	uint32_t chunks, index_capacity;
+	_Alignas(64) trace_record_t ring[BTRACE_RING_RECORDS];
+} btrace_t;
+
+/* register each op writes: 0-31, TRACE_DEST_*, or rd/rt of the instruction */
+enum { D_NONE = TRACE_DEST_NONE, D_RD = 0xfe, D_RT = 0xfd };
+
+static const uint8_t BTRACE_DEST[NUM_OPS] = {
+	[OP_UNDECODED] = D_NONE, [OP_NOP] = D_NONE, [OP_UNIMPLEMENTED] = D_NONE,
+	[OP_SLL] = D_RD, [OP_SRL] = D_RD, [OP_SRA] = D_RD,
+	[OP_JR] = D_NONE, [OP_JALR] = D_RD, [OP_SYSCALL] = D_NONE,
+	[OP_MFHI] = D_RD, [OP_MFLO] = D_RD,
+	[OP_MTHI] = TRACE_DEST_HI, [OP_MTLO] = TRACE_DEST_LO,
+	[OP_MULT] = TRACE_DEST_HILO, [OP_MULTU] = TRACE_DEST_HILO,
+	[OP_DIV] = TRACE_DEST_HILO, [OP_DIVU] = TRACE_DEST_HILO,
+	[OP_ADD] = D_RD, [OP_ADDU] = D_RD, [OP_SUB] = D_RD, [OP_SUBU] = D_RD,
+	[OP_AND] = D_RD, [OP_OR] = D_RD, [OP_XOR] = D_RD, [OP_NOR] = D_RD, [OP_SLT] = D_RD,
+	[OP_BLTZ] = D_NONE, [OP_BGEZ] = D_NONE, [OP_J] = D_NONE, [OP_JAL] = 31,
+	[OP_BEQ] = D_NONE, [OP_BNE] = D_NONE, [OP_BLEZ] = D_NONE, [OP_BGTZ] = D_NONE,
+	[OP_ADDI] = D_RT, [OP_ADDIU] = D_RT, [OP_SLTI] = D_RT, [OP_ANDI] = D_RT,
+	[OP_ORI] = D_RT, [OP_XORI] = D_RT, [OP_LUI] = D_RT,
+	[OP_LB] = D_RT, [OP_LH] = D_RT, [OP_LW] = D_RT,
+	[OP_SB] = D_NONE, [OP_SH] = D_NONE, [OP_SW] = D_NONE,
+};
+
+/* memory access of loads and stores: TRACE_LOAD/TRACE_STORE | size */
+static const uint8_t BTRACE_MEM[NUM_OPS] = {
+	[OP_LB] = TRACE_LOAD | 1, [OP_LH] = TRACE_LOAD | 2, [OP_LW] = TRACE_LOAD | 4,
+	[OP_SB] = TRACE_STORE | 1, [OP_SH] = TRACE_STORE | 2, [OP_SW] = TRACE_STORE | 4,
+};
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+	put_le32(p, (uint32_t)v);
+	put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* NULL if the varint runs past end or is longer than 5 bytes */
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+	uint32_t shift;
+
+	*v = 0;
+	for (shift = 0; p < end && shift < 35; shift += 7) {
+		*v |= (uint32_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static inline uint32_t zigzag(uint32_t delta)
+{
+	return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+static inline uint32_t unzigzag(uint32_t v)
+{
+	return (v >> 1) ^ -(v & 1);
+}
+
+static void tz_reset(tz_state_t *s)
+{
+	memset(s, 0, sizeof(*s));
+	memset(s->cache_pc, 0xff, sizeof(s->cache_pc));
+}
+
+/***************************************************************/
+/* Append the encoding of r to out (at most TZ_MAX_RECORD bytes)   */
+/***************************************************************/
+static uint8_t *tz_encode(tz_state_t *s, const trace_record_t *r, uint8_t *out)
+{
+	uint8_t *tag = out++;
+	uint32_t slot = (r->pc >> 2) & (TZ_WORD_CACHE - 1);
+
+	*tag = 0;
+	if (r->pc != s->next_pc) {
+		*tag |= TZ_PC;
+		out = put_varint(out, zigzag(r->pc - s->next_pc));
+	}
+	s->next_pc = r->pc + 4;
+	if (s->cache_pc[slot] != r->pc || s->cache_word[slot] != r->word) {
+		*tag |= TZ_WORD;
+		put_le32(out, r->word);
+		out += 4;
+		s->cache_pc[slot] = r->pc;
+		s->cache_word[slot] = r->word;
+	}
+	if (r->dest < MIPS_REGS || r->dest == TRACE_DEST_HI || r->dest == TRACE_DEST_LO) {
+		if (s->regs[r->dest] != r->value) {
+			*tag |= TZ_DEST;
+			*out++ = r->dest;
+			out = put_varint(out, zigzag(r->value - s->regs[r->dest]));
+			s->regs[r->dest] = r->value;
+		}
+	}
+	else if (r->dest == TRACE_DEST_HILO) {
+		if (s->regs[TRACE_DEST_LO] != r->value || s->regs[TRACE_DEST_HI] != r->data) {
+			*tag |= TZ_DEST;
+			*out++ = r->dest;
+			out = put_varint(out, zigzag(r->value - s->regs[TRACE_DEST_LO]));
+			out = put_varint(out, zigzag(r->data - s->regs[TRACE_DEST_HI]));
+			s->regs[TRACE_DEST_LO] = r->value;
+			s->regs[TRACE_DEST_HI] = r->data;
+		}
+	}
+	if (r->flags & (TRACE_LOAD | TRACE_STORE)) {
+		*tag |= TZ_MEM;
+		*out++ = r->flags;
+		out = put_varint(out, zigzag(r->addr - s->addr));
+		s->addr = r->addr;
+		if (r->flags & TRACE_STORE) {
+			out = put_varint(out, r->data);
+		}
+	}
+	return out;
+}
+
+/***************************************************************/
+/* Decode one record from p (no further than end) into r; returns  */
+/* the byte after it, or NULL if the encoding is corrupt. Registers  */
+/* written without changing their value come back as TRACE_DEST_NONE */
+/***************************************************************/
+static const uint8_t *tz_decode(tz_state_t *s, const uint8_t *p, const uint8_t *end, trace_record_t *r)
+{
+	uint8_t tag;
+	uint32_t v, slot;
+
+	if (p >= end) {
+		return NULL;
+	}
+	tag = *p++;
+	memset(r, 0, sizeof(*r));
+	r->pc = s->next_pc;
+	if (tag & TZ_PC) {
+		if ((p = get_varint(p, end, &v)) == NULL) {
+			return NULL;
+		}
+		r->pc += unzigzag(v);
+	}
+	s->next_pc = r->pc + 4;
+	slot = (r->pc >> 2) & (TZ_WORD_CACHE - 1);
+	if (tag & TZ_WORD) {
+		if (end - p < 4) {
+			return NULL;
+		}
+		s->cache_pc[slot] = r->pc;
+		s->cache_word[slot] = get_le32(p);
+		p += 4;
+	}
+	else if (s->cache_pc[slot] != r->pc) {
+		return NULL;
+	}
+	r->word = s->cache_word[slot];
+
+	r->dest = TRACE_DEST_NONE;
+	if (tag & TZ_DEST) {
+		if (p >= end) {
+			return NULL;
+		}
+		r->dest = *p++;
+		if (r->dest > TRACE_DEST_HILO || (p = get_varint(p, end, &v)) == NULL) {
+			return NULL;
+		}
+		if (r->dest == TRACE_DEST_HILO) {
+			s->regs[TRACE_DEST_LO] += unzigzag(v);
+			if ((p = get_varint(p, end, &v)) == NULL) {
+				return NULL;
+			}
+			s->regs[TRACE_DEST_HI] += unzigzag(v);
+			r->value = s->regs[TRACE_DEST_LO];
+			r->data = s->regs[TRACE_DEST_HI];
+		}
+		else {
+			s->regs[r->dest] += unzigzag(v);
+			r->value = s->regs[r->dest];
+		}
+	}
+	if (tag & TZ_MEM) {
+		if (p >= end) {
+			return NULL;
+		}
+		r->flags = *p++;
+		if ((p = get_varint(p, end, &v)) == NULL) {
+			return NULL;
+		}
+		s->addr += unzigzag(v);
+		r->addr = s->addr;
+		if (r->flags & TRACE_STORE) {
+			if ((p = get_varint(p, end, &r->data)) == NULL) {
+				return NULL;
+			}
+		}
+		else {
+			r->data = s->regs[(r->word >> 16) & 0x1f];
+		}
+	}
+	return p;
+}
+
+/***************************************************************/
+/* Deflate and write the pending chunk (writer thread)                      */
+/***************************************************************/
+static void tz_flush_chunk(btrace_t *t)
+{
+	uint8_t header[TZ_CHUNK_HEADER];
+	uLongf deflated = t->deflated_capacity;
+	uint64_t *grown;
+
+	if (t->chunk_records == 0 || t->error) {
+		return;
+	}
+	if (compress2(t->deflated, &deflated, t->chunk, t->chunk_bytes, 1) != Z_OK) {
+		t->error = TRUE;
+		return;
+	}
+	if (t->chunks == t->index_capacity) {
+		t->index_capacity = t->index_capacity ? t->index_capacity * 2 : 64;
+		grown = realloc(t->index, t->index_capacity * 2 * sizeof(uint64_t));
+		if (grown == NULL) {
+			t->error = TRUE;
+			return;
+		}
+		t->index = grown;
+	}
+	t->index[2 * t->chunks] = t->records - t->chunk_records;
+	t->index[2 * t->chunks + 1] = t->offset;
+	t->chunks++;
+
+	memcpy(header, TZ_CHUNK_MAGIC, 4);
+	put_le32(header + 4, t->chunk_records);
+	put_le64(header + 8, t->records - t->chunk_records);
+	put_le32(header + 16, t->chunk_bytes);
+	put_le32(header + 20, deflated);
+	put_le32(header + 24, t->chunk_pc);
+	put_le32(header + 28, crc32(0, t->deflated, deflated));
+	if (fwrite(header, sizeof(header), 1, t->fp) != 1 || fwrite(t->deflated, deflated, 1, t->fp) != 1) {
+		t->error = TRUE;
+	}
+	t->offset += sizeof(header) + deflated;
+	t->chunk_records = 0;
+	t->chunk_bytes = 0;
+	tz_reset(&t->tz);
+}
+
+/***************************************************************/
+/* Encode records into the pending chunk (writer thread)                  */
+/***************************************************************/
+static void tz_write(btrace_t *t, const trace_record_t *r, uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		if (t->chunk_records == 0) {
+			t->chunk_pc = r[i].pc;
+		}
+		t->chunk_bytes = tz_encode(&t->tz, &r[i], t->chunk + t->chunk_bytes) - t->chunk;
+		t->chunk_records++;
+		t->records++;
+		if (t->chunk_records == TZ_CHUNK_RECORDS) {
+			tz_flush_chunk(t);
+		}
+	}
+}
+
+/***************************************************************/
+/* Last chunk, index and footer (after the writer has stopped)         */
+/***************************************************************/
+static void tz_finish(btrace_t *t)
+{
+	uint8_t entry[16], footer[TZ_FOOTER];
+	uint64_t index_offset;
+	uint32_t i;
+
+	tz_flush_chunk(t);
+	index_offset = t->offset;
+	for (i = 0; i < t->chunks && !t->error; i++) {
+		put_le64(entry, t->index[2 * i]);
+		put_le64(entry + 8, t->index[2 * i + 1]);
+		if (fwrite(entry, sizeof(entry), 1, t->fp) != 1) {
+			t->error = TRUE;
+		}
+	}
+	put_le64(footer, index_offset);
+	put_le32(footer + 8, t->chunks);
+	put_le32(footer + 12, 0);
+	memcpy(footer + 16, TZ_INDEX_MAGIC, 8);
+	if (!t->error && fwrite(footer, sizeof(footer), 1, t->fp) != 1) {
+		t->error = TRUE;
+	}
+}
+
+/***************************************************************/
+/* Writer thread: drain published records to the file                      */
+/***************************************************************/
+static void *btrace_writer(void *arg)
+{
+	btrace_t *t = arg;
+	uint64_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed), head, n;
+	struct timespec poll = { 0, BTRACE_POLL_NS };
+	int stop;
+
+	for (;;) {
+		head = atomic_load_explicit(&t->head, memory_order_acquire);
+		if (head == tail) {
+			/* stop is set after the last record is published */
+			stop = atomic_load_explicit(&t->stop, memory_order_acquire);
+			if (atomic_load_explicit(&t->head, memory_order_acquire) != tail) {
+				continue;
+			}
+			if (stop) {
+				break;
+			}
+			nanosleep(&poll, NULL);
+			continue;
+		}
+		/* up to the end of the ring; the rest goes next time round */
+		n = head - tail;
+		if ((tail % BTRACE_RING_RECORDS) + n > BTRACE_RING_RECORDS) {
+			n = BTRACE_RING_RECORDS - tail % BTRACE_RING_RECORDS;
+		}
+		if (t->packed) {
+			tz_write(t, &t->ring[tail % BTRACE_RING_RECORDS], n);
+		}
+		else if (!t->error && fwrite(&t->ring[tail % BTRACE_RING_RECORDS], sizeof(trace_record_t), n, t->fp) != n) {
+			t->error = TRUE;
+		}
+		tail += n;
+		atomic_store_explicit(&t->tail, tail, memory_order_release);
+	}
+	return NULL;
+}
+
+/***************************************************************/
+/* Start a binary trace of m into path, raw or (packed) delta-encoded */
+/* and compressed; returns 0 or -1                                                           */
+/***************************************************************/
+int btrace_open(mips_machine *m, const char *path, int packed)
+{
+	btrace_t *t;
+	uint32_t header[2] = { BTRACE_VERSION, sizeof(trace_record_t) };
+	uint8_t tz_header[16];
+
+	btrace_close(m);
+	t = aligned_alloc(64, sizeof(btrace_t));
+	if (t == NULL) {
+		printf("Error: Out of memory starting binary trace\n");
+		exit(-1);
+	}
+	memset(t, 0, offsetof(btrace_t, ring));
+	t->fp = fopen(path, "wb");
+	if (t->fp == NULL) {
+		printf("Error: Can't create trace file %s\n", path);
+		free(t);
+		return -1;
+	}
+	t->path = strdup(path);
+	t->packed = packed;
+	if (packed) {
+		tz_reset(&t->tz);
+		t->deflated_capacity = compressBound(TZ_CHUNK_RECORDS * TZ_MAX_RECORD);
+		t->chunk = malloc(TZ_CHUNK_RECORDS * TZ_MAX_RECORD);
+		t->deflated = malloc(t->deflated_capacity);
+		if (t->chunk == NULL || t->deflated == NULL) {
+			printf("Error: Out of memory starting binary trace\n");
+			exit(-1);
+		}
+		memcpy(tz_header, TZ_MAGIC, 8);
+		put_le32(tz_header + 8, TZ_VERSION);
+		put_le32(tz_header + 12, TZ_CHUNK_RECORDS);
+		t->offset = sizeof(tz_header);
+	}
+	if (t->path == NULL
+			|| (packed && fwrite(tz_header, sizeof(tz_header), 1, t->fp) != 1)
+			|| (!packed && (fwrite(BTRACE_MAGIC, 8, 1, t->fp) != 1 || fwrite(header, sizeof(header), 1, t->fp) != 1))) {
+		printf("Error: Can't write trace file %s\n", path);
+		exit(-1);
+	}
+	if (pthread_create(&t->writer, NULL, btrace_writer, t) != 0) {
+		printf("Error: Can't start the trace writer thread\n");
+		exit(-1);
+	}
+	m->btrace = t;
+	return 0;
+}
+
+/***************************************************************/
+/* Flush and close m's binary trace, if any                                          */
+/***************************************************************/
+void btrace_close(mips_machine *m)
+{
+	btrace_t *t = m->btrace;
+	uint64_t records;
+
+	if (t == NULL) {
+		return;
+	}
+	atomic_store_explicit(&t->stop, TRUE, memory_order_release);
+	pthread_join(t->writer, NULL);
+	records = atomic_load_explicit(&t->tail, memory_order_relaxed);
+	if (t->packed) {
+		tz_finish(t);
+	}
+	if (fclose(t->fp) != 0 || t->error) {
+		printf("Error: Can't write trace file %s\n", t->path);
+	}
+	else if (!m->quiet && t->packed) {
+		printf("Packed trace written to %s: %llu instructions in %llu bytes (%.2f bytes/instruction).\n\n",
+			t->path, (unsigned long long)records, (unsigned long long)t->offset + 16ull * t->chunks + TZ_FOOTER,
+			records ? (double)(t->offset + 16ull * t->chunks + TZ_FOOTER) / records : 0.0);
+	}
+	else if (!m->quiet) {
+		printf("Binary trace written to %s: %llu instructions.\n\n", t->path, (unsigned long long)records);
+	}
+	m->btrace = NULL;
+	free(t->chunk);
+	free(t->deflated);
+	free(t->index);
+	free(t->path);
+	free(t);
+}
+
+/***************************************************************/
+/* Publish the record of the instruction d just executed at pc (ea:  */
+/* its rs + imm, read before it ran)                                                     */
+/***************************************************************/
+void btrace_emit(mips_machine *m, const decoded_inst_t *d, uint32_t pc, uint32_t ea)
+{
+	btrace_t *t = m->btrace;
+	uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+	trace_record_t *r;
+	uint8_t dest = BTRACE_DEST[d->op], mem = BTRACE_MEM[d->op];
+
+	/* full: wait for the writer */
+	while (head - t->tail_seen >= BTRACE_RING_RECORDS) {
+		t->tail_seen = atomic_load_explicit(&t->tail, memory_order_acquire);
+		if (head - t->tail_seen >= BTRACE_RING_RECORDS) {
+			sched_yield();
+		}
+	}
+
+	r = &t->ring[head % BTRACE_RING_RECORDS];
+	r->pc = pc;
+	r->word = d->word;
+	r->flags = mem;
+	r->addr = 0;
+	r->data = 0;
+	if (dest == D_RD) {
+		dest = d->rd;
+	}
+	else if (dest == D_RT) {
+		dest = d->rt;
+	}
+	r->dest = dest;
+	if (dest < MIPS_REGS) {
+		r->value = m->cpu.REGS[dest];
+	}
+	else if (dest == TRACE_DEST_HI) {
+		r->value = m->cpu.HI;
+	}
+	else if (dest == TRACE_DEST_LO || dest == TRACE_DEST_HILO) {
+		r->value = m->cpu.LO;
+		r->data = dest == TRACE_DEST_HILO ? m->cpu.HI : 0;
+	}
+	else {
+		r->value = 0;
+	}
+	if (mem != 0) {
+		/* loaded value as it reached rt; stored bytes zero-extended */
+		r->addr = ea;
+		r->data = m->cpu.REGS[d->rt];
+		if ((mem & TRACE_STORE) && (mem & TRACE_SIZE) < 4) {
+			r->data &= (1u << (8 * (mem & TRACE_SIZE))) - 1;
+		}
+	}
+	r->reserved = 0;
+	atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
+
+/***************************************************************/
+/* Trace reader, for raw and packed files                                            */
+/***************************************************************/
+
+struct trace_reader {
+	FILE *fp;
+	int packed;
+	uint64_t records;                       /* in the file */
+	uint64_t next;                          /* record next returns */
+	/* packed: chunk index and the decoded chunk */
+	uint64_t *index;                        /* first record, offset per chunk */
+	uint32_t chunks, chunk;                 /* count, next to load */
+	uint32_t left;                          /* records left in the chunk */
+	tz_state_t tz;
+	uint8_t *encoded, *deflated;
+	const uint8_t *p, *end;
+};
+
+/***************************************************************/
+/* Index from the footer; 0, or -1 if the trace has none                   */
+/***************************************************************/
+static int tz_read_index(trace_reader_t *tr)
+{
+	uint8_t footer[TZ_FOOTER], entry[16];
+	uint64_t offset;
+	uint32_t i;
+
+	if (fseeko(tr->fp, -(off_t)TZ_FOOTER, SEEK_END) != 0 || fread(footer, sizeof(footer), 1, tr->fp) != 1
+			|| memcmp(footer + 16, TZ_INDEX_MAGIC, 8) != 0) {
+		return -1;
+	}
+	offset = get_le64(footer);
+	tr->chunks = get_le32(footer + 8);
+	tr->index = malloc((tr->chunks + 1) * 2 * sizeof(uint64_t));
+	if (tr->index == NULL || fseeko(tr->fp, offset, SEEK_SET) != 0) {
+		return -1;
+	}
+	for (i = 0; i < tr->chunks; i++) {
+		if (fread(entry, sizeof(entry), 1, tr->fp) != 1) {
+			return -1;
+		}
+		tr->index[2 * i] = get_le64(entry);
+		tr->index[2 * i + 1] = get_le64(entry + 8);
+	}
+	/* the record count is the last chunk's first record plus its size */
+	tr->records = 0;
+	if (tr->chunks > 0) {
+		if (fseeko(tr->fp, tr->index[2 * tr->chunks - 1] + 4, SEEK_SET) != 0
+				|| fread(entry, 4, 1, tr->fp) != 1) {
+			return -1;
+		}
+		tr->records = tr->index[2 * tr->chunks - 2] + get_le32(entry);
+	}
+	return 0;
+}
+
+/***************************************************************/
+/* Index by walking the chunk headers of a trace without one; stops   */
+/* at the first incomplete chunk                                                             */
+/***************************************************************/
+static void tz_scan_index(trace_reader_t *tr)
+{
+	uint8_t header[TZ_CHUNK_HEADER];
+	uint64_t offset = 16, *grown;
+	uint32_t capacity = 0, deflated;
+
+	free(tr->index);
+	tr->index = NULL;
+	tr->chunks = 0;
+	tr->records = 0;
+	while (fseeko(tr->fp, offset, SEEK_SET) == 0 && fread(header, sizeof(header), 1, tr->fp) == 1
+			&& memcmp(header, TZ_CHUNK_MAGIC, 4) == 0 && get_le64(header + 8) == tr->records) {
+		deflated = get_le32(header + 20);
+		if (fseeko(tr->fp, offset + sizeof(header) + deflated - 1, SEEK_SET) != 0 || fgetc(tr->fp) == EOF) {
+			break;
+		}
+		if (tr->chunks == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			grown = realloc(tr->index, capacity * 2 * sizeof(uint64_t));
+			if (grown == NULL) {
+				break;
+			}
+			tr->index = grown;
+		}
+		tr->index[2 * tr->chunks] = tr->records;
+		tr->index[2 * tr->chunks + 1] = offset;
+		tr->chunks++;
+		tr->records += get_le32(header + 4);
+		offset += sizeof(header) + deflated;
+	}
+}
+
+/***************************************************************/
+/* Read and inflate chunk i; returns 0, or -1 if it is corrupt            */
+/***************************************************************/
+static int tz_load_chunk(trace_reader_t *tr, uint32_t i)
+{
+	uint8_t header[TZ_CHUNK_HEADER];
+	uint32_t records, encoded, deflated;
+	uLongf size;
+
+	if (fseeko(tr->fp, tr->index[2 * i + 1], SEEK_SET) != 0 || fread(header, sizeof(header), 1, tr->fp) != 1
+			|| memcmp(header, TZ_CHUNK_MAGIC, 4) != 0 || get_le64(header + 8) != tr->index[2 * i]) {
+		return -1;
+	}
+	records = get_le32(header + 4);
+	encoded = get_le32(header + 16);
+	deflated = get_le32(header + 20);
+	size = encoded;
+	if (records > TZ_CHUNK_RECORDS || encoded > TZ_CHUNK_RECORDS * TZ_MAX_RECORD
+			|| deflated > compressBound(TZ_CHUNK_RECORDS * TZ_MAX_RECORD)
+			|| fread(tr->deflated, 1, deflated, tr->fp) != deflated
+			|| crc32(0, tr->deflated, deflated) != get_le32(header + 28)
+			|| uncompress(tr->encoded, &size, tr->deflated, deflated) != Z_OK || size != encoded) {
+		return -1;
+	}
+	tz_reset(&tr->tz);
+	tr->p = tr->encoded;
+	tr->end = tr->encoded + encoded;
+	tr->left = records;
+	tr->chunk = i + 1;
+	return 0;
+}
+
+/***************************************************************/
+/* Open a raw or packed trace; NULL (with a message) if it can't be read */
+/***************************************************************/
+trace_reader_t *trace_reader_open(const char *path)
+{
+	trace_reader_t *tr;
+	uint8_t header[16];
+
+	tr = calloc(1, sizeof(trace_reader_t));
+	if (tr == NULL) {
+		printf("Error: Out of memory opening trace\n");
+		exit(-1);
+	}
+	tr->fp = fopen(path, "rb");
+	if (tr->fp == NULL) {
+		printf("Error: Can't open trace file %s\n", path);
+		free(tr);
+		return NULL;
+	}
+	if (fread(header, sizeof(header), 1, tr->fp) != 1) {
+		header[0] = '\0';
+	}
+	if (memcmp(header, BTRACE_MAGIC, 8) == 0 && get_le32(header + 8) == BTRACE_VERSION
+			&& get_le32(header + 12) == sizeof(trace_record_t)) {
+		fseeko(tr->fp, 0, SEEK_END);
+		tr->records = (ftello(tr->fp) - sizeof(header)) / sizeof(trace_record_t);
+		fseeko(tr->fp, sizeof(header), SEEK_SET);
+		return tr;
+	}
+	if (memcmp(header, TZ_MAGIC, 8) != 0 || get_le32(header + 8) != TZ_VERSION) {
+		printf("Error: %s is not a trace file\n", path);
+		trace_reader_close(tr);
+		return NULL;
+	}
+	tr->packed = TRUE;
+	tr->encoded = malloc(TZ_CHUNK_RECORDS * TZ_MAX_RECORD);
+	tr->deflated = malloc(compressBound(TZ_CHUNK_RECORDS * TZ_MAX_RECORD));
+	if (tr->encoded == NULL || tr->deflated == NULL) {
+		printf("Error: Out of memory opening trace\n");
+		exit(-1);
+	}
+	if (tz_read_index(tr) != 0) {
+		tz_scan_index(tr);
+		printf("Warning: %s has no index (trace cut short?); %llu instructions in %u complete chunks\n",
+			path, (unsigned long long)tr->records, tr->chunks);
+	}
+	return tr;
+}
+
+/***************************************************************/
+/* Instructions in the trace                                                                        */
+/***************************************************************/
+uint64_t trace_reader_records(trace_reader_t *tr)
+{
+	return tr->records;
+}
+
+/***************************************************************/
+/* Position the reader at record n (counting from 0); returns 0, or  */
+/* -1 if the trace is shorter or corrupt                                                     */
+/***************************************************************/
+int trace_reader_seek(trace_reader_t *tr, uint64_t n)
+{
+	trace_record_t r;
+	uint32_t lo = 0, hi, mid;
+
+	if (n > tr->records) {
+		return -1;
+	}
+	tr->next = n;
+	if (!tr->packed) {
+		return fseeko(tr->fp, 16 + n * sizeof(trace_record_t), SEEK_SET);
+	}
+	tr->chunk = 0;
+	tr->left = 0;
+	if (n == tr->records) {
+		tr->chunk = tr->chunks;
+		return 0;
+	}
+	/* last chunk starting at or before n */
+	hi = tr->chunks;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (tr->index[2 * mid] <= n) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if (tz_load_chunk(tr, lo) != 0) {
+		return -1;
+	}
+	for (n -= tr->index[2 * lo]; n > 0; n--) {
+		if ((tr->p = tz_decode(&tr->tz, tr->p, tr->end, &r)) == NULL || tr->left == 0) {
+			return -1;
+		}
+		tr->left--;
+	}
+	return 0;
+}
+
+/***************************************************************/
+/* Read the next record; 1 if read, 0 at the end, -1 if corrupt         */
+/***************************************************************/
+int trace_reader_next(trace_reader_t *tr, trace_record_t *r)
+{
+	if (!tr->packed) {
+		if (fread(r, sizeof(*r), 1, tr->fp) != 1) {
+			return tr->next < tr->records ? -1 : 0;
+		}
+		tr->next++;
+		return 1;
+	}
+	if (tr->left == 0) {
+		if (tr->chunk >= tr->chunks) {
+			return 0;
+		}
+		if (tz_load_chunk(tr, tr->chunk) != 0) {
+			return -1;
+		}
+	}
+	if ((tr->p = tz_decode(&tr->tz, tr->p, tr->end, r)) == NULL) {
+		return -1;
+	}
+	tr->left--;
+	tr->next++;
+	return 1;
+}
+
+void trace_reader_close(trace_reader_t *tr)
+{
+	fclose(tr->fp);
+	free(tr->index);
+	free(tr->encoded);
+	free(tr->deflated);
+	free(tr);
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Offline trace decoder.                                                                                  */
+/*                                                                                                                     */
+/* mu-mips-tracedump [--from=<n>] [--count=<n>] [--effects] <trace>   */
+/*                                                                                                                     */
+/* Prints the instructions of a raw (--trace=binary) or packed       */
+/* (--trace=packed) trace in the format of --trace=full, starting at */
+/* instruction n (counting from 0; packed traces seek through their  */
+/* chunk index). --effects adds the register and memory effects of   */
+/* each instruction below it.                                                                   */
+/***************************************************************/
+
+static void print_effects(const trace_record_t *r)
+{
+	if (r->dest < MIPS_REGS) {
+		printf("\t\t$r%u = 0x%08x\n", r->dest, r->value);
+	}
+	else if (r->dest == TRACE_DEST_HI) {
+		printf("\t\tHI = 0x%08x\n", r->value);
+	}
+	else if (r->dest == TRACE_DEST_LO) {
+		printf("\t\tLO = 0x%08x\n", r->value);
+	}
+	else if (r->dest == TRACE_DEST_HILO) {
+		printf("\t\tHI = 0x%08x, LO = 0x%08x\n", r->data, r->value);
+	}
+	if (r->flags & TRACE_LOAD) {
+		printf("\t\tload%u [0x%08x] -> 0x%08x\n", 8 * (r->flags & TRACE_SIZE), r->addr, r->data);
+	}
+	else if (r->flags & TRACE_STORE) {
+		printf("\t\tstore%u [0x%08x] <- 0x%08x\n", 8 * (r->flags & TRACE_SIZE), r->addr, r->data);
+	}
+}
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[])
+{
+	trace_reader_t *tr;
+	trace_record_t r;
+	decoded_inst_t d;
+	uint64_t from = 0, count = UINT64_MAX, n;
+	const char *path = NULL;
+	int effects = FALSE, result = 0;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--from=", 7) == 0) {
+			from = strtoull(argv[i] + 7, NULL, 0);
+		}
+		else if (strncmp(argv[i], "--count=", 8) == 0) {
+			count = strtoull(argv[i] + 8, NULL, 0);
+		}
+		else if (strcmp(argv[i], "--effects") == 0) {
+			effects = TRUE;
+		}
+		else if (argv[i][0] == '-' || path != NULL) {
+			path = NULL;
+			break;
+		}
+		else {
+			path = argv[i];
+		}
+	}
+	if (path == NULL) {
+		printf("Usage: %s [--from=<instruction>] [--count=<instructions>] [--effects] <trace file>\n", argv[0]);
+		return 1;
+	}
+
+	tr = trace_reader_open(path);
+	if (tr == NULL) {
+		return 1;
+	}
+	if (trace_reader_seek(tr, from) != 0) {
+		printf("Error: Can't seek to instruction %llu of %s (%llu instructions)\n",
+			(unsigned long long)from, path, (unsigned long long)trace_reader_records(tr));
+		trace_reader_close(tr);
+		return 1;
+	}
+	for (n = 0; n < count && (result = trace_reader_next(tr, &r)) == 1; n++) {
+		decode_instruction(r.word, r.pc, &d);
+		printf("[0x%x]\t", r.pc);
+		if (d.op == OP_UNIMPLEMENTED) {
+			printf("Instruction at 0x%x is not implemented!\n", r.pc);
+		}
+		else {
+			/* --trace=full disassembles after the instruction ran; only J/JAL use the PC */
+			print_instruction_word(r.pc + 4, r.word);
+		}
+		if (effects) {
+			print_effects(&r);
+		}
+	}
+	trace_reader_close(tr);
+	if (n < count && result < 0) {
+		printf("Error: %s is corrupt after instruction %llu\n", path, (unsigned long long)(from + n));
+		return 1;
+	}
+	return 0;
+}
@@ -3,9 +3,24 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mu-mips.h"
 
+/***************************************************************/
+/* Shared, read-only simulator state (declared in mu-mips.h)        */
+/***************************************************************/
+const mem_region_t MEM_REGIONS[NUM_MEM_REGION] = {
+	{ MEM_TEXT_BEGIN, MEM_TEXT_END },
+	{ MEM_DATA_BEGIN, MEM_DATA_END },
+	{ MEM_KDATA_BEGIN, MEM_KDATA_END },
+	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END }
+};
+
 /***************************************************************/
 /* Print out a list of commands available                                                                  */
 /***************************************************************/
@@ -15,623 +30,2885 @@ void help() {
 	printf("sim\t-- simulate program to completion \n");
 	printf("run <n>\t-- simulate program for <n> instructions\n");
 	printf("rdump\t-- dump register values\n");
+	printf("stats\t-- show run times, guest MIPS and (make STATS=1) op, branch and memory counters\n");
+	printf("rstep [<n>]\t-- step back <n> instructions (default 1)\n");
+	printf("rcontinue [<pc>]\t-- run back to the last time PC was <pc>, or to the start of the history\n");
 	printf("reset\t-- clears all registers/memory and re-loads the program\n");
+	printf("save <file>\t-- write registers and non-zero memory to a checkpoint file\n");
+	printf("restore <file>\t-- continue from a checkpoint file\n");
 	printf("input <reg> <val>\t-- set GPR <reg> to <val>\n");
+	printf("fork <n> [rN=<v>[+<step>]].. [hi=..] [lo=..] [max=<n>]\t-- run <n> what-if copies in parallel and report their final states\n");
 	printf("mdump <start> <stop>\t-- dump memory from <start> to <stop> address\n");
+	printf("memstats\t-- show resident guest memory, page counts and TLB hits/misses\n");
 	printf("high <val>\t-- set the HI register to <val>\n");
 	printf("low <val>\t-- set the LO register to <val>\n");
 	printf("print\t-- print the program loaded into memory\n");
+	printf("profile <on|off|clear|report [<n>]|save <file>>\t-- count instructions per PC and calls; show the <n> hottest or write callgrind format\n");
+	printf("trace <off|pc|full|binary <file>|packed <file>>\t-- set the per-instruction trace level\n");
+	printf("engine <switch|threaded|block|jit>\t-- select the interpreter core\n");
 	printf("?\t-- display help menu\n");
 	printf("quit\t-- exit the simulator\n\n");
 	printf("------------------------------------------------------------------\n\n");
 }
 
+/* shared backing for every page that has never been written */
+static const uint8_t ZERO_PAGE[PAGE_SIZE];
+
 /***************************************************************/
-/* Read a 32-bit word from memory                                                                            */
+/* Index in MEM_REGIONS of address, NUM_MEM_REGION if it is in none   */
 /***************************************************************/
-uint32_t mem_read_32(uint32_t address)
+static int mem_region_index(uint32_t address)
 {
 	int i;
 	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset+3] << 24) |
-					(MEM_REGIONS[i].mem[offset+2] << 16) |
-					(MEM_REGIONS[i].mem[offset+1] <<  8) |
-					(MEM_REGIONS[i].mem[offset+0] <<  0);
+		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
+			return i;
 		}
 	}
-	return 0;
+	return NUM_MEM_REGION;
 }
 
 /***************************************************************/
-/* Write a 32-bit word to memory                                                                                */
+/* Return TRUE if address falls inside one of MEM_REGIONS            */
+/***************************************************************/
+static int mem_in_region(uint32_t address)
+{
+	return mem_region_index(address) < NUM_MEM_REGION;
+}
+
+/***************************************************************/
+/* Page of pt backing a guest address, or NULL if there is none      */
+/***************************************************************/
+static uint8_t *table_lookup(const page_table_t *pt, uint32_t address)
+{
+	uint8_t **table = pt->dir[address >> (PAGE_SHIFT + PT_L2_BITS)];
+	if (table == NULL) {
+		return NULL;
+	}
+	return table[(address >> PAGE_SHIFT) & (PT_L2_SIZE - 1)];
+}
+
+/***************************************************************/
+/* Slot of pt for a guest address, allocating its table on demand  */
+/***************************************************************/
+static uint8_t **table_slot(page_table_t *pt, uint32_t address)
+{
+	uint8_t ***table = &pt->dir[address >> (PAGE_SHIFT + PT_L2_BITS)];
+
+	if (*table == NULL) {
+		*table = calloc(PT_L2_SIZE, sizeof(uint8_t *));
+		if (*table == NULL) {
+			printf("Error: Out of memory allocating page table\n");
+			exit(-1);
+		}
+		pt->tables++;
+	}
+	return &(*table)[(address >> PAGE_SHIFT) & (PT_L2_SIZE - 1)];
+}
+
+/***************************************************************/
+/* Release a guest page: heap pages are freed, pages of a mapped    */
+/* checkpoint go away with the mapping                                                      */
+/***************************************************************/
+static void page_free(const mips_machine *m, uint8_t *page)
+{
+	if (m != NULL && page >= m->ckpt_map && page < m->ckpt_map + m->ckpt_map_size) {
+		return;
+	}
+	free(page);
+}
+
+/***************************************************************/
+/* Free every page and table of pt (m: the machine owning the pages, */
+/* NULL for a table of plain heap copies)                                               */
+/***************************************************************/
+static void table_free(const mips_machine *m, page_table_t *pt)
+{
+	uint32_t i, j;
+	for (i = 0; i < PT_L1_SIZE; i++) {
+		if (pt->dir[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_L2_SIZE; j++) {
+			page_free(m, pt->dir[i][j]);
+		}
+		free(pt->dir[i]);
+	}
+	memset(pt, 0, sizeof(page_table_t));
+}
+
+/***************************************************************/
+/* Host page backing a guest address, or NULL if never written  */
+/***************************************************************/
+static uint8_t *page_lookup(mips_machine *m, uint32_t address)
+{
+	return table_lookup(&m->page_table, address);
+}
+
+/***************************************************************/
+/* Note the first write to a page since the snapshot or last reset */
+/***************************************************************/
+static void snapshot_mark_dirty(mips_machine *m, uint32_t address)
+{
+	snapshot_t *snap = &m->snapshot;
+	uint32_t page = address >> PAGE_SHIFT;
+	uint32_t *grown;
+
+	if (snap->dirty_map == NULL || (snap->dirty_map[page >> 6] & (1ull << (page & 63)))) {
+		return;
+	}
+	if (snap->dirty_count == snap->dirty_capacity) {
+		snap->dirty_capacity = snap->dirty_capacity ? snap->dirty_capacity * 2 : 64;
+		grown = realloc(snap->dirty, snap->dirty_capacity * sizeof(uint32_t));
+		if (grown == NULL) {
+			printf("Error: Out of memory tracking dirty pages\n");
+			exit(-1);
+		}
+		snap->dirty = grown;
+	}
+	snap->dirty_map[page >> 6] |= 1ull << (page & 63);
+	snap->dirty[snap->dirty_count++] = page;
+}
+
+/***************************************************************/
+/* Forget which pages were written                                                                      */
+/***************************************************************/
+static void snapshot_clear_dirty(mips_machine *m)
+{
+	snapshot_t *snap = &m->snapshot;
+	uint32_t i, page;
+
+	for (i = 0; i < snap->dirty_count; i++) {
+		page = snap->dirty[i];
+		snap->dirty_map[page >> 6] &= ~(1ull << (page & 63));
+	}
+	snap->dirty_count = 0;
+}
+
+/***************************************************************/
+/* Before the first write to a page in a history interval, keep a   */
+/* copy of the page (or note that it was not resident) to undo it     */
+/***************************************************************/
+static void history_save_page(mips_machine *m, uint32_t address)
+{
+	history_t *hist = &m->history;
+	uint32_t page = address >> PAGE_SHIFT;
+	history_undo_t *grown, *rec;
+	const uint8_t *current;
+
+	if (!hist->enabled || (hist->saved_map[page >> 6] & (1ull << (page & 63)))) {
+		return;
+	}
+	if (hist->num_undo == hist->undo_capacity) {
+		hist->undo_capacity = hist->undo_capacity ? hist->undo_capacity * 2 : 64;
+		grown = realloc(hist->undo, hist->undo_capacity * sizeof(history_undo_t));
+		if (grown == NULL) {
+			printf("Error: Out of memory recording history\n");
+			exit(-1);
+		}
+		hist->undo = grown;
+	}
+	rec = &hist->undo[hist->num_undo++];
+	rec->page = page;
+	rec->data = NULL;
+	current = page_lookup(m, address);
+	if (current != NULL) {
+		rec->data = malloc(PAGE_SIZE);
+		if (rec->data == NULL) {
+			printf("Error: Out of memory recording history\n");
+			exit(-1);
+		}
+		memcpy(rec->data, current, PAGE_SIZE);
+		hist->undo_bytes += PAGE_SIZE;
+	}
+	hist->saved_map[page >> 6] |= 1ull << (page & 63);
+}
+
+/***************************************************************/
+/* Host page for reading: unmapped pages read as zero                 */
+/***************************************************************/
+static uint8_t *page_for_read(mips_machine *m, uint32_t address)
+{
+	uint8_t *page = page_lookup(m, address);
+	return page ? page : (uint8_t *)ZERO_PAGE;
+}
+
+/***************************************************************/
+/* Host page for writing: allocate the page (and table) on demand */
+/***************************************************************/
+static uint8_t *page_for_write(mips_machine *m, uint32_t address)
+{
+	uint8_t **page = table_slot(&m->page_table, address);
+	tlb_entry_t *entry;
+
+	/* every write TLB refill comes through here */
+	snapshot_mark_dirty(m, address);
+	history_save_page(m, address);
+	if (*page == NULL) {
+		*page = calloc(1, PAGE_SIZE);
+		if (*page == NULL) {
+			printf("Error: Out of memory allocating guest page\n");
+			exit(-1);
+		}
+		m->page_table.resident_pages++;
+
+		/* a cached read translation may still point at the zero page */
+		entry = &m->tlb.read[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+		if (entry->tag == (address & ~PAGE_MASK)) {
+			entry->tag = TLB_INVALID;
+		}
+	}
+	return *page;
+}
+
+/***************************************************************/
+/* Make host (a page of m->ckpt_map) the guest page at address,     */
+/* as checkpoint_restore does for its pages                                       */
+/***************************************************************/
+void mem_map_page(mips_machine *m, uint32_t address, uint8_t *host)
+{
+	uint8_t **page = table_slot(&m->page_table, address);
+	uint32_t tag = address & ~PAGE_MASK, i = (address >> PAGE_SHIFT) & (TLB_SIZE - 1);
+
+	if (*page != NULL) {
+		page_free(m, *page);
+	}
+	else {
+		m->page_table.resident_pages++;
+	}
+	*page = host;
+	if (m->tlb.read[i].tag == tag) {
+		m->tlb.read[i].tag = TLB_INVALID;
+	}
+	if (m->tlb.write[i].tag == tag) {
+		m->tlb.write[i].tag = TLB_INVALID;
+	}
+}
+
+/***************************************************************/
+/* Drop every cached translation                                                                         */
+/***************************************************************/
+static void tlb_flush(mips_machine *m)
+{
+	uint32_t i;
+	for (i = 0; i < TLB_SIZE; i++) {
+		m->tlb.read[i].tag = TLB_INVALID;
+		m->tlb.write[i].tag = TLB_INVALID;
+	}
+}
+
+/***************************************************************/
+/* Allocate the decoded-instruction page covering a text address */
+/***************************************************************/
+static decoded_inst_t *decode_page_alloc(mips_machine *m, uint32_t address)
+{
+	decoded_inst_t **page = &m->decode_cache[(address - MEM_TEXT_BEGIN) >> PAGE_SHIFT];
+	tlb_entry_t *entry;
+
+	/* OP_UNDECODED is 0, so a zeroed page is all undecoded */
+	*page = calloc(PAGE_SIZE / 4, sizeof(decoded_inst_t));
+	if (*page == NULL) {
+		printf("Error: Out of memory allocating decode cache\n");
+		exit(-1);
+	}
+
+	/* stores to this page must now take the slow path to invalidate */
+	entry = &m->tlb.write[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+	if (entry->tag == (address & ~PAGE_MASK)) {
+		entry->tag = TLB_INVALID;
+	}
+	return *page;
+}
+
+/***************************************************************/
+/* Forget decoded records for the words a store touches               */
+/***************************************************************/
+static int decode_invalidate(mips_machine *m, uint32_t address)
+{
+	uint32_t first, last, a;
+	decoded_inst_t *page;
+	int cached = FALSE;
+
+	first = (address & ~0x3) - MEM_TEXT_BEGIN;
+	last = ((address + 3) & ~0x3) - MEM_TEXT_BEGIN;
+	for (a = first; a <= last; a += 4) {
+		if (a >= TEXT_SIZE) {
+			continue;
+		}
+		page = m->decode_cache[a >> PAGE_SHIFT];
+		if (page != NULL) {
+			page[(a & PAGE_MASK) >> 2].op = OP_UNDECODED;
+			cached = TRUE;
+		}
+	}
+	if (cached) {
+		m->code_generation++;
+	}
+	return cached;
+}
+
+/***************************************************************/
+/* Drop every decoded instruction                                                                         */
+/***************************************************************/
+void decode_cache_flush(mips_machine *m)
+{
+	uint32_t i;
+	for (i = 0; i < TEXT_PAGES; i++) {
+		free(m->decode_cache[i]);
+		m->decode_cache[i] = NULL;
+	}
+}
+
+/* native little-endian word access on a host page */
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	return value;
+}
+
+static inline void store_le32(uint8_t *p, uint32_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	memcpy(p, &value, 4);
+}
+
 /***************************************************************/
-void mem_write_32(uint32_t address, uint32_t value)
+/* TLB miss path for reads: walk the regions and refill                   */
+/***************************************************************/
+static uint32_t mem_read_32_slow(mips_machine *m, uint32_t address)
 {
+	tlb_entry_t *entry;
+	uint32_t offset, value;
 	int i;
+
+	m->tlb.misses++;
+	if (STATS_ENABLED) {
+		m->stats.read_walks++;
+	}
+	if (!mem_in_region(address)) {
+		return 0;
+	}
+
+	offset = address & PAGE_MASK;
+	if (offset <= PAGE_SIZE - 4) {
+		entry = &m->tlb.read[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+		entry->tag = address & ~PAGE_MASK;
+		entry->host = page_for_read(m, address);
+		return load_le32(entry->host + offset);
+	}
+
+	/* unaligned word straddling two pages */
+	value = 0;
+	for (i = 0; i < 4; i++) {
+		value |= page_for_read(m, address + i)[(address + i) & PAGE_MASK] << (8 * i);
+	}
+	return value;
+}
+
+/***************************************************************/
+/* TLB miss path for writes: walk the regions and refill                  */
+/***************************************************************/
+static void mem_write_32_slow(mips_machine *m, uint32_t address, uint32_t value)
+{
+	tlb_entry_t *entry;
 	uint32_t offset;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
-			offset = address - MEM_REGIONS[i].begin;
+	int i;
 
-			MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
-		}
+	m->tlb.misses++;
+	if (!mem_in_region(address)) {
+		return;
+	}
+
+	/* pages holding decoded code never get a write translation */
+	offset = address & PAGE_MASK;
+	if (!decode_invalidate(m, address) && offset <= PAGE_SIZE - 4) {
+		entry = &m->tlb.write[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+		entry->tag = address & ~PAGE_MASK;
+		entry->host = page_for_write(m, address);
+		store_le32(entry->host + offset, value);
+		return;
+	}
+
+	/* unaligned or code-page store, one byte at a time */
+	for (i = 0; i < 4; i++) {
+		page_for_write(m, address + i)[(address + i) & PAGE_MASK] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+/***************************************************************/
+/* Read a 32-bit word from memory                                                                            */
+/***************************************************************/
+uint32_t mem_read_32(mips_machine *m, uint32_t address)
+{
+	const tlb_entry_t *entry = &m->tlb.read[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+	uint32_t offset = address & PAGE_MASK;
+
+	if (entry->tag == (address & ~PAGE_MASK) && offset <= PAGE_SIZE - 4) {
+		m->tlb.hits++;
+		return load_le32(entry->host + offset);
+	}
+	return mem_read_32_slow(m, address);
+}
+
+/***************************************************************/
+/* Write a 32-bit word to memory                                                                                */
+/***************************************************************/
+void mem_write_32(mips_machine *m, uint32_t address, uint32_t value)
+{
+	const tlb_entry_t *entry = &m->tlb.write[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+	uint32_t offset = address & PAGE_MASK;
+
+	if (entry->tag == (address & ~PAGE_MASK) && offset <= PAGE_SIZE - 4) {
+		m->tlb.hits++;
+		store_le32(entry->host + offset, value);
+		return;
 	}
+	mem_write_32_slow(m, address, value);
 }
 
+static inline __attribute__((always_inline)) void execute_instruction(mips_machine *m, const int trace);
+
 /***************************************************************/
 /* Execute one cycle                                                                                                              */
 /***************************************************************/
-void cycle() {                                                
-	handle_instruction();
-	CURRENT_STATE = NEXT_STATE;
-	INSTRUCTION_COUNT++;
+void cycle(mips_machine *m) {                                                
+	handle_instruction(m);
+	m->instruction_count++;
+}
+
+/***************************************************************/
+/* Execute up to num_cycles cycles with trace fixed at compile time */
+/***************************************************************/
+static inline __attribute__((always_inline)) uint32_t run_loop(mips_machine *m, uint32_t num_cycles, const int trace) {
+	uint32_t i;
+	for (i = 0; i < num_cycles && m->run_flag; i++) {
+		execute_instruction(m, trace);
+		m->instruction_count++;
+	}
+	return i;
+}
+
+static uint32_t run_threaded(mips_machine *m, uint32_t budget);
+static uint32_t run_blocks(mips_machine *m, uint32_t budget);
+static uint32_t run_jit(mips_machine *m, uint32_t budget);
+
+/***************************************************************/
+/* Execute up to num_cycles cycles on the machine's engine                 */
+/***************************************************************/
+static uint32_t run_engine(mips_machine *m, uint32_t num_cycles) {
+	uint32_t executed;
+
+	if (m->profile != NULL && m->profile->on && m->trace_level == TRACE_OFF) {
+		return run_loop(m, num_cycles, TRACE_PROFILE);
+	}
+	if (m->engine != ENGINE_SWITCH && m->trace_level == TRACE_OFF) {
+		switch (m->engine) {
+			case ENGINE_BLOCK:
+				executed = run_blocks(m, num_cycles);
+				break;
+			case ENGINE_JIT:
+				executed = run_jit(m, num_cycles);
+				break;
+			default:
+				executed = run_threaded(m, num_cycles);
+				break;
+		}
+		m->instruction_count += executed;
+		return executed;
+	}
+
+	switch (m->trace_level) {
+		case TRACE_OFF:
+			return run_loop(m, num_cycles, TRACE_OFF);
+		case TRACE_PC:
+			return run_loop(m, num_cycles, TRACE_PC);
+		case TRACE_BINARY:
+			return run_loop(m, num_cycles, TRACE_BINARY);
+		default:
+			return run_loop(m, num_cycles, TRACE_FULL);
+	}
+}
+
+/***************************************************************/
+/* Execute up to num_cycles cycles; returns the number executed   */
+/***************************************************************/
+uint32_t run_cycles(mips_machine *m, uint32_t num_cycles) {
+	uint32_t executed = 0, step, left;
+	history_t *hist = &m->history;
+
+	if (m->record == NULL && !hist->enabled) {
+		return run_engine(m, num_cycles);
+	}
+	/* stop at every state hash and history point on the way */
+	while (executed < num_cycles && m->run_flag) {
+		step = num_cycles - executed;
+		if (m->record != NULL) {
+			step = record_budget(m, step);
+		}
+		if (hist->enabled) {
+			left = hist->points[hist->num_points - 1].instruction_count + HISTORY_INTERVAL - m->instruction_count;
+			step = step < left ? step : left;
+		}
+		step = run_engine(m, step);
+		executed += step;
+		if (m->record != NULL) {
+			record_ran(m, step);
+		}
+		if (hist->enabled && m->instruction_count - hist->points[hist->num_points - 1].instruction_count >= HISTORY_INTERVAL) {
+			history_point(m);
+		}
+	}
+	return executed;
+}
+
+/***************************************************************/
+/* Monotonic host time in nanoseconds                                                             */
+/***************************************************************/
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/***************************************************************/
+/* Report host time spent per simulated instruction                       */
+/***************************************************************/
+static void report_speed(uint64_t executed, uint64_t ns) {
+	printf("Simulated %llu instructions in %.3f ms", (unsigned long long)executed, ns / 1e6);
+	if (executed > 0) {
+		printf(" (%.2f ns/instruction)", (double)ns / executed);
+	}
+	printf("\n\n");
+}
+
+/***************************************************************/
+/* Account and report one run/sim command                                                 */
+/***************************************************************/
+static void stats_run(mips_machine *m, uint64_t executed, uint64_t ns) {
+	m->stats.runs++;
+	m->stats.run_ns += ns;
+	m->stats.run_instructions += executed;
+	m->stats.last_run_ns = ns;
+	m->stats.last_run_instructions = executed;
+	report_speed(executed, ns);
 }
 
 /***************************************************************/
 /* Simulate MIPS for n cycles                                                                                       */
 /***************************************************************/
-void run(int num_cycles) {                                      
+void run(mips_machine *m, int num_cycles) {                                      
+	uint32_t executed = 0;
+	uint64_t start;
 	
-	if (RUN_FLAG == FALSE) {
+	if (m->run_flag == FALSE) {
 		printf("Simulation Stopped\n\n");
 		return;
 	}
 
 	printf("Running simulator for %d cycles...\n\n", num_cycles);
-	int i;
-	for (i = 0; i < num_cycles; i++) {
-		if (RUN_FLAG == FALSE) {
-			printf("Simulation Stopped.\n\n");
-			break;
-		}
-		cycle();
+	start = now_ns();
+	if (num_cycles > 0) {
+		executed = run_cycles(m, num_cycles);
+	}
+	if (num_cycles > 0 && executed < (uint32_t)num_cycles) {
+		printf("Simulation Stopped.\n\n");
 	}
+	stats_run(m, executed, now_ns() - start);
 }
 
 /***************************************************************/
 /* simulate to completion                                                                                               */
 /***************************************************************/
-void runAll() {                                                     
-	if (RUN_FLAG == FALSE) {
+void runAll(mips_machine *m) {                                                     
+	uint64_t executed = 0, start;
+
+	if (m->run_flag == FALSE) {
 		printf("Simulation Stopped.\n\n");
 		return;
 	}
 
-	printf("Simulation Started...\n\n");
-	while (RUN_FLAG){
-		cycle();
+	printf("Simulation Started...\n\n");
+	start = now_ns();
+	while (m->run_flag){
+		executed += run_cycles(m, UINT32_MAX);
+	}
+	printf("Simulation Finished.\n\n");
+	stats_run(m, executed, now_ns() - start);
+}
+
+/***************************************************************/ 
+/* Dump a word-aligned region of memory to out                                                    */
+/***************************************************************/
+void mdump_to(mips_machine *m, FILE *out, uint32_t start, uint32_t stop) {          
+	uint32_t address;
+
+	fprintf(out, "-------------------------------------------------------------\n");
+	fprintf(out, "Memory content [0x%08x..0x%08x] :\n", start, stop);
+	fprintf(out, "-------------------------------------------------------------\n");
+	fprintf(out, "\t[Address in Hex (Dec) ]\t[Value]\n");
+	for (address = start; address <= stop; address += 4){
+		fprintf(out, "\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(m, address));
+	}
+	fprintf(out, "\n");
+}
+
+/***************************************************************/ 
+/* Dump a word-aligned region of memory to the terminal                              */
+/***************************************************************/
+void mdump(mips_machine *m, uint32_t start, uint32_t stop) {          
+	mdump_to(m, stdout, start, stop);
+}
+
+/***************************************************************/
+/* Dump current values of registers to out                                                               */   
+/***************************************************************/
+void rdump_to(mips_machine *m, FILE *out) {                               
+	int i; 
+	fprintf(out, "-------------------------------------\n");
+	fprintf(out, "Dumping Register Content\n");
+	fprintf(out, "-------------------------------------\n");
+	fprintf(out, "# Instructions Executed\t: %u\n", m->instruction_count);
+	fprintf(out, "PC\t: 0x%08x\n", m->cpu.PC);
+	fprintf(out, "-------------------------------------\n");
+	fprintf(out, "[Register]\t[Value]\n");
+	fprintf(out, "-------------------------------------\n");
+	for (i = 0; i < MIPS_REGS; i++){
+		fprintf(out, "[R%d]\t: 0x%08x\n", i, m->cpu.REGS[i]);
+	}
+	fprintf(out, "-------------------------------------\n");
+	fprintf(out, "[HI]\t: 0x%08x\n", m->cpu.HI);
+	fprintf(out, "[LO]\t: 0x%08x\n", m->cpu.LO);
+	fprintf(out, "-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Dump current values of registers to the teminal                                              */   
+/***************************************************************/
+void rdump(mips_machine *m) {                               
+	rdump_to(m, stdout);
+}
+
+/***************************************************************/
+/* profile <on|off|clear|report [<n>]|save <file>>                                   */
+/***************************************************************/
+static void profile_command(mips_machine *m) {
+	char buffer[20], line[1024];
+	char path[PROG_FILE_MAX];
+	uint32_t top = 0;
+
+	if (scanf("%19s", buffer) != 1){
+		return;
+	}
+	if (strcmp(buffer, "on") == 0){
+		profile_start(m);
+	}
+	else if (strcmp(buffer, "off") == 0){
+		profile_stop(m);
+	}
+	else if (strcmp(buffer, "clear") == 0){
+		profile_clear(m);
+	}
+	else if (strcmp(buffer, "report") == 0){
+		if (fgets(line, sizeof(line), stdin) != NULL){
+			sscanf(line, "%u", &top);
+		}
+		profile_report(m, top);
+	}
+	else if (strcmp(buffer, "save") == 0 && scanf("%4095s", path) == 1){
+		profile_save(m, path);
+	}
+	else {
+		printf("Invalid profile command %s (use on, off, clear, report [<n>] or save <file>).\n", buffer);
+	}
+}
+
+/***************************************************************/
+/* Read a command from standard input.                                                               */  
+/***************************************************************/
+void handle_command(mips_machine *m) {                         
+	char buffer[20];
+	char path[PROG_FILE_MAX];
+	uint32_t children;
+	char line[1024];
+	uint32_t start, stop, cycles;
+	uint32_t register_no;
+	int register_value;
+	int hi_reg_value, lo_reg_value;
+
+	printf("MU-MIPS SIM:> ");
+
+	if (scanf("%s", buffer) == EOF){
+		exit(0);
+	}
+
+	switch(buffer[0]) {
+		case 'S':
+		case 's':
+			if (strcmp(buffer, "save") == 0){
+				if (scanf("%4095s", path) == 1){
+					checkpoint_save(m, path);
+				}
+				break;
+			}
+			if (strcmp(buffer, "stats") == 0){
+				stats_print(m);
+				break;
+			}
+			runAll(m); 
+			break;
+		case 'M':
+		case 'm':
+			if (strcmp(buffer, "memstats") == 0){
+				mem_stats(m);
+				break;
+			}
+			if (scanf("%x %x", &start, &stop) != 2){
+				break;
+			}
+			mdump(m, start, stop);
+			break;
+		case '?':
+			help();
+			break;
+		case 'Q':
+		case 'q':
+			printf("**************************\n");
+			printf("Exiting MU-MIPS! Good Bye...\n");
+			printf("**************************\n");
+			exit(0);
+		case 'R':
+		case 'r':
+			if (buffer[1] == 'd' || buffer[1] == 'D'){
+				rdump(m);
+			}else if (strcmp(buffer, "rstep") == 0){
+				if (fgets(line, sizeof(line), stdin) == NULL || sscanf(line, "%u", &cycles) != 1){
+					cycles = 1;
+				}
+				rstep(m, cycles);
+			}else if (strcmp(buffer, "rcontinue") == 0){
+				if (fgets(line, sizeof(line), stdin) == NULL || sscanf(line, "%x", &start) != 1){
+					rcontinue(m, FALSE, 0);
+				}else{
+					rcontinue(m, TRUE, start);
+				}
+			}else if (strcmp(buffer, "restore") == 0){
+				/*log the state being left, then where it went*/
+				if (scanf("%4095s", path) == 1){
+					record_event(m, REPLAY_HASH, 0, 0, NULL);
+					if (checkpoint_restore(m, path) == 0){
+						record_event(m, REPLAY_RESTORE, 0, 0, path);
+					}
+				}
+			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
+				record_event(m, REPLAY_HASH, 0, 0, NULL);
+				if (reset(m) != 0) {
+					exit(-1);
+				}
+				record_event(m, REPLAY_RESET, 0, 0, NULL);
+			}
+			else {
+				if (scanf("%d", &cycles) != 1) {
+					break;
+				}
+				run(m, cycles);
+			}
+			break;
+		case 'I':
+		case 'i':
+			if (scanf("%u %i", &register_no, &register_value) != 2){
+				break;
+			}
+			if (register_no == 0 || register_no >= MIPS_REGS){
+				printf("Register $r%u is not writable.\n", register_no);
+				break;
+			}
+			m->cpu.REGS[register_no] = register_value;
+			history_point(m);
+			record_event(m, REPLAY_INPUT, register_no, register_value, NULL);
+			break;
+		case 'H':
+		case 'h':
+			if (scanf("%i", &hi_reg_value) != 1){
+				break;
+			}
+			m->cpu.HI = hi_reg_value; 
+			history_point(m);
+			record_event(m, REPLAY_HI, 0, hi_reg_value, NULL);
+			break;
+		case 'L':
+		case 'l':
+			if (scanf("%i", &lo_reg_value) != 1){
+				break;
+			}
+			m->cpu.LO = lo_reg_value;
+			history_point(m);
+			record_event(m, REPLAY_LO, 0, lo_reg_value, NULL);
+			break;
+		case 'P':
+		case 'p':
+			if (strcmp(buffer, "profile") == 0){
+				profile_command(m);
+				break;
+			}
+			print_program(m); 
+			break;
+		case 'F':
+		case 'f':
+			if (strcmp(buffer, "fork") != 0 || scanf("%u", &children) != 1){
+				printf("Invalid Command.\n");
+				break;
+			}
+			if (fgets(line, sizeof(line), stdin) == NULL){
+				line[0] = '\0';
+			}
+			fork_run(m, children, line);
+			break;
+		case 'E':
+		case 'e':
+			if (scanf("%19s", buffer) != 1){
+				break;
+			}
+			if (set_engine(m, buffer) != 0){
+				printf("Invalid engine %s (use switch, threaded, block or jit).\n", buffer);
+			}
+			break;
+		case 'T':
+		case 't':
+			if (scanf("%19s", buffer) != 1){
+				break;
+			}
+			if (strcmp(buffer, "binary") == 0 || strcmp(buffer, "packed") == 0){
+				if (scanf("%4095s", path) == 1){
+					set_binary_trace(m, path, buffer[0] == 'p');
+				}
+				break;
+			}
+			if (set_trace_level(m, buffer) != 0){
+				printf("Invalid trace level %s (use off, pc, full, binary <file> or packed <file>).\n", buffer);
+			}
+			break;
+		default:
+			printf("Invalid Command.\n");
+			break;
+	}
+}
+
+static void history_restart(mips_machine *m);
+
+/***************************************************************/
+/* reset registers/memory and reload program; -1 if it can't be read */
+/***************************************************************/
+int reset(mips_machine *m) {   
+	int i;
+
+	/*same program as the snapshot: restore only the pages written since*/
+	if (snapshot_restore(m) == 0) {
+		if (!m->quiet) {
+			printf("Program restored from snapshot.\n\n");
+		}
+		history_restart(m);
+		return 0;
+	}
+
+	/*reset registers*/
+	for (i = 0; i < MIPS_REGS; i++){
+		m->cpu.REGS[i] = 0;
+	}
+	m->cpu.HI = 0;
+	m->cpu.LO = 0;
+	
+	/*release every guest page; untouched memory reads as zero*/
+	free_memory(m);
+	decode_cache_flush(m);
+	block_cache_flush(m);
+	/*the snapshot described that memory, even if the load below fails*/
+	m->snapshot.valid = FALSE;
+	
+	/*load program*/
+	if (load_program(m) != 0) {
+		return -1;
+	}
+	
+	/*start over at the entry point load_program set*/
+	m->instruction_count = 0;
+	m->run_flag = TRUE;
+	snapshot_take(m);
+	history_restart(m);
+	return 0;
+}
+
+/***************************************************************/
+/* Set up an empty page table; pages are allocated on first write */
+/***************************************************************/
+void init_memory(mips_machine *m) {                                           
+	memset(&m->page_table, 0, sizeof(m->page_table));
+	tlb_flush(m);
+}
+
+/***************************************************************/
+/* Release every guest page and page table                                                           */
+/***************************************************************/
+void free_memory(mips_machine *m) {
+	table_free(m, &m->page_table);
+	if (m->ckpt_map != NULL) {
+		munmap(m->ckpt_map, m->ckpt_map_size);
+		m->ckpt_map = NULL;
+		m->ckpt_map_size = 0;
+	}
+	if (m->snapshot.dirty_map != NULL) {
+		snapshot_clear_dirty(m);
+	}
+	init_memory(m);
+}
+
+/***************************************************************/
+/* Identity of the program file, to notice it changing on disk      */
+/***************************************************************/
+static int prog_file_identity(const char *path, uint64_t id[4])
+{
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return -1;
+	}
+	id[0] = st.st_dev;
+	id[1] = st.st_ino;
+	id[2] = st.st_size;
+	id[3] = st.st_mtime;
+	return 0;
+}
+
+/***************************************************************/
+/* Make the current machine state (just after a load) the golden      */
+/* image reset restores                                                                                         */
+/***************************************************************/
+void snapshot_take(mips_machine *m) {
+	snapshot_t *snap = &m->snapshot;
+	uint64_t id[4] = { 0, 0, 0, 0 };
+	uint8_t **copy;
+	uint32_t i, j, address;
+
+	table_free(NULL, &snap->pages);
+	if (snap->dirty_map == NULL) {
+		snap->dirty_map = calloc((1u << (32 - PAGE_SHIFT)) / 64, sizeof(uint64_t));
+		if (snap->dirty_map == NULL) {
+			printf("Error: Out of memory allocating snapshot\n");
+			exit(-1);
+		}
+	}
+	for (i = 0; i < PT_L1_SIZE; i++) {
+		if (m->page_table.dir[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_L2_SIZE; j++) {
+			if (m->page_table.dir[i][j] == NULL) {
+				continue;
+			}
+			address = (i << (PAGE_SHIFT + PT_L2_BITS)) | (j << PAGE_SHIFT);
+			copy = table_slot(&snap->pages, address);
+			*copy = malloc(PAGE_SIZE);
+			if (*copy == NULL) {
+				printf("Error: Out of memory allocating snapshot\n");
+				exit(-1);
+			}
+			memcpy(*copy, m->page_table.dir[i][j], PAGE_SIZE);
+			snap->pages.resident_pages++;
+		}
+	}
+	snapshot_clear_dirty(m);
+
+	prog_file_identity(m->prog_file, id);
+	strcpy(snap->prog_file, m->prog_file);
+	snap->file_dev = id[0];
+	snap->file_ino = id[1];
+	snap->file_size = id[2];
+	snap->file_mtime = id[3];
+	snap->cpu = m->cpu;
+	snap->program_size = m->program_size;
+	snap->valid = TRUE;
+
+	/* the next write to any page must miss and mark it dirty */
+	tlb_flush(m);
+}
+
+/***************************************************************/
+/* Return to the snapshot if it holds the current program file:      */
+/* pages written since go back to their golden copy (or away, if   */
+/* they were blank), registers to their loaded values. Decoded code  */
+/* survives except on pages that were written. Returns 0, or -1     */
+/* (nothing changed) when there is no usable snapshot.                   */
+/***************************************************************/
+int snapshot_restore(mips_machine *m) {
+	snapshot_t *snap = &m->snapshot;
+	uint64_t id[4];
+	uint32_t i, address, text;
+	uint8_t *golden, **page;
+
+	if (!snap->valid || strcmp(snap->prog_file, m->prog_file) != 0
+			|| prog_file_identity(m->prog_file, id) != 0
+			|| id[0] != snap->file_dev || id[1] != snap->file_ino
+			|| id[2] != snap->file_size || id[3] != snap->file_mtime) {
+		return -1;
+	}
+
+	for (i = 0; i < snap->dirty_count; i++) {
+		address = snap->dirty[i] << PAGE_SHIFT;
+		page = table_slot(&m->page_table, address);
+		golden = table_lookup(&snap->pages, address);
+		if (golden != NULL) {
+			memcpy(*page, golden, PAGE_SIZE);
+		}
+		else if (*page != NULL) {
+			page_free(m, *page);
+			*page = NULL;
+			m->page_table.resident_pages--;
+		}
+
+		/* records decoded from the overwritten code are stale */
+		text = address - MEM_TEXT_BEGIN;
+		if (text < TEXT_SIZE && m->decode_cache[text >> PAGE_SHIFT] != NULL) {
+			free(m->decode_cache[text >> PAGE_SHIFT]);
+			m->decode_cache[text >> PAGE_SHIFT] = NULL;
+			m->code_generation++;
+		}
+	}
+	snapshot_clear_dirty(m);
+	tlb_flush(m);
+
+	m->cpu = snap->cpu;
+	m->program_size = snap->program_size;
+	m->instruction_count = 0;
+	m->run_flag = TRUE;
+	return 0;
+}
+
+/***************************************************************/
+/* Drop the snapshot and dirty-page tracking                                                 */
+/***************************************************************/
+void snapshot_release(mips_machine *m) {
+	snapshot_t *snap = &m->snapshot;
+
+	table_free(NULL, &snap->pages);
+	free(snap->dirty_map);
+	free(snap->dirty);
+	memset(snap, 0, sizeof(snapshot_t));
+}
+
+/***************************************************************/
+/* Forget the whole history (the records, not the machine state)    */
+/***************************************************************/
+static void history_clear(history_t *hist)
+{
+	uint32_t i;
+
+	for (i = 0; i < hist->num_undo; i++) {
+		free(hist->undo[i].data);
+	}
+	hist->num_undo = 0;
+	hist->num_points = 0;
+	hist->undo_bytes = 0;
+	memset(hist->saved_map, 0, (1u << (32 - PAGE_SHIFT)) / 8);
+}
+
+/***************************************************************/
+/* Start recording history for m from its current state                  */
+/***************************************************************/
+void history_enable(mips_machine *m) {
+	history_t *hist = &m->history;
+
+	if (hist->enabled) {
+		return;
+	}
+	hist->saved_map = calloc((1u << (32 - PAGE_SHIFT)) / 64, sizeof(uint64_t));
+	if (hist->saved_map == NULL) {
+		printf("Error: Out of memory recording history\n");
+		exit(-1);
+	}
+	hist->enabled = TRUE;
+	history_point(m);
+}
+
+/***************************************************************/
+/* New history from the current state (after reset or restore)         */
+/***************************************************************/
+static void history_restart(mips_machine *m)
+{
+	if (m->history.enabled) {
+		history_clear(&m->history);
+		history_point(m);
+	}
+}
+
+/***************************************************************/
+/* Drop the oldest point and the undo records of its interval         */
+/***************************************************************/
+static void history_drop_oldest(history_t *hist)
+{
+	uint32_t i, n = hist->points[1].first_undo;
+
+	for (i = 0; i < n; i++) {
+		if (hist->undo[i].data != NULL) {
+			free(hist->undo[i].data);
+			hist->undo_bytes -= PAGE_SIZE;
+		}
+	}
+	memmove(hist->undo, hist->undo + n, (hist->num_undo - n) * sizeof(history_undo_t));
+	hist->num_undo -= n;
+	memmove(hist->points, hist->points + 1, (hist->num_points - 1) * sizeof(history_point_t));
+	hist->num_points--;
+	for (i = 0; i < hist->num_points; i++) {
+		hist->points[i].first_undo -= n;
+	}
+}
+
+/***************************************************************/
+/* Take a history point at the current state                                         */
+/***************************************************************/
+void history_point(mips_machine *m) {
+	history_t *hist = &m->history;
+	history_point_t *top, *grown;
+	uint32_t i, page;
+
+	if (!hist->enabled) {
+		return;
+	}
+	top = hist->num_points > 0 ? &hist->points[hist->num_points - 1] : NULL;
+
+	/* nothing ran since the last point (registers set twice): move it */
+	if (top == NULL || top->instruction_count != m->instruction_count || top->first_undo != hist->num_undo) {
+		/* records of the interval just ended stay; its pages need new ones */
+		for (i = top != NULL ? top->first_undo : 0; i < hist->num_undo; i++) {
+			page = hist->undo[i].page;
+			hist->saved_map[page >> 6] &= ~(1ull << (page & 63));
+		}
+		if (hist->num_points == hist->points_capacity) {
+			hist->points_capacity = hist->points_capacity ? hist->points_capacity * 2 : 64;
+			grown = realloc(hist->points, hist->points_capacity * sizeof(history_point_t));
+			if (grown == NULL) {
+				printf("Error: Out of memory recording history\n");
+				exit(-1);
+			}
+			hist->points = grown;
+		}
+		top = &hist->points[hist->num_points++];
+		top->first_undo = hist->num_undo;
+	}
+	top->instruction_count = m->instruction_count;
+	top->run_flag = m->run_flag;
+	top->cpu = m->cpu;
+
+	/* the first write to each page from here on must be seen */
+	for (i = 0; i < TLB_SIZE; i++) {
+		m->tlb.write[i].tag = TLB_INVALID;
+	}
+	while (hist->undo_bytes > HISTORY_MAX_BYTES && hist->num_points > 1) {
+		history_drop_oldest(hist);
+	}
+}
+
+/***************************************************************/
+/* Roll the machine back to history point k, dropping later points */
+/***************************************************************/
+static void history_rewind(mips_machine *m, uint32_t k)
+{
+	history_t *hist = &m->history;
+	const history_point_t *point = &hist->points[k];
+	history_undo_t *rec;
+	uint32_t i, address, text;
+	uint8_t **slot;
+
+	/* newest first, so each page ends up as it was at the point */
+	for (i = hist->num_undo; i-- > point->first_undo; ) {
+		rec = &hist->undo[i];
+		address = rec->page << PAGE_SHIFT;
+		slot = table_slot(&m->page_table, address);
+		if (rec->data == NULL) {
+			if (*slot != NULL) {
+				page_free(m, *slot);
+				*slot = NULL;
+				m->page_table.resident_pages--;
+			}
+		}
+		else {
+			if (*slot != NULL) {
+				memcpy(*slot, rec->data, PAGE_SIZE);
+				free(rec->data);
+			}
+			else {
+				*slot = rec->data;
+				m->page_table.resident_pages++;
+			}
+			hist->undo_bytes -= PAGE_SIZE;
+		}
+		hist->saved_map[rec->page >> 6] &= ~(1ull << (rec->page & 63));
+
+		/* records decoded from the overwritten code are stale */
+		text = address - MEM_TEXT_BEGIN;
+		if (text < TEXT_SIZE && m->decode_cache[text >> PAGE_SHIFT] != NULL) {
+			free(m->decode_cache[text >> PAGE_SHIFT]);
+			m->decode_cache[text >> PAGE_SHIFT] = NULL;
+			m->code_generation++;
+		}
+	}
+	hist->num_undo = point->first_undo;
+	hist->num_points = k + 1;
+	tlb_flush(m);
+
+	m->cpu = point->cpu;
+	m->instruction_count = point->instruction_count;
+	m->run_flag = point->run_flag;
+}
+
+/***************************************************************/
+/* Move m to instruction count target, which must not be before the */
+/* oldest point: roll back to the latest point at or before it and   */
+/* re-execute untraced. Returns 0, or -1 if target can't be reached */
+/***************************************************************/
+int history_goto(mips_machine *m, uint32_t target) {
+	history_t *hist = &m->history;
+	uint32_t k = hist->num_points;
+	int trace = m->trace_level;
+
+	while (k > 0 && hist->points[k - 1].instruction_count > target) {
+		k--;
+	}
+	if (!hist->enabled || k == 0) {
+		return -1;
+	}
+	history_rewind(m, k - 1);
+	m->trace_level = TRACE_OFF;
+	while (m->run_flag && m->instruction_count < target) {
+		run_cycles(m, target - m->instruction_count);
+	}
+	m->trace_level = trace;
+	return m->instruction_count == target ? 0 : -1;
+}
+
+/***************************************************************/
+/* Step back n instructions (no further than the oldest point)      */
+/***************************************************************/
+void rstep(mips_machine *m, uint32_t n) {
+	history_t *hist = &m->history;
+	uint32_t oldest;
+	uint64_t start;
+
+	if (!hist->enabled) {
+		printf("No execution history.\n\n");
+		return;
+	}
+	oldest = hist->points[0].instruction_count;
+	if (n > m->instruction_count - oldest) {
+		printf("History starts at instruction %u.\n", oldest);
+		n = m->instruction_count - oldest;
+	}
+	start = now_ns();
+	record_event(m, REPLAY_HASH, 0, 0, NULL);
+	history_goto(m, m->instruction_count - n);
+	record_event(m, REPLAY_REWIND, 0, 0, NULL);
+	printf("Stepped back to instruction %u, PC 0x%08x (%.3f ms)\n\n",
+		m->instruction_count, m->cpu.PC, (now_ns() - start) / 1e6);
+}
+
+/***************************************************************/
+/* Run backwards to the last earlier state with PC == pc, or to the   */
+/* start of the history when there is none (or has_pc is FALSE)       */
+/***************************************************************/
+void rcontinue(mips_machine *m, int has_pc, uint32_t pc) {
+	history_t *hist = &m->history;
+	uint32_t k, from, end, hit = 0;
+	int found = FALSE, engine, trace;
+	uint64_t start;
+
+	if (!hist->enabled) {
+		printf("No execution history.\n\n");
+		return;
+	}
+	start = now_ns();
+	record_event(m, REPLAY_HASH, 0, 0, NULL);
+
+	/* scan one interval at a time, newest first, one instruction at a time */
+	end = m->instruction_count;
+	for (k = hist->num_points; has_pc && !found && k-- > 0; ) {
+		from = hist->points[k].instruction_count;
+		if (from >= end) {
+			continue;
+		}
+		history_goto(m, from);
+		engine = m->engine;
+		trace = m->trace_level;
+		m->engine = ENGINE_SWITCH;
+		m->trace_level = TRACE_OFF;
+		while (m->run_flag && m->instruction_count < end) {
+			if (m->cpu.PC == pc) {
+				hit = m->instruction_count;
+				found = TRUE;
+			}
+			run_engine(m, 1);
+		}
+		m->engine = engine;
+		m->trace_level = trace;
+		end = from;
+	}
+
+	if (found) {
+		history_goto(m, hit);
+	}
+	else {
+		history_goto(m, hist->points[0].instruction_count);
+		printf("Reached the start of the history.\n");
+	}
+	record_event(m, REPLAY_REWIND, 0, 0, NULL);
+	printf("Stepped back to instruction %u, PC 0x%08x (%.3f ms)\n\n",
+		m->instruction_count, m->cpu.PC, (now_ns() - start) / 1e6);
+}
+
+/***************************************************************/
+/* Drop the history and stop recording it                                             */
+/***************************************************************/
+void history_release(mips_machine *m) {
+	history_t *hist = &m->history;
+
+	if (hist->saved_map != NULL) {
+		history_clear(hist);
+	}
+	free(hist->points);
+	free(hist->undo);
+	free(hist->saved_map);
+	memset(hist, 0, sizeof(history_t));
+}
+
+/***************************************************************/
+/* Checkpoint file.                                                                                                 */
+/*                                                                                                                     */
+/* Little-endian throughout:                                                                            */
+/*   ckpt_header_t                                                                                                */
+/*   num_pages x uint32_t guest page numbers, ascending                  */
+/*   zero padding up to data_offset (a multiple of PAGE_SIZE)            */
+/*   num_pages x PAGE_SIZE bytes of page contents, in index order      */
+/* Only pages holding a non-zero byte are written. Page data sits on */
+/* PAGE_SIZE boundaries so restore can map it in place.                     */
+/***************************************************************/
+#define CKPT_MAGIC "MUMIPSCK"
+#define CKPT_VERSION 2
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t pc, regs[MIPS_REGS], hi, lo;
+	uint32_t instruction_count;
+	uint32_t run_flag;
+	uint32_t program_size;
+	uint32_t big_endian;          /* byte order of the loaded image */
+	uint32_t num_pages;
+	uint32_t data_offset;
+	char prog_file[PROG_FILE_MAX];
+} ckpt_header_t;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CKPT_LE(x) __builtin_bswap32(x)
+#else
+#define CKPT_LE(x) (x)
+#endif
+
+/***************************************************************/
+/* Write the machine state and every non-zero guest page to path;  */
+/* returns 0, or -1 if the file can't be written                              */
+/***************************************************************/
+int checkpoint_save(mips_machine *m, const char *path) {
+	ckpt_header_t *h;
+	uint32_t *index = NULL, *grown;
+	uint32_t i, j, count = 0, capacity = 0, address;
+	const uint8_t *page;
+	size_t pad;
+	FILE *fp;
+	int ok;
+
+	for (i = 0; i < PT_L1_SIZE; i++) {
+		if (m->page_table.dir[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_L2_SIZE; j++) {
+			page = m->page_table.dir[i][j];
+			if (page == NULL || memcmp(page, ZERO_PAGE, PAGE_SIZE) == 0) {
+				continue;
+			}
+			if (count == capacity) {
+				capacity = capacity ? capacity * 2 : 64;
+				grown = realloc(index, capacity * sizeof(uint32_t));
+				if (grown == NULL) {
+					printf("Error: Out of memory writing checkpoint\n");
+					exit(-1);
+				}
+				index = grown;
+			}
+			index[count++] = (i << PT_L2_BITS) | j;
+		}
+	}
+
+	h = calloc(1, sizeof(ckpt_header_t));
+	if (h == NULL) {
+		printf("Error: Out of memory writing checkpoint\n");
+		exit(-1);
+	}
+	memcpy(h->magic, CKPT_MAGIC, sizeof(h->magic));
+	h->version = CKPT_LE(CKPT_VERSION);
+	h->page_size = CKPT_LE(PAGE_SIZE);
+	h->pc = CKPT_LE(m->cpu.PC);
+	for (i = 0; i < MIPS_REGS; i++) {
+		h->regs[i] = CKPT_LE(m->cpu.REGS[i]);
+	}
+	h->hi = CKPT_LE(m->cpu.HI);
+	h->lo = CKPT_LE(m->cpu.LO);
+	h->instruction_count = CKPT_LE(m->instruction_count);
+	h->run_flag = CKPT_LE((uint32_t)m->run_flag);
+	h->program_size = CKPT_LE(m->program_size);
+	h->big_endian = CKPT_LE((uint32_t)m->big_endian);
+	h->num_pages = CKPT_LE(count);
+	pad = sizeof(ckpt_header_t) + (size_t)count * sizeof(uint32_t);
+	h->data_offset = CKPT_LE((uint32_t)((pad + PAGE_MASK) & ~(size_t)PAGE_MASK));
+	pad = ((pad + PAGE_MASK) & ~(size_t)PAGE_MASK) - pad;
+	strcpy(h->prog_file, m->prog_file);
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		printf("Error: Can't create checkpoint %s\n", path);
+		free(h);
+		free(index);
+		return -1;
+	}
+	ok = fwrite(h, sizeof(ckpt_header_t), 1, fp) == 1;
+	for (i = 0; ok && i < count; i++) {
+		uint32_t le = CKPT_LE(index[i]);
+		ok = fwrite(&le, sizeof(le), 1, fp) == 1;
+	}
+	if (ok && pad > 0) {
+		ok = fwrite(ZERO_PAGE, pad, 1, fp) == 1;
+	}
+	for (i = 0; ok && i < count; i++) {
+		address = index[i] << PAGE_SHIFT;
+		ok = fwrite(page_lookup(m, address), PAGE_SIZE, 1, fp) == 1;
+	}
+	if (fclose(fp) != 0) {
+		ok = FALSE;
+	}
+	free(h);
+	free(index);
+	if (!ok) {
+		printf("Error: Can't write checkpoint %s\n", path);
+		return -1;
+	}
+	if (!m->quiet) {
+		printf("Checkpoint written to %s: %u pages, %u instructions.\n\n", path, count, m->instruction_count);
+	}
+	return 0;
+}
+
+/***************************************************************/
+/* Replace the machine state with the checkpoint in path. The file   */
+/* is mapped privately and its pages become guest pages in place, so */
+/* they are read in on first touch and copied on first write. Returns */
+/* 0, or -1 (machine unchanged) if the file can't be used.                 */
+/***************************************************************/
+int checkpoint_restore(mips_machine *m, const char *path) {
+	const ckpt_header_t *h;
+	const uint32_t *index;
+	struct stat st;
+	uint8_t *map, **slot;
+	uint32_t i, num_pages, data_offset, page, prev = 0;
+	int fd, in_place;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Error: Can't open checkpoint %s\n", path);
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ckpt_header_t)) {
+		printf("Error: %s is not a checkpoint\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Error: Can't map checkpoint %s\n", path);
+		return -1;
+	}
+
+	/* validate everything before touching the machine */
+	h = (const ckpt_header_t *)map;
+	num_pages = CKPT_LE(h->num_pages);
+	data_offset = CKPT_LE(h->data_offset);
+	index = (const uint32_t *)(map + sizeof(ckpt_header_t));
+	if (memcmp(h->magic, CKPT_MAGIC, sizeof(h->magic)) != 0 || CKPT_LE(h->version) != CKPT_VERSION
+			|| CKPT_LE(h->page_size) != PAGE_SIZE || (data_offset & PAGE_MASK) != 0
+			|| num_pages > (1u << (32 - PAGE_SHIFT))
+			|| data_offset < sizeof(ckpt_header_t) + (uint64_t)num_pages * sizeof(uint32_t)
+			|| (uint64_t)data_offset + (uint64_t)num_pages * PAGE_SIZE > (uint64_t)st.st_size
+			|| memchr(h->prog_file, '\0', PROG_FILE_MAX) == NULL) {
+		printf("Error: %s is not a valid checkpoint\n", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	for (i = 0; i < num_pages; i++) {
+		page = CKPT_LE(index[i]);
+		if ((i > 0 && page <= prev) || !mem_in_region(page << PAGE_SHIFT)) {
+			printf("Error: %s is not a valid checkpoint\n", path);
+			munmap(map, st.st_size);
+			return -1;
+		}
+		prev = page;
+	}
+
+	/* the snapshot and every cached translation describe other memory */
+	free_memory(m);
+	decode_cache_flush(m);
+	block_cache_flush(m);
+	m->snapshot.valid = FALSE;
+
+	in_place = sysconf(_SC_PAGESIZE) == PAGE_SIZE;
+	for (i = 0; i < num_pages; i++) {
+		slot = table_slot(&m->page_table, CKPT_LE(index[i]) << PAGE_SHIFT);
+		if (in_place) {
+			*slot = map + data_offset + (size_t)i * PAGE_SIZE;
+		}
+		else {
+			*slot = malloc(PAGE_SIZE);
+			if (*slot == NULL) {
+				printf("Error: Out of memory restoring checkpoint\n");
+				exit(-1);
+			}
+			memcpy(*slot, map + data_offset + (size_t)i * PAGE_SIZE, PAGE_SIZE);
+		}
+		m->page_table.resident_pages++;
+	}
+
+	m->cpu.PC = CKPT_LE(h->pc);
+	for (i = 0; i < MIPS_REGS; i++) {
+		m->cpu.REGS[i] = CKPT_LE(h->regs[i]);
+	}
+	m->cpu.REGS[0] = 0;
+	m->cpu.HI = CKPT_LE(h->hi);
+	m->cpu.LO = CKPT_LE(h->lo);
+	m->instruction_count = CKPT_LE(h->instruction_count);
+	m->run_flag = CKPT_LE(h->run_flag) ? TRUE : FALSE;
+	m->program_size = CKPT_LE(h->program_size);
+	m->big_endian = CKPT_LE(h->big_endian) ? TRUE : FALSE;
+	strcpy(m->prog_file, h->prog_file);
+	m->image = IMAGE_CHECKPOINT;
+	elf_load_symbols(m, m->prog_file);
+
+	if (in_place) {
+		m->ckpt_map = map;
+		m->ckpt_map_size = st.st_size;
+	}
+	else {
+		munmap(map, st.st_size);
+	}
+	history_restart(m);
+	if (!m->quiet) {
+		printf("Checkpoint %s restored: %u pages, %u instructions.\n\n", path, num_pages, m->instruction_count);
+	}
+	return 0;
+}
+
+/***************************************************************/
+/* 64-bit hash of the architectural state: PC, registers, HI/LO,    */
+/* instruction count, run flag and every guest page holding a      */
+/* non-zero byte (with its address), so pages that were allocated  */
+/* but hold only zeroes hash like unmapped memory                           */
+/***************************************************************/
+#define HASH_PRIME 0x100000001b3ull
+#define HASH_MIX(h, x) (((h) ^ (x)) * HASH_PRIME)
+
+uint64_t state_hash(mips_machine *m) {
+	uint64_t h = 0xcbf29ce484222325ull, ph, any, w;
+	const uint8_t *page;
+	uint32_t i, j, k;
+
+	h = HASH_MIX(h, m->cpu.PC);
+	for (i = 0; i < MIPS_REGS; i++) {
+		h = HASH_MIX(h, m->cpu.REGS[i]);
+	}
+	h = HASH_MIX(h, ((uint64_t)m->cpu.HI << 32) | m->cpu.LO);
+	h = HASH_MIX(h, ((uint64_t)m->instruction_count << 1) | (m->run_flag != 0));
+	for (i = 0; i < PT_L1_SIZE; i++) {
+		if (m->page_table.dir[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_L2_SIZE; j++) {
+			page = m->page_table.dir[i][j];
+			if (page == NULL) {
+				continue;
+			}
+			ph = 0;
+			any = 0;
+			for (k = 0; k < PAGE_SIZE; k += sizeof(uint64_t)) {
+				memcpy(&w, page + k, sizeof(w));
+				any |= w;
+				ph = HASH_MIX(ph, w);
+			}
+			if (any != 0) {
+				h = HASH_MIX(h, (i << PT_L2_BITS) | j);
+				h = HASH_MIX(h, ph);
+			}
+		}
+	}
+	return h ^ (h >> 32);
+}
+
+/***************************************************************/
+/* Print host memory used by the guest page table                                             */
+/***************************************************************/
+void mem_stats(mips_machine *m) {
+	uint64_t page_bytes = (uint64_t)m->page_table.resident_pages * PAGE_SIZE;
+	uint64_t table_bytes = (uint64_t)m->page_table.tables * PT_L2_SIZE * sizeof(uint8_t *) + sizeof(m->page_table);
+
+	printf("-------------------------------------\n");
+	printf("Guest Memory Statistics\n");
+	printf("-------------------------------------\n");
+	printf("Page size\t: %u bytes\n", PAGE_SIZE);
+	printf("Resident pages\t: %u\n", m->page_table.resident_pages);
+	printf("Page tables\t: %u\n", m->page_table.tables);
+	printf("Resident bytes\t: %llu (pages %llu + tables %llu)\n",
+		(unsigned long long)(page_bytes + table_bytes), (unsigned long long)page_bytes, (unsigned long long)table_bytes);
+	printf("TLB entries\t: %u (direct-mapped)\n", TLB_SIZE);
+	printf("TLB hits\t: %llu\n", (unsigned long long)m->tlb.hits);
+	printf("TLB misses\t: %llu\n", (unsigned long long)m->tlb.misses);
+	printf("-------------------------------------\n");
+}
+
+/**************************************************************/
+/* Map (or, for pipes and other unmappable files, read) a whole file; */
+/* *mapped tells which, for program_file_release                        */
+/**************************************************************/
+static char *program_file_map(int fd, size_t *size, int *mapped)
+{
+	struct stat st;
+	char *data = NULL, *grown;
+	size_t capacity = 0;
+	ssize_t n;
+
+	*size = 0;
+	*mapped = FALSE;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			*size = st.st_size;
+			*mapped = TRUE;
+			return data;
+		}
+		data = NULL;
+	}
+	for (;;) {
+		if (*size == capacity) {
+			capacity = capacity ? capacity * 2 : 65536;
+			grown = realloc(data, capacity);
+			if (grown == NULL) {
+				free(data);
+				return NULL;
+			}
+			data = grown;
+		}
+		n = read(fd, data + *size, capacity - *size);
+		if (n < 0) {
+			free(data);
+			return NULL;
+		}
+		if (n == 0) {
+			return data;
+		}
+		*size += n;
+	}
+}
+
+static void program_file_release(char *data, size_t size, int mapped)
+{
+	if (mapped) {
+		munmap(data, size);
+	}
+	else {
+		free(data);
+	}
+}
+
+/**************************************************************/
+/* Parse 8 hex digits packed little-endian in v (first digit in the  */
+/* low byte) eight at a time, SWAR style; -1 if one is not a hex digit */
+/**************************************************************/
+static int64_t parse_hex8(uint64_t v)
+{
+	const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+	uint64_t lower = v | (0x20 * ones);
+	uint64_t digit, alpha, n;
+
+	/* bytes below 0x80: adding up to 0x7f per byte cannot carry out */
+	digit = ((v + (0x80 - 0x30) * ones) & ~(v + (0x7f - 0x39) * ones)) & highs;
+	alpha = ((lower + (0x80 - 0x61) * ones) & ~(lower + (0x7f - 0x66) * ones)) & highs;
+	if ((v & highs) != 0 || (digit | alpha) != highs) {
+		return -1;
+	}
+
+	/* nibble values, then pairs into bytes, bytes into a word */
+	n = (v & (0x0f * ones)) + ((v & (0x40 * ones)) >> 6) * 9;
+	n = ((n << 4) | (n >> 8)) & 0x00ff00ff00ff00ffull;
+	n = (n | (n >> 8)) & 0x0000ffff0000ffffull;
+	n = n | (n >> 16);
+	return __builtin_bswap32((uint32_t)n);
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+static int is_space(char c)
+{
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+}
+
+/**************************************************************/
+/* Parse the next whitespace-separated hex word (as fscanf("%x"):  */
+/* optional 0x, up to 8 digits) at *p; 1, 0 at the end, -1 with *p  */
+/* at the offending word                                                                         */
+/**************************************************************/
+static int parse_hex_word(const char **p, const char *end, uint32_t *word)
+{
+	const char *s = *p, *start;
+	uint64_t v;
+	int64_t fast;
+	int digits, d;
+
+	while (s < end && is_space(*s)) {
+		s++;
+	}
+	if (s == end) {
+		*p = s;
+		return 0;
+	}
+	start = s;
+
+	/* the usual line: exactly eight digits */
+	if (end - s >= 8 && (end - s == 8 || is_space(s[8]))) {
+		memcpy(&v, s, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		v = __builtin_bswap64(v);
+#endif
+		fast = parse_hex8(v);
+		if (fast >= 0) {
+			*word = fast;
+			*p = s + 8;
+			return 1;
+		}
+	}
+
+	if (end - s > 2 && s[0] == '0' && (s[1] | 0x20) == 'x' && hex_value(s[2]) >= 0) {
+		s += 2;
+	}
+	*word = 0;
+	for (digits = 0; s < end && (d = hex_value(*s)) >= 0; s++, digits++) {
+		*word = (*word << 4) | d;
+	}
+	if (digits == 0 || digits > 8 || (s < end && !is_space(*s))) {
+		*p = start;
+		return -1;
+	}
+	*p = s;
+	return 1;
+}
+
+/**************************************************************/
+/* Host page for loading the text word at address: forgets any     */
+/* decoded records of the page, as mem_write_32 would per word      */
+/**************************************************************/
+static uint8_t *text_page_for_load(mips_machine *m, uint32_t address)
+{
+	decoded_inst_t *decoded = m->decode_cache[(address - MEM_TEXT_BEGIN) >> PAGE_SHIFT];
+	uint32_t i;
+
+	if (decoded != NULL) {
+		for (i = 0; i < PAGE_SIZE / 4; i++) {
+			decoded[i].op = OP_UNDECODED;
+		}
+		m->code_generation++;
+	}
+	return page_for_write(m, address);
+}
+
+/**************************************************************/
+/* load program into memory; returns 0, or -1 if it can't be read */
+/**************************************************************/
+int load_program(mips_machine *m) {                   
+	const char *p, *end;
+	char *data;
+	uint8_t *page = NULL;
+	uint32_t address, word;
+	size_t size, n;
+	int fd, mapped, r;
+
+	/* Open the program file: an ELF executable, or hex words to map. */
+	fd = open(m->prog_file, O_RDONLY);
+	if (fd < 0) {
+		printf("Error: Can't open program file %s\n", m->prog_file);
+		return -1;
+	}
+	if (elf_probe(fd)) {
+		r = elf_load(m, fd);
+		close(fd);
+		return r;
+	}
+	data = program_file_map(fd, &size, &mapped);
+	close(fd);
+	if (data == NULL) {
+		printf("Error: Can't read program file %s\n", m->prog_file);
+		return -1;
+	}
+
+	/* Parse it straight into the text pages. */
+	p = data;
+	end = data + size;
+	address = MEM_TEXT_BEGIN;
+	while ((r = parse_hex_word(&p, end, &word)) == 1) {
+		if (address - MEM_TEXT_BEGIN >= TEXT_SIZE) {
+			r = -2;
+			break;
+		}
+		if (page == NULL || (address & PAGE_MASK) == 0) {
+			page = text_page_for_load(m, address);
+		}
+		store_le32(page + (address & PAGE_MASK), word);
+		if (m->verbose) {
+			printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
+		}
+		address += 4;
+	}
+	m->program_size = (address - MEM_TEXT_BEGIN) / 4;
+	if (r == -1) {
+		for (n = 0; p + n < end && n < 16 && !is_space(p[n]); n++) {
+		}
+		printf("Error: Invalid word \"%.*s\" after %u words of %s\n", (int)n, p, m->program_size, m->prog_file);
+	}
+	else if (r == -2) {
+		printf("Error: Program %s does not fit the text segment\n", m->prog_file);
+	}
+	program_file_release(data, size, mapped);
+	if (r < 0) {
+		return -1;
+	}
+	m->cpu.PC = MEM_TEXT_BEGIN;
+	m->image = IMAGE_HEX;
+	m->big_endian = FALSE;
+	symbols_release(m);
+	if (!m->quiet) {
+		printf("Program loaded into memory.\n%d words written into memory.\n\n", m->program_size);
+	}
+	return 0;
+}
+
+/************************************************************/
+/* $zero is hardwired: an instruction whose only effect is a GPR    */
+/* write to $r0 becomes a NOP, and JALR $r0 becomes a plain JR.   */
+/************************************************************/
+static void decode_hardwire_zero(decoded_inst_t *d)
+{
+	switch(d->op){
+		case OP_SLL: case OP_SRL: case OP_SRA:
+		case OP_MFHI: case OP_MFLO:
+		case OP_ADD: case OP_ADDU: case OP_SUB: case OP_SUBU:
+		case OP_AND: case OP_OR: case OP_XOR: case OP_NOR: case OP_SLT:
+			if (d->rd == 0) {
+				d->op = OP_NOP;
+			}
+			break;
+		case OP_JALR:
+			if (d->rd == 0) {
+				d->op = OP_JR;
+			}
+			break;
+		case OP_ADDI: case OP_ADDIU: case OP_SLTI:
+		case OP_ANDI: case OP_ORI: case OP_XORI: case OP_LUI:
+		case OP_LB: case OP_LH: case OP_LW:
+			if (d->rt == 0) {
+				d->op = OP_NOP;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+/************************************************************/
+/* Decode one instruction word fetched from pc                                                */
+/************************************************************/
+void decode_instruction(uint32_t instruction, uint32_t pc, decoded_inst_t *d)
+{
+	uint32_t opcode, function, rt, immediate, simm;
+
+	opcode = (instruction & 0xFC000000) >> 26;
+	function = instruction & 0x0000003F;
+	rt = (instruction & 0x001F0000) >> 16;
+	immediate = instruction & 0x0000FFFF;
+	simm = (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : immediate;
+
+	d->word = instruction;
+	d->rs = (instruction & 0x03E00000) >> 21;
+	d->rt = rt;
+	d->rd = (instruction & 0x0000F800) >> 11;
+	d->sa = (instruction & 0x000007C0) >> 6;
+	d->imm = simm;
+	d->target = pc + (simm << 2);
+
+	if(opcode == 0x00){
+		switch(function){
+			case 0x00: d->op = OP_SLL; break;
+			case 0x02: d->op = OP_SRL; break;
+			case 0x03: d->op = OP_SRA; break;
+			case 0x08: d->op = OP_JR; break;
+			case 0x09: d->op = OP_JALR; break;
+			case 0x0C: d->op = OP_SYSCALL; break;
+			case 0x10: d->op = OP_MFHI; break;
+			case 0x11: d->op = OP_MTHI; break;
+			case 0x12: d->op = OP_MFLO; break;
+			case 0x13: d->op = OP_MTLO; break;
+			case 0x18: d->op = OP_MULT; break;
+			case 0x19: d->op = OP_MULTU; break;
+			case 0x1A: d->op = OP_DIV; break;
+			case 0x1B: d->op = OP_DIVU; break;
+			case 0x20: d->op = OP_ADD; break;
+			case 0x21: d->op = OP_ADDU; break;
+			case 0x22: d->op = OP_SUB; break;
+			case 0x23: d->op = OP_SUBU; break;
+			case 0x24: d->op = OP_AND; break;
+			case 0x25: d->op = OP_OR; break;
+			case 0x26: d->op = OP_XOR; break;
+			case 0x27: d->op = OP_NOR; break;
+			case 0x2A: d->op = OP_SLT; break;
+			default: d->op = OP_UNIMPLEMENTED; break;
+		}
+		decode_hardwire_zero(d);
+		return;
+	}
+
+	switch(opcode){
+		case 0x01:
+			if(rt == 0x00000){
+				d->op = OP_BLTZ;
+			}
+			else if(rt == 0x00001){
+				d->op = OP_BGEZ;
+			}
+			else{
+				d->op = OP_NOP;
+			}
+			break;
+		case 0x02: d->op = OP_J; break;
+		case 0x03: d->op = OP_JAL; break;
+		case 0x04: d->op = OP_BEQ; break;
+		case 0x05: d->op = OP_BNE; break;
+		case 0x06: d->op = OP_BLEZ; break;
+		case 0x07: d->op = OP_BGTZ; break;
+		case 0x08: d->op = OP_ADDI; break;
+		case 0x09: d->op = OP_ADDIU; break;
+		case 0x0A: d->op = OP_SLTI; break;
+		case 0x0C: d->op = OP_ANDI; d->imm = immediate; break;
+		case 0x0D: d->op = OP_ORI; d->imm = immediate; break;
+		case 0x0E: d->op = OP_XORI; d->imm = immediate; break;
+		case 0x0F: d->op = OP_LUI; d->imm = immediate << 16; break;
+		case 0x20: d->op = OP_LB; break;
+		case 0x21: d->op = OP_LH; break;
+		case 0x23: d->op = OP_LW; break;
+		case 0x28: d->op = OP_SB; break;
+		case 0x29: d->op = OP_SH; break;
+		case 0x2B: d->op = OP_SW; break;
+		default: d->op = OP_UNIMPLEMENTED; break;
+	}
+	if(opcode == 0x02 || opcode == 0x03){
+		d->target = (pc & 0xF0000000) | ((instruction & 0x03FFFFFF) << 2);
+	}
+	decode_hardwire_zero(d);
+}
+
+/************************************************************/
+/* Decoded record for pc, decoding and caching it on first use       */
+/************************************************************/
+static const decoded_inst_t *fetch_decoded(mips_machine *m, uint32_t pc, decoded_inst_t *scratch)
+{
+	uint32_t offset = pc - MEM_TEXT_BEGIN;
+	decoded_inst_t *page, *d;
+
+	if (offset >= TEXT_SIZE || (pc & 0x3) != 0) {
+		/* outside the cached text segment: decode every time */
+		decode_instruction(mem_read_32(m, pc), pc, scratch);
+		return scratch;
+	}
+
+	page = m->decode_cache[offset >> PAGE_SHIFT];
+	if (page == NULL) {
+		if (page_lookup(m, pc) == NULL) {
+			/* never-written page: not worth caching zero words */
+			decode_instruction(0, pc, scratch);
+			return scratch;
+		}
+		page = decode_page_alloc(m, pc);
+	}
+	d = &page[(offset & PAGE_MASK) >> 2];
+	if (d->op == OP_UNDECODED) {
+		decode_instruction(mem_read_32(m, pc), pc, d);
+	}
+	return d;
+}
+
+/************************************************************/
+/* Instruction semantics, one function per decoded handler id.       */
+/* Each updates cpu (= &m->cpu) in place, including cpu->PC,        */
+/* reading all sources before any write. Writes to $zero never get  */
+/* here: the decoder turns them into OP_NOP.                                 */
+/************************************************************/
+#define MIPS_OP(name) \
+	static inline __attribute__((always_inline)) \
+	void op_body_##name(mips_machine *m, CPU_State *cpu, const decoded_inst_t *d); \
+	static inline __attribute__((always_inline)) \
+	void op_##name(mips_machine *m, const decoded_inst_t *d) { op_body_##name(m, &m->cpu, d); } \
+	static inline __attribute__((always_inline)) \
+	void op_body_##name(mips_machine *m, CPU_State *cpu, const decoded_inst_t *d)
+
+MIPS_OP(UNIMPLEMENTED)
+{
+	printf("Instruction at 0x%x is not implemented!\n", cpu->PC);
+	cpu->PC = cpu->PC + 4;
+}
+
+/* never dispatched: fetch_decoded always returns a decoded record */
+MIPS_OP(UNDECODED)
+{
+	op_UNIMPLEMENTED(m, d);
+}
+
+MIPS_OP(NOP)
+{
+	cpu->PC = cpu->PC + 4;
+}
+
+MIPS_OP(SLL)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->REGS[d->rt] << d->sa;
+}
+
+MIPS_OP(SRL)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->REGS[d->rt] >> d->sa;
+}
+
+MIPS_OP(SRA)
+{
+	cpu->PC = cpu->PC + 4;
+	if ((cpu->REGS[d->rt] & 0x80000000) == 1)
+	{
+		cpu->REGS[d->rd] =  ~(~cpu->REGS[d->rt] >> d->sa );
+	}
+	else{
+		cpu->REGS[d->rd] = cpu->REGS[d->rt] >> d->sa;
+	}
+}
+
+MIPS_OP(JR)
+{
+	cpu->PC = cpu->REGS[d->rs];
+}
+
+MIPS_OP(JALR)
+{
+	uint32_t link = cpu->PC + 4;
+	cpu->PC = cpu->REGS[d->rs];
+	cpu->REGS[d->rd] = link;
+}
+
+MIPS_OP(SYSCALL)
+{
+	if(cpu->REGS[2] == 0xa){
+		m->run_flag = FALSE;
+	}
+	cpu->PC = cpu->PC + 4;
+}
+
+MIPS_OP(MFHI)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->HI;
+}
+
+MIPS_OP(MTHI)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->HI = cpu->REGS[d->rs];
+}
+
+MIPS_OP(MFLO)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->LO;
+}
+
+MIPS_OP(MTLO)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->LO = cpu->REGS[d->rs];
+}
+
+MIPS_OP(MULT)
+{
+	uint64_t product, p1, p2;
+	if ((cpu->REGS[d->rs] & 0x80000000) == 0x80000000){
+		p1 = 0xFFFFFFFF00000000 | cpu->REGS[d->rs];
+	}else{
+		p1 = 0x00000000FFFFFFFF & cpu->REGS[d->rs];
+	}
+	if ((cpu->REGS[d->rt] & 0x80000000) == 0x80000000){
+		p2 = 0xFFFFFFFF00000000 | cpu->REGS[d->rt];
+	}else{
+		p2 = 0x00000000FFFFFFFF & cpu->REGS[d->rt];
+	}
+	product = p1 * p2;
+	cpu->PC = cpu->PC + 4;
+	cpu->LO = (product & 0X00000000FFFFFFFF);
+	cpu->HI = (product & 0XFFFFFFFF00000000)>>32;
+}
+
+MIPS_OP(MULTU)
+{
+	uint64_t product = (uint64_t)cpu->REGS[d->rs] * (uint64_t)cpu->REGS[d->rt];
+	cpu->PC = cpu->PC + 4;
+	cpu->LO = (product & 0X00000000FFFFFFFF);
+	cpu->HI = (product & 0XFFFFFFFF00000000)>>32;
+}
+
+MIPS_OP(DIV)
+{
+	int32_t rs = cpu->REGS[d->rs], rt = cpu->REGS[d->rt];
+	cpu->PC = cpu->PC + 4;
+	if(rt != 0)
+	{
+		cpu->LO = rs / rt;
+		cpu->HI = rs % rt;
+	}
+}
+
+MIPS_OP(DIVU)
+{
+	uint32_t rs = cpu->REGS[d->rs], rt = cpu->REGS[d->rt];
+	cpu->PC = cpu->PC + 4;
+	if(rt != 0)
+	{
+		cpu->LO = rs / rt;
+		cpu->HI = rs % rt;
+	}
+}
+
+MIPS_OP(ADD)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->REGS[d->rs] + cpu->REGS[d->rt];
+}
+
+MIPS_OP(ADDU)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->REGS[d->rt] + cpu->REGS[d->rs];
+}
+
+MIPS_OP(SUB)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->REGS[d->rs] - cpu->REGS[d->rt];
+}
+
+MIPS_OP(SUBU)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->REGS[d->rs] - cpu->REGS[d->rt];
+}
+
+MIPS_OP(AND)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->REGS[d->rs] & cpu->REGS[d->rt];
+}
+
+MIPS_OP(OR)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->REGS[d->rs] | cpu->REGS[d->rt];
+}
+
+MIPS_OP(XOR)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->REGS[d->rs] ^ cpu->REGS[d->rt];
+}
+
+MIPS_OP(NOR)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = ~(cpu->REGS[d->rs] | cpu->REGS[d->rt]);
+}
+
+MIPS_OP(SLT)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rd] = cpu->REGS[d->rs] < cpu->REGS[d->rt] ? 0x1 : 0x0;
+}
+
+MIPS_OP(BLTZ)
+{
+	cpu->PC = (cpu->REGS[d->rs] & 0x80000000) > 0 ? d->target : cpu->PC + 4;
+}
+
+MIPS_OP(BGEZ)
+{
+	cpu->PC = (cpu->REGS[d->rs] & 0x80000000) == 0x0 ? d->target : cpu->PC + 4;
+}
+
+MIPS_OP(J)
+{
+	cpu->PC = d->target;
+}
+
+MIPS_OP(JAL)
+{
+	cpu->REGS[31] = cpu->PC + 4;
+	cpu->PC = d->target;
+}
+
+MIPS_OP(BEQ)
+{
+	cpu->PC = cpu->REGS[d->rs] == cpu->REGS[d->rt] ? d->target : cpu->PC + 4;
+}
+
+MIPS_OP(BNE)
+{
+	cpu->PC = cpu->REGS[d->rs] != cpu->REGS[d->rt] ? d->target : cpu->PC + 4;
+}
+
+MIPS_OP(BLEZ)
+{
+	uint32_t rs = cpu->REGS[d->rs];
+	cpu->PC = ((rs & 0x80000000) > 0 || rs == 0) ? d->target : cpu->PC + 4;
+}
+
+MIPS_OP(BGTZ)
+{
+	uint32_t rs = cpu->REGS[d->rs];
+	cpu->PC = ((rs & 0x80000000) == 0x0 || rs != 0) ? d->target : cpu->PC + 4;
+}
+
+MIPS_OP(ADDI)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rt] = cpu->REGS[d->rs] + d->imm;
+}
+
+MIPS_OP(ADDIU)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rt] = cpu->REGS[d->rs] + d->imm;
+}
+
+MIPS_OP(SLTI)
+{
+	cpu->PC = cpu->PC + 4;
+	/* sign of the wrapped difference, not a true signed compare */
+	cpu->REGS[d->rt] = (int32_t)(cpu->REGS[d->rs] - d->imm) < 0 ? 0x1 : 0x0;
+}
+
+MIPS_OP(ANDI)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rt] = cpu->REGS[d->rs] & d->imm;
+}
+
+MIPS_OP(ORI)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rt] = cpu->REGS[d->rs] | d->imm;
+}
+
+MIPS_OP(XORI)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rt] = cpu->REGS[d->rs] ^ d->imm;
+}
+
+MIPS_OP(LUI)
+{
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rt] = d->imm;
+}
+
+MIPS_OP(LB)
+{
+	uint32_t data = mem_read_32(m, BYTE_ADDRESS(m, cpu->REGS[d->rs] + d->imm));
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rt] = ((data & 0x000000FF) & 0x80) > 0 ? (data | 0xFFFFFF00) : (data & 0x000000FF);
+}
+
+MIPS_OP(LH)
+{
+	uint32_t data = mem_read_32(m, HALF_ADDRESS(m, cpu->REGS[d->rs] + d->imm));
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rt] = ((data & 0x0000FFFF) & 0x8000) > 0 ? (data | 0xFFFF0000) : (data & 0x0000FFFF);
+}
+
+MIPS_OP(LW)
+{
+	uint32_t data = mem_read_32(m, cpu->REGS[d->rs] + d->imm);
+	cpu->PC = cpu->PC + 4;
+	cpu->REGS[d->rt] = data;
+}
+
+MIPS_OP(SB)
+{
+	uint32_t addr = BYTE_ADDRESS(m, cpu->REGS[d->rs] + d->imm);
+	uint32_t data = mem_read_32(m, addr);
+	data = (data & 0xFFFFFF00) | (cpu->REGS[d->rt] & 0x000000FF);
+	mem_write_32(m, addr, data);
+	cpu->PC = cpu->PC + 4;
+}
+
+MIPS_OP(SH)
+{
+	uint32_t addr = HALF_ADDRESS(m, cpu->REGS[d->rs] + d->imm);
+	uint32_t data = mem_read_32(m, addr);
+	data = (data & 0xFFFF0000) | (cpu->REGS[d->rt] & 0x0000FFFF);
+	mem_write_32(m, addr, data);
+	cpu->PC = cpu->PC + 4;
+}
+
+MIPS_OP(SW)
+{
+	mem_write_32(m, cpu->REGS[d->rs] + d->imm, cpu->REGS[d->rt]);
+	cpu->PC = cpu->PC + 4;
+}
+
+/************************************************************/
+/* Count the instruction d just executed at pc (ea: rs + imm before   */
+/* it ran) in the MU_MIPS_STATS counters                                                */
+/************************************************************/
+static inline __attribute__((always_inline)) void stats_count(mips_machine *m, const decoded_inst_t *d, uint32_t pc, uint32_t ea)
+{
+	stats_t *s = &m->stats;
+
+	s->ops[d->op]++;
+	if (m->cpu.PC != pc + 4 && d->op != OP_SYSCALL) {
+		s->taken[d->op]++;
+	}
+	if (d->op >= OP_LB && d->op <= OP_SW) {
+		if (d->op <= OP_LW) {
+			s->loads[mem_region_index(ea)]++;
+		}
+		else {
+			s->stores[mem_region_index(ea)]++;
+		}
+	}
+}
+
+/************************************************************/
+/* Profile the instruction d just executed at pc (see profile_t)      */
+/************************************************************/
+static inline __attribute__((always_inline)) void profile_count(mips_machine *m, const decoded_inst_t *d, uint32_t pc)
+{
+	profile_t *p = m->profile;
+	uint32_t index = (pc - MEM_TEXT_BEGIN) >> 2;
+	uint64_t *counts = index < TEXT_SIZE / 4 ? p->counts[index / PROFILE_PAGE_SLOTS] : NULL;
+
+	p->total++;
+	if (counts != NULL) {
+		counts[index % PROFILE_PAGE_SLOTS]++;
+	}
+	else {
+		profile_miss(m, pc);
+	}
+	if (d->op == OP_JAL || d->op == OP_JALR || (d->op == OP_JR && d->rs == 31)) {
+		profile_branch(m, d, pc);
+	}
+}
+
+/************************************************************/
+/* decode and execute instruction                                                                     */ 
+/* trace is a compile-time constant at every call site, so the   */
+/* TRACE_OFF copy carries no formatting or stdio in its hot path */
+/************************************************************/
+static inline __attribute__((always_inline)) void execute_instruction(mips_machine *m, const int trace)
+{
+	decoded_inst_t scratch;
+	const decoded_inst_t *d;
+	uint32_t pc = m->cpu.PC, ea = 0;
+	
+	if (trace == TRACE_PC || trace == TRACE_FULL) {
+		printf(trace == TRACE_PC ? "[0x%x]\n" : "[0x%x]\t", m->cpu.PC);
+	}
+	
+	d = fetch_decoded(m, m->cpu.PC, &scratch);
+	if (trace == TRACE_BINARY || STATS_ENABLED) {
+		ea = m->cpu.REGS[d->rs] + d->imm;
+	}
+	
+	switch(d->op){
+#define MIPS_OP_CASE(name) \
+		case OP_##name: \
+			op_##name(m, d); \
+			break;
+		MIPS_OPS(MIPS_OP_CASE)
+#undef MIPS_OP_CASE
+	}
+	
+	if (trace == TRACE_FULL && d->op != OP_UNIMPLEMENTED) {
+		print_instruction_word(m->cpu.PC, d->word);
+	}
+	else if (trace == TRACE_BINARY) {
+		btrace_emit(m, d, pc, ea);
+	}
+	if (trace == TRACE_PROFILE || (trace != TRACE_OFF && m->profile != NULL && m->profile->on)) {
+		profile_count(m, d, pc);
+	}
+	if (STATS_ENABLED) {
+		stats_count(m, d, pc, ea);
+	}
+}
+
+/************************************************************/
+/* decode and execute one instruction at the current trace level */
+/************************************************************/
+void handle_instruction(mips_machine *m)
+{
+	switch (m->trace_level) {
+		case TRACE_OFF:
+			if (m->profile != NULL && m->profile->on) {
+				execute_instruction(m, TRACE_PROFILE);
+			}
+			else {
+				execute_instruction(m, TRACE_OFF);
+			}
+			break;
+		case TRACE_PC:
+			execute_instruction(m, TRACE_PC);
+			break;
+		case TRACE_BINARY:
+			execute_instruction(m, TRACE_BINARY);
+			break;
+		default:
+			execute_instruction(m, TRACE_FULL);
+			break;
+	}
+}
+
+/************************************************************/
+/* Threaded interpreter: computed-goto dispatch over decoded        */
+/* records. Untraced; returns the number of instructions executed */
+/* (at most budget).                                                                        */
+/************************************************************/
+static uint32_t run_threaded(mips_machine *m, uint32_t budget)
+{
+#define MIPS_OP_LABEL(name) &&L_##name,
+	static void *const labels[NUM_OPS] = { MIPS_OPS(MIPS_OP_LABEL) };
+#undef MIPS_OP_LABEL
+	decoded_inst_t scratch;
+	const decoded_inst_t *d;
+	uint32_t executed = 0;
+
+	if (budget == 0 || !m->run_flag) {
+		return 0;
+	}
+
+	d = fetch_decoded(m, m->cpu.PC, &scratch);
+	goto *labels[d->op];
+
+#define MIPS_OP_BODY(name) \
+	L_##name: \
+		op_##name(m, d); \
+		if (++executed == budget || (OP_##name == OP_SYSCALL && !m->run_flag)) { \
+			goto done; \
+		} \
+		d = fetch_decoded(m, m->cpu.PC, &scratch); \
+		goto *labels[d->op];
+	MIPS_OPS(MIPS_OP_BODY)
+#undef MIPS_OP_BODY
+
+done:
+	return executed;
+}
+
+/************************************************************/
+/* Basic-block translation cache                                                                  */
+/************************************************************/
+#define MIPS_OP_FN(name) \
+	static void fn_##name(mips_machine *m, const decoded_inst_t *d) { op_##name(m, d); }
+MIPS_OPS(MIPS_OP_FN)
+#undef MIPS_OP_FN
+
+#define MIPS_OP_FN_ENTRY(name) fn_##name,
+const block_fn_t OP_FUNCS[NUM_OPS] = { MIPS_OPS(MIPS_OP_FN_ENTRY) };
+#undef MIPS_OP_FN_ENTRY
+
+/* ops that end a basic block */
+static int op_ends_block(uint8_t op)
+{
+	switch (op) {
+		case OP_BEQ: case OP_BNE: case OP_BLEZ: case OP_BGTZ: case OP_BLTZ: case OP_BGEZ:
+		case OP_J: case OP_JAL: case OP_JR: case OP_JALR: case OP_SYSCALL:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/************************************************************/
+/* Free every translated block                                                                      */
+/************************************************************/
+void block_cache_flush(mips_machine *m)
+{
+	translated_block_t *tb, *next;
+	uint32_t i;
+
+	for (i = 0; i < BLOCK_HASH_SIZE; i++) {
+		for (tb = m->block_cache.hash[i]; tb != NULL; tb = next) {
+			next = tb->hash_next;
+			free(tb);
+		}
+		m->block_cache.hash[i] = NULL;
+	}
+	m->block_cache.blocks = 0;
+	m->block_cache.generation = m->code_generation;
+	jit_reset(m);
+}
+
+/************************************************************/
+/* Translate the block starting at pc. Returns NULL when pc is not */
+/* in a resident, aligned text page; such code is interpreted.        */
+/************************************************************/
+static translated_block_t *block_translate(mips_machine *m, uint32_t pc)
+{
+	block_insn_t insns[BLOCK_MAX_INSNS];
+	translated_block_t *tb;
+	uint32_t count = 0, addr = pc, offset = pc - MEM_TEXT_BEGIN;
+	int has_store = FALSE;
+
+	if (offset >= TEXT_SIZE || (pc & 0x3) != 0 || page_lookup(m, pc) == NULL) {
+		return NULL;
+	}
+
+	/* route stores to this page through the invalidating slow path */
+	if (m->decode_cache[offset >> PAGE_SHIFT] == NULL) {
+		decode_page_alloc(m, pc);
 	}
-	printf("Simulation Finished.\n\n");
-}
 
-/***************************************************************/ 
-/* Dump a word-aligned region of memory to the terminal                              */
-/***************************************************************/
-void mdump(uint32_t start, uint32_t stop) {          
-	uint32_t address;
+	do {
+		decode_instruction(mem_read_32(m, addr), addr, &insns[count].d);
+		insns[count].fn = OP_FUNCS[insns[count].d.op];
+		has_store |= insns[count].d.op == OP_SB || insns[count].d.op == OP_SH || insns[count].d.op == OP_SW;
+		addr += 4;
+	} while (!op_ends_block(insns[count++].d.op) && count < BLOCK_MAX_INSNS && (addr & PAGE_MASK) != 0);
 
-	printf("-------------------------------------------------------------\n");
-	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
-	printf("-------------------------------------------------------------\n");
-	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
-	for (address = start; address <= stop; address += 4){
-		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+	tb = malloc(sizeof(translated_block_t) + count * sizeof(block_insn_t));
+	if (tb == NULL) {
+		printf("Error: Out of memory allocating translated block\n");
+		exit(-1);
 	}
-	printf("\n");
+	tb->pc = pc;
+	tb->count = count;
+	tb->has_store = has_store;
+	tb->succ[0] = tb->succ[1] = NULL;
+	tb->succ_pc[0] = tb->succ_pc[1] = 0;
+	tb->native = NULL;
+	memcpy(tb->insns, insns, count * sizeof(block_insn_t));
+
+	tb->hash_next = m->block_cache.hash[(pc >> 2) & (BLOCK_HASH_SIZE - 1)];
+	m->block_cache.hash[(pc >> 2) & (BLOCK_HASH_SIZE - 1)] = tb;
+	m->block_cache.blocks++;
+	return tb;
 }
 
-/***************************************************************/
-/* Dump current values of registers to the teminal                                              */   
-/***************************************************************/
-void rdump() {                               
-	int i; 
-	printf("-------------------------------------\n");
-	printf("Dumping Register Content\n");
-	printf("-------------------------------------\n");
-	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
-	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
-	printf("-------------------------------------\n");
-	printf("[Register]\t[Value]\n");
-	printf("-------------------------------------\n");
-	for (i = 0; i < MIPS_REGS; i++){
-		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.REGS[i]);
+/************************************************************/
+/* Cached block for pc, translating on a miss                                    */
+/************************************************************/
+static translated_block_t *block_lookup(mips_machine *m, uint32_t pc)
+{
+	translated_block_t *tb;
+
+	for (tb = m->block_cache.hash[(pc >> 2) & (BLOCK_HASH_SIZE - 1)]; tb != NULL; tb = tb->hash_next) {
+		if (tb->pc == pc) {
+			return tb;
+		}
 	}
-	printf("-------------------------------------\n");
-	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
-	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
-	printf("-------------------------------------\n");
+	return block_translate(m, pc);
 }
 
-/***************************************************************/
-/* Read a command from standard input.                                                               */  
-/***************************************************************/
-void handle_command() {                         
-	char buffer[20];
-	uint32_t start, stop, cycles;
-	uint32_t register_no;
-	int register_value;
-	int hi_reg_value, lo_reg_value;
-
-	printf("MU-MIPS SIM:> ");
+/************************************************************/
+/* Block engine: runs translated blocks back to back, following  */
+/* chained successor links and only returning to the lookup on a  */
+/* link miss. With native set, blocks run as JIT-compiled host     */
+/* code instead of handler calls. Untraced; returns instructions   */
+/* executed (<= budget).                                                                    */
+/************************************************************/
+static inline __attribute__((always_inline)) uint32_t run_translated(mips_machine *m, uint32_t budget, const int native)
+{
+	CPU_State *cpu = &m->cpu;
+	translated_block_t *tb, *prev = NULL;
+	decoded_inst_t scratch;
+	const decoded_inst_t *d;
+	uint32_t executed = 0, n, i, generation;
 
-	if (scanf("%s", buffer) == EOF){
-		exit(0);
-	}
+	while (executed < budget && m->run_flag) {
+		if (m->block_cache.generation != m->code_generation) {
+			/* code was overwritten: drop every translation */
+			block_cache_flush(m);
+			prev = NULL;
+		}
 
-	switch(buffer[0]) {
-		case 'S':
-		case 's':
-			runAll(); 
-			break;
-		case 'M':
-		case 'm':
-			if (scanf("%x %x", &start, &stop) != 2){
-				break;
+		/* follow the chain from the previous block, else look up */
+		tb = NULL;
+		if (prev != NULL) {
+			if (prev->succ[0] != NULL && prev->succ_pc[0] == cpu->PC) {
+				tb = prev->succ[0];
 			}
-			mdump(start, stop);
-			break;
-		case '?':
-			help();
-			break;
-		case 'Q':
-		case 'q':
-			printf("**************************\n");
-			printf("Exiting MU-MIPS! Good Bye...\n");
-			printf("**************************\n");
-			exit(0);
-		case 'R':
-		case 'r':
-			if (buffer[1] == 'd' || buffer[1] == 'D'){
-				rdump();
-			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
-				reset();
+			else if (prev->succ[1] != NULL && prev->succ_pc[1] == cpu->PC) {
+				tb = prev->succ[1];
 			}
-			else {
-				if (scanf("%d", &cycles) != 1) {
+		}
+		if (tb == NULL) {
+			tb = block_lookup(m, cpu->PC);
+			if (tb == NULL) {
+				/* not translatable: interpret a single instruction */
+				d = fetch_decoded(m, cpu->PC, &scratch);
+				OP_FUNCS[d->op](m, d);
+				executed++;
+				prev = NULL;
+				continue;
+			}
+			if (prev != NULL) {
+				/* chain: slot 0 for the first successor seen, slot 1 for the other */
+				i = prev->succ[0] == NULL ? 0 : 1;
+				prev->succ[i] = tb;
+				prev->succ_pc[i] = tb->pc;
+			}
+		}
+
+		n = tb->count;
+		if (n > budget - executed) {
+			/* budget ends inside this block: finish it instruction by instruction */
+			n = budget - executed;
+			for (i = 0; i < n; i++) {
+				tb->insns[i].fn(m, &tb->insns[i].d);
+				if (tb->has_store && m->block_cache.generation != m->code_generation) {
+					n = i + 1;
 					break;
 				}
-				run(cycles);
 			}
-			break;
-		case 'I':
-		case 'i':
-			if (scanf("%u %i", &register_no, &register_value) != 2){
-				break;
+		}
+		else if (native) {
+			if (tb->native == NULL && (tb->native = jit_compile(m, tb)) == NULL) {
+				/* code cache full: start over with empty caches */
+				block_cache_flush(m);
+				prev = NULL;
+				continue;
 			}
-			CURRENT_STATE.REGS[register_no] = register_value;
-			NEXT_STATE.REGS[register_no] = register_value;
-			break;
-		case 'H':
-		case 'h':
-			if (scanf("%i", &hi_reg_value) != 1){
-				break;
+			n = tb->native(m);
+		}
+		else if (!tb->has_store) {
+			for (i = 0; i < n; i++) {
+				tb->insns[i].fn(m, &tb->insns[i].d);
 			}
-			CURRENT_STATE.HI = hi_reg_value; 
-			NEXT_STATE.HI = hi_reg_value; 
-			break;
-		case 'L':
-		case 'l':
-			if (scanf("%i", &lo_reg_value) != 1){
-				break;
+		}
+		else {
+			/* a store may rewrite the rest of this block: stop at once */
+			generation = m->code_generation;
+			for (i = 0; i < n; ) {
+				tb->insns[i].fn(m, &tb->insns[i].d);
+				i++;
+				if (generation != m->code_generation) {
+					break;
+				}
 			}
-			CURRENT_STATE.LO = lo_reg_value;
-			NEXT_STATE.LO = lo_reg_value;
-			break;
-		case 'P':
-		case 'p':
-			print_program(); 
-			break;
-		default:
-			printf("Invalid Command.\n");
-			break;
+			n = i;
+		}
+		executed += n;
+		prev = n == tb->count ? tb : NULL;
 	}
+	return executed;
 }
 
-/***************************************************************/
-/* reset registers/memory and reload program                                                    */
-/***************************************************************/
-void reset() {   
-	int i;
-	/*reset registers*/
-	for (i = 0; i < MIPS_REGS; i++){
-		CURRENT_STATE.REGS[i] = 0;
-	}
-	CURRENT_STATE.HI = 0;
-	CURRENT_STATE.LO = 0;
-	
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
-	}
-	
-	/*load program*/
-	load_program();
-	
-	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+static uint32_t run_blocks(mips_machine *m, uint32_t budget)
+{
+	return run_translated(m, budget, FALSE);
 }
 
-/***************************************************************/
-/* Allocate and set memory to zero                                                                            */
-/***************************************************************/
-void init_memory() {                                           
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
-	}
+static uint32_t run_jit(mips_machine *m, uint32_t budget)
+{
+	return run_translated(m, budget, TRUE);
 }
 
-/**************************************************************/
-/* load program into memory                                                                                      */
-/**************************************************************/
-void load_program() {                   
-	FILE * fp;
-	int i, word;
-	uint32_t address;
-
-	/* Open program file. */
-	fp = fopen(prog_file, "r");
-	if (fp == NULL) {
-		printf("Error: Can't open program file %s\n", prog_file);
-		exit(-1);
+/************************************************************/
+/* Select the trace level by name; returns 0 on success. Leaving    */
+/* the binary level closes its trace file.                                         */
+/************************************************************/
+int set_trace_level(mips_machine *m, const char *name)
+{
+	if (strcmp(name, "off") != 0 && strcmp(name, "pc") != 0 && strcmp(name, "full") != 0) {
+		return -1;
 	}
+	btrace_close(m);
+	if (strcmp(name, "off") == 0) {
+		m->trace_level = TRACE_OFF;
+	}
+	else if (strcmp(name, "pc") == 0) {
+		m->trace_level = TRACE_PC;
+	}
+	else {
+		m->trace_level = TRACE_FULL;
+	}
+	return 0;
+}
 
-	/* Read in the program. */
-
-	i = 0;
-	while( fscanf(fp, "%x\n", &word) != EOF ) {
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+/************************************************************/
+/* Trace in binary to path, raw or packed (see mu-mips-trace.c);    */
+/* returns 0 on success                                                                  */
+/************************************************************/
+int set_binary_trace(mips_machine *m, const char *path, int packed)
+{
+	if (btrace_open(m, path, packed) != 0) {
+		return -1;
 	}
-	PROGRAM_SIZE = i/4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
-	fclose(fp);
+	m->trace_level = TRACE_BINARY;
+	return 0;
 }
 
 /************************************************************/
-/* decode and execute instruction                                                                     */ 
+/* Select the interpreter core by name; returns 0 on success          */
 /************************************************************/
-void handle_instruction()
+int set_engine(mips_machine *m, const char *name)
 {
-	/*IMPLEMENT THIS*/
-	/* execute one instruction at a time. Use/update CURRENT_STATE and and NEXT_STATE, as necessary.*/
-	
-	
-	uint32_t instruction, opcode, function, rs, rt, rd, sa, immediate, target;
-	uint64_t product, p1, p2;
-	
-	uint32_t addr, data;
-	
-	int branch_jump = FALSE;
-	
-	printf("[0x%x]\t", CURRENT_STATE.PC);
-	
-	instruction = mem_read_32(CURRENT_STATE.PC);
-	
-	opcode = (instruction & 0xFC000000) >> 26;
-	function = instruction & 0x0000003F;
-	rs = (instruction & 0x03E00000) >> 21;
-	rt = (instruction & 0x001F0000) >> 16;
-	rd = (instruction & 0x0000F800) >> 11;
-	sa = (instruction & 0x000007C0) >> 6;
-	immediate = instruction & 0x0000FFFF;
-	target = instruction & 0x03FFFFFF;
-	
-	if(opcode == 0x00){
-		switch(function){
-			case 0x00: //SLL
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] << sa;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x02: //SRL
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] >> sa;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x03: //SRA 
-				if ((CURRENT_STATE.REGS[rt] & 0x80000000) == 1)
-				{
-					NEXT_STATE.REGS[rd] =  ~(~CURRENT_STATE.REGS[rt] >> sa );
-				}
-				else{
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] >> sa;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x08: //JR
-				NEXT_STATE.PC = CURRENT_STATE.REGS[rs];
-				branch_jump = TRUE;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x09: //JALR
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.PC + 4;
-				NEXT_STATE.PC = CURRENT_STATE.REGS[rs];
-				branch_jump = TRUE;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0C: //SYSCALL
-				if(CURRENT_STATE.REGS[2] == 0xa){
-					RUN_FLAG = FALSE;
-					print_instruction(CURRENT_STATE.PC);
-				}
-				break;
-			case 0x10: //MFHI
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.HI;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x11: //MTHI
-				NEXT_STATE.HI = CURRENT_STATE.REGS[rs];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x12: //MFLO
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.LO;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x13: //MTLO
-				NEXT_STATE.LO = CURRENT_STATE.REGS[rs];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x18: //MULT
-				if ((CURRENT_STATE.REGS[rs] & 0x80000000) == 0x80000000){
-					p1 = 0xFFFFFFFF00000000 | CURRENT_STATE.REGS[rs];
-				}else{
-					p1 = 0x00000000FFFFFFFF & CURRENT_STATE.REGS[rs];
-				}
-				if ((CURRENT_STATE.REGS[rt] & 0x80000000) == 0x80000000){
-					p2 = 0xFFFFFFFF00000000 | CURRENT_STATE.REGS[rt];
-				}else{
-					p2 = 0x00000000FFFFFFFF & CURRENT_STATE.REGS[rt];
-				}
-				product = p1 * p2;
-				NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
-				NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x19: //MULTU
-				product = (uint64_t)CURRENT_STATE.REGS[rs] * (uint64_t)CURRENT_STATE.REGS[rt];
-				NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
-				NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x1A: //DIV 
-				if(CURRENT_STATE.REGS[rt] != 0)
-				{
-					NEXT_STATE.LO = (int32_t)CURRENT_STATE.REGS[rs] / (int32_t)CURRENT_STATE.REGS[rt];
-					NEXT_STATE.HI = (int32_t)CURRENT_STATE.REGS[rs] % (int32_t)CURRENT_STATE.REGS[rt];
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x1B: //DIVU
-				if(CURRENT_STATE.REGS[rt] != 0)
-				{
-					NEXT_STATE.LO = CURRENT_STATE.REGS[rs] / CURRENT_STATE.REGS[rt];
-					NEXT_STATE.HI = CURRENT_STATE.REGS[rs] % CURRENT_STATE.REGS[rt];
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x20: //ADD
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] + CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x21: //ADDU 
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] + CURRENT_STATE.REGS[rs];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x22: //SUB
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] - CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x23: //SUBU
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] - CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x24: //AND
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] & CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x25: //OR
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] | CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x26: //XOR
-				NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] ^ CURRENT_STATE.REGS[rt];
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x27: //NOR
-				NEXT_STATE.REGS[rd] = ~(CURRENT_STATE.REGS[rs] | CURRENT_STATE.REGS[rt]);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x2A: //SLT
-				if(CURRENT_STATE.REGS[rs] < CURRENT_STATE.REGS[rt]){
-					NEXT_STATE.REGS[rd] = 0x1;
-				}
-				else{
-					NEXT_STATE.REGS[rd] = 0x0;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			default:
-				printf("Instruction at 0x%x is not implemented!\n", CURRENT_STATE.PC);
-				break;
-		}
+	if (strcmp(name, "switch") == 0) {
+		m->engine = ENGINE_SWITCH;
 	}
-	else{
-		switch(opcode){
-			case 0x01:
-				if(rt == 0x00000){ //BLTZ
-					if((CURRENT_STATE.REGS[rs] & 0x80000000) > 0){
-						NEXT_STATE.PC = CURRENT_STATE.PC + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-						branch_jump = TRUE;
-					}
-					print_instruction(CURRENT_STATE.PC);
-				}
-				else if(rt == 0x00001){ //BGEZ
-					if((CURRENT_STATE.REGS[rs] & 0x80000000) == 0x0){
-						NEXT_STATE.PC = CURRENT_STATE.PC + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-						branch_jump = TRUE;
-					}
-					print_instruction(CURRENT_STATE.PC);
-				}
-				break;
-			case 0x02: //J
-				NEXT_STATE.PC = (CURRENT_STATE.PC & 0xF0000000) | (target << 2);
-				branch_jump = TRUE;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x03: //JAL
-				NEXT_STATE.PC = (CURRENT_STATE.PC & 0xF0000000) | (target << 2);
-				NEXT_STATE.REGS[31] = CURRENT_STATE.PC + 4;
-				branch_jump = TRUE;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x04: //BEQ
-				if(CURRENT_STATE.REGS[rs] == CURRENT_STATE.REGS[rt]){
-					NEXT_STATE.PC = CURRENT_STATE.PC + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-					branch_jump = TRUE;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x05: //BNE
-				if(CURRENT_STATE.REGS[rs] != CURRENT_STATE.REGS[rt]){
-					NEXT_STATE.PC = CURRENT_STATE.PC + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-					branch_jump = TRUE;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x06: //BLEZ
-				if((CURRENT_STATE.REGS[rs] & 0x80000000) > 0 || CURRENT_STATE.REGS[rs] == 0){
-					NEXT_STATE.PC = CURRENT_STATE.PC +  ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-					branch_jump = TRUE;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x07: //BGTZ
-				if((CURRENT_STATE.REGS[rs] & 0x80000000) == 0x0 || CURRENT_STATE.REGS[rs] != 0){
-					NEXT_STATE.PC = CURRENT_STATE.PC +  ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000)<<2 : (immediate & 0x0000FFFF)<<2);
-					branch_jump = TRUE;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x08: //ADDI
-				NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF));
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x09: //ADDIU
-				NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF));
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0A: //SLTI
-				if ( (  (int32_t)CURRENT_STATE.REGS[rs] - (int32_t)( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF))) < 0){
-					NEXT_STATE.REGS[rt] = 0x1;
-				}else{
-					NEXT_STATE.REGS[rt] = 0x0;
-				}
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0C: //ANDI
-				NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] & (immediate & 0x0000FFFF);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0D: //ORI
-				NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] | (immediate & 0x0000FFFF);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0E: //XORI
-				NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] ^ (immediate & 0x0000FFFF);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x0F: //LUI
-				NEXT_STATE.REGS[rt] = immediate << 16;
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x20: //LB
-				data = mem_read_32( CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF)) );
-				NEXT_STATE.REGS[rt] = ((data & 0x000000FF) & 0x80) > 0 ? (data | 0xFFFFFF00) : (data & 0x000000FF);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x21: //LH
-				data = mem_read_32( CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF)) );
-				NEXT_STATE.REGS[rt] = ((data & 0x0000FFFF) & 0x8000) > 0 ? (data | 0xFFFF0000) : (data & 0x0000FFFF);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x23: //LW
-				NEXT_STATE.REGS[rt] = mem_read_32( CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF)) );
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x28: //SB
-				addr = CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF));
-				data = mem_read_32( addr);
-				data = (data & 0xFFFFFF00) | (CURRENT_STATE.REGS[rt] & 0x000000FF);
-				mem_write_32(addr, data);
-				print_instruction(CURRENT_STATE.PC);				
-				break;
-			case 0x29: //SH
-				addr = CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF));
-				data = mem_read_32( addr);
-				data = (data & 0xFFFF0000) | (CURRENT_STATE.REGS[rt] & 0x0000FFFF);
-				mem_write_32(addr, data);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			case 0x2B: //SW
-				addr = CURRENT_STATE.REGS[rs] + ( (immediate & 0x8000) > 0 ? (immediate | 0xFFFF0000) : (immediate & 0x0000FFFF));
-				mem_write_32(addr, CURRENT_STATE.REGS[rt]);
-				print_instruction(CURRENT_STATE.PC);
-				break;
-			default:
-				// put more things here
-				printf("Instruction at 0x%x is not implemented!\n", CURRENT_STATE.PC);
-				break;
-		}
+	else if (strcmp(name, "threaded") == 0) {
+		m->engine = ENGINE_THREADED;
 	}
-	
-	if(!branch_jump){
-		NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+	else if (strcmp(name, "block") == 0) {
+		m->engine = ENGINE_BLOCK;
+	}
+	else if (strcmp(name, "jit") == 0 && jit_available()) {
+		m->engine = ENGINE_JIT;
 	}
+	else {
+		return -1;
+	}
+	return 0;
 }
 
-
 /************************************************************/
 /* Initialize Memory                                                                                                    */ 
 /************************************************************/
-void initialize() { 
-	init_memory();
-	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+void initialize(mips_machine *m) { 
+	init_memory(m);
+	m->cpu.PC = MEM_TEXT_BEGIN;
+	m->run_flag = TRUE;
+}
+
+/************************************************************/
+/* Allocate an initialized machine with no program loaded; trace  */
+/* is off and the engine is switch until set otherwise                 */
+/************************************************************/
+mips_machine *machine_create() {
+	mips_machine *m = calloc(1, sizeof(mips_machine));
+	if (m == NULL) {
+		printf("Error: Out of memory allocating machine\n");
+		exit(-1);
+	}
+	m->trace_level = TRACE_OFF;
+	m->engine = ENGINE_SWITCH;
+	initialize(m);
+	return m;
+}
+
+/************************************************************/
+/* Release a machine and everything it allocated                          */
+/************************************************************/
+void machine_destroy(mips_machine *m) {
+	if (m == NULL) {
+		return;
+	}
+	free_memory(m);
+	btrace_close(m);
+	profile_release(m);
+	symbols_release(m);
+	snapshot_release(m);
+	history_release(m);
+	decode_cache_flush(m);
+	block_cache_flush(m);
+	jit_release(m);
+	free(m);
+}
+
+/************************************************************/
+/* Set the program file load_program/reset read; returns 0 on success */
+/************************************************************/
+int set_prog_file(mips_machine *m, const char *path) {
+	if (strlen(path) >= PROG_FILE_MAX) {
+		return -1;
+	}
+	strcpy(m->prog_file, path);
+	return 0;
 }
 
 /************************************************************/
 /* Print the program loaded into memory (in MIPS assembly format)    */ 
 /************************************************************/
-void print_program(){
+void print_program(mips_machine *m){
 	int i;
 	uint32_t addr;
+	const symbol_t *s;
 	
-	for(i=0; i<PROGRAM_SIZE; i++){
+	for(i=0; i<m->program_size; i++){
 		addr = MEM_TEXT_BEGIN + (i*4);
+		s = m->num_symbols ? symbol_lookup(m, addr) : NULL;
+		if (s != NULL && s->addr == addr) {
+			printf("%s:\n", s->name);
+		}
 		printf("[0x%x]\t", addr);
-		print_instruction(addr);
+		print_instruction(m, addr);
 	}
 }
 
 /************************************************************/
 /* Print the instruction at given memory address (in MIPS assembly format)    */
 /************************************************************/
-void print_instruction(uint32_t addr){
-	uint32_t instruction, opcode, function, rs, rt, rd, sa, immediate, target;
-	
-	instruction = mem_read_32(addr);
+void print_instruction(mips_machine *m, uint32_t addr){
+	print_instruction_word(addr, mem_read_32(m, addr));
+}
+
+/************************************************************/
+/* Print an already fetched instruction word located at addr              */
+/************************************************************/
+void print_instruction_word(uint32_t addr, uint32_t instruction){
+	fprint_instruction_word(stdout, addr, instruction);
+}
+
+/************************************************************/
+/* Disassemble an instruction word located at addr to fp                  */
+/************************************************************/
+void fprint_instruction_word(FILE *fp, uint32_t addr, uint32_t instruction){
+	uint32_t opcode, function, rs, rt, rd, sa, immediate, target;
 	
 	opcode = (instruction & 0xFC000000) >> 26;
 	function = instruction & 0x0000003F;
@@ -647,81 +2924,81 @@ void print_instruction(uint32_t addr){
 		
 		switch(function){
 			case 0x00:
-				printf("SLL $r%u, $r%u, 0x%x\n", rd, rt, sa);
+				fprintf(fp, "SLL $r%u, $r%u, 0x%x\n", rd, rt, sa);
 				break;
 			case 0x02:
-				printf("SRL $r%u, $r%u, 0x%x\n", rd, rt, sa);
+				fprintf(fp, "SRL $r%u, $r%u, 0x%x\n", rd, rt, sa);
 				break;
 			case 0x03:
-				printf("SRA $r%u, $r%u, 0x%x\n", rd, rt, sa);
+				fprintf(fp, "SRA $r%u, $r%u, 0x%x\n", rd, rt, sa);
 				break;
 			case 0x08:
-				printf("JR $r%u\n", rs);
+				fprintf(fp, "JR $r%u\n", rs);
 				break;
 			case 0x09:
 				if(rd == 31){
-					printf("JALR $r%u\n", rs);
+					fprintf(fp, "JALR $r%u\n", rs);
 				}
 				else{
-					printf("JALR $r%u, $r%u\n", rd, rs);
+					fprintf(fp, "JALR $r%u, $r%u\n", rd, rs);
 				}
 				break;
 			case 0x0C:
-				printf("SYSCALL\n");
+				fprintf(fp, "SYSCALL\n");
 				break;
 			case 0x10:
-				printf("MFHI $r%u\n", rd);
+				fprintf(fp, "MFHI $r%u\n", rd);
 				break;
 			case 0x11:
-				printf("MTHI $r%u\n", rs);
+				fprintf(fp, "MTHI $r%u\n", rs);
 				break;
 			case 0x12:
-				printf("MFLO $r%u\n", rd);
+				fprintf(fp, "MFLO $r%u\n", rd);
 				break;
 			case 0x13:
-				printf("MTLO $r%u\n", rs);
+				fprintf(fp, "MTLO $r%u\n", rs);
 				break;
 			case 0x18:
-				printf("MULT $r%u, $r%u\n", rs, rt);
+				fprintf(fp, "MULT $r%u, $r%u\n", rs, rt);
 				break;
 			case 0x19:
-				printf("MULTU $r%u, $r%u\n", rs, rt);
+				fprintf(fp, "MULTU $r%u, $r%u\n", rs, rt);
 				break;
 			case 0x1A:
-				printf("DIV $r%u, $r%u\n", rs, rt);
+				fprintf(fp, "DIV $r%u, $r%u\n", rs, rt);
 				break;
 			case 0x1B:
-				printf("DIVU $r%u, $r%u\n", rs, rt);
+				fprintf(fp, "DIVU $r%u, $r%u\n", rs, rt);
 				break;
 			case 0x20:
-				printf("ADD $r%u, $r%u, $r%u\n", rd, rs, rt);
+				fprintf(fp, "ADD $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
 			case 0x21:
-				printf("ADDU $r%u, $r%u, $r%u\n", rd, rs, rt);
+				fprintf(fp, "ADDU $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
 			case 0x22:
-				printf("SUB $r%u, $r%u, $r%u\n", rd, rs, rt);
+				fprintf(fp, "SUB $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
 			case 0x23:
-				printf("SUBU $r%u, $r%u, $r%u\n", rd, rs, rt);
+				fprintf(fp, "SUBU $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
 			case 0x24:
-				printf("AND $r%u, $r%u, $r%u\n", rd, rs, rt);
+				fprintf(fp, "AND $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
 			case 0x25:
-				printf("OR $r%u, $r%u, $r%u\n", rd, rs, rt);
+				fprintf(fp, "OR $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
 			case 0x26:
-				printf("XOR $r%u, $r%u, $r%u\n", rd, rs, rt);
+				fprintf(fp, "XOR $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
 			case 0x27:
-				printf("NOR $r%u, $r%u, $r%u\n", rd, rs, rt);
+				fprintf(fp, "NOR $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
 			case 0x2A:
-				printf("SLT $r%u, $r%u, $r%u\n", rd, rs, rt);
+				fprintf(fp, "SLT $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
 			default:
-				printf("Instruction is not implemented!\n");
+				fprintf(fp, "Instruction is not implemented!\n");
 				break;
 		}
 	}
@@ -729,95 +3006,72 @@ void print_instruction(uint32_t addr){
 		switch(opcode){
 			case 0x01:
 				if(rt == 0){
-					printf("BLTZ $r%u, 0x%x\n", rs, immediate<<2);
+					fprintf(fp, "BLTZ $r%u, 0x%x\n", rs, immediate<<2);
 				}
 				else if(rt == 1){
-					printf("BGEZ $r%u, 0x%x\n", rs, immediate<<2);
+					fprintf(fp, "BGEZ $r%u, 0x%x\n", rs, immediate<<2);
 				}
 				break;
 			case 0x02:
-				printf("J 0x%x\n", (addr & 0xF0000000) | (target<<2));
+				fprintf(fp, "J 0x%x\n", (addr & 0xF0000000) | (target<<2));
 				break;
 			case 0x03:
-				printf("JAL 0x%x\n", (addr & 0xF0000000) | (target<<2));
+				fprintf(fp, "JAL 0x%x\n", (addr & 0xF0000000) | (target<<2));
 				break;
 			case 0x04:
-				printf("BEQ $r%u, $r%u, 0x%x\n", rs, rt, immediate<<2);
+				fprintf(fp, "BEQ $r%u, $r%u, 0x%x\n", rs, rt, immediate<<2);
 				break;
 			case 0x05:
-				printf("BNE $r%u, $r%u, 0x%x\n", rs, rt, immediate<<2);
+				fprintf(fp, "BNE $r%u, $r%u, 0x%x\n", rs, rt, immediate<<2);
 				break;
 			case 0x06:
-				printf("BLEZ $r%u, 0x%x\n", rs, immediate<<2);
+				fprintf(fp, "BLEZ $r%u, 0x%x\n", rs, immediate<<2);
 				break;
 			case 0x07:
-				printf("BGTZ $r%u, 0x%x\n", rs, immediate<<2);
+				fprintf(fp, "BGTZ $r%u, 0x%x\n", rs, immediate<<2);
 				break;
 			case 0x08:
-				printf("ADDI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+				fprintf(fp, "ADDI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
 			case 0x09:
-				printf("ADDIU $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+				fprintf(fp, "ADDIU $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
 			case 0x0A:
-				printf("SLTI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+				fprintf(fp, "SLTI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
 			case 0x0C:
-				printf("ANDI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+				fprintf(fp, "ANDI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
 			case 0x0D:
-				printf("ORI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+				fprintf(fp, "ORI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
 			case 0x0E:
-				printf("XORI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+				fprintf(fp, "XORI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
 			case 0x0F:
-				printf("LUI $r%u, 0x%x\n", rt, immediate);
+				fprintf(fp, "LUI $r%u, 0x%x\n", rt, immediate);
 				break;
 			case 0x20:
-				printf("LB $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+				fprintf(fp, "LB $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
 			case 0x21:
-				printf("LH $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+				fprintf(fp, "LH $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
 			case 0x23:
-				printf("LW $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+				fprintf(fp, "LW $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
 			case 0x28:
-				printf("SB $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+				fprintf(fp, "SB $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
 			case 0x29:
-				printf("SH $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+				fprintf(fp, "SH $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
 			case 0x2B:
-				printf("SW $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+				fprintf(fp, "SW $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
 			default:
-				printf("Instruction is not implemented!\n");
+				fprintf(fp, "Instruction is not implemented!\n");
 				break;
 		}
 	}
 }
-
-/***************************************************************/
-/* main                                                                                                                                   */
-/***************************************************************/
-int main(int argc, char *argv[]) {                              
-	printf("\n**************************\n");
-	printf("Welcome to MU-MIPS SIM...\n");
-	printf("**************************\n\n");
-	
-	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
-		exit(1);
-	}
-
-	strcpy(prog_file, argv[1]);
-	initialize();
-	load_program();
-	help();
-	while (1){
-		handle_command();
-	}
-	return 0;
-}
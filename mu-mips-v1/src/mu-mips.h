@@ -1,3 +1,7 @@
+#ifndef MU_MIPS_H
+#define MU_MIPS_H
+
+#include <stdio.h>
 #include <stdint.h>
 
 #define FALSE 0
@@ -24,18 +28,52 @@
 
 typedef struct {
 	uint32_t begin, end;
-	uint8_t *mem;
 } mem_region_t;
 
-/* memory will be dynamically allocated at initialization */
-mem_region_t MEM_REGIONS[] = {
-	{ MEM_TEXT_BEGIN, MEM_TEXT_END, NULL },
-	{ MEM_DATA_BEGIN, MEM_DATA_END, NULL },
-	{ MEM_KDATA_BEGIN, MEM_KDATA_END, NULL },
-	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END, NULL }
-};
-
 #define NUM_MEM_REGION 4
+
+/* valid guest address ranges (shared, read-only); backing storage is per machine */
+extern const mem_region_t MEM_REGIONS[NUM_MEM_REGION];
+
+/******************************************************************************/
+/* Paged guest memory                                                                                                                                    */
+/******************************************************************************/
+/* 4 KB pages, two-level table (10 + 10 bits of page number). Pages are allocated */
+/* on first write; reads of unmapped pages are served from a shared zero page.      */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE  (1u << PAGE_SHIFT)
+#define PAGE_MASK  (PAGE_SIZE - 1)
+#define PT_L2_BITS 10
+#define PT_L1_SIZE (1u << (32 - PAGE_SHIFT - PT_L2_BITS))
+#define PT_L2_SIZE (1u << PT_L2_BITS)
+
+typedef struct {
+	uint8_t **dir[PT_L1_SIZE];    /* second-level tables, allocated on demand */
+	uint32_t resident_pages;      /* guest pages backed by host memory */
+	uint32_t tables;              /* second-level tables allocated */
+} page_table_t;
+
+/* Direct-mapped software TLB caching guest page -> host page. Read entries */
+/* may point at the shared zero page; write entries only at allocated pages. */
+#define TLB_BITS 8
+#define TLB_SIZE (1u << TLB_BITS)
+#define TLB_INVALID 0x1           /* never equal to a page-aligned tag */
+
+typedef struct {
+	uint32_t tag;                 /* guest address of the page */
+	uint8_t *host;
+} tlb_entry_t;
+
+typedef struct {
+	tlb_entry_t read[TLB_SIZE];
+	tlb_entry_t write[TLB_SIZE];
+	uint64_t hits, misses;
+} soft_tlb_t;
+
+/* text segment geometry, used by the decoded-instruction cache */
+#define TEXT_SIZE (MEM_TEXT_END - MEM_TEXT_BEGIN + 1)
+#define TEXT_PAGES (TEXT_SIZE >> PAGE_SHIFT)
+
 #define MIPS_REGS 32
 
 typedef struct CPU_State_Struct {
@@ -47,35 +85,400 @@ typedef struct CPU_State_Struct {
 
 
 
+/******************************************************************************/
+/* Predecoded instructions                                                                                                                          */
+/******************************************************************************/
+#define MIPS_OPS(X) \
+	X(UNDECODED) \
+	X(SLL) X(SRL) X(SRA) X(JR) X(JALR) X(SYSCALL) \
+	X(MFHI) X(MTHI) X(MFLO) X(MTLO) X(MULT) X(MULTU) X(DIV) X(DIVU) \
+	X(ADD) X(ADDU) X(SUB) X(SUBU) X(AND) X(OR) X(XOR) X(NOR) X(SLT) \
+	X(BLTZ) X(BGEZ) X(J) X(JAL) X(BEQ) X(BNE) X(BLEZ) X(BGTZ) \
+	X(ADDI) X(ADDIU) X(SLTI) X(ANDI) X(ORI) X(XORI) X(LUI) \
+	X(LB) X(LH) X(LW) X(SB) X(SH) X(SW) \
+	X(NOP) X(UNIMPLEMENTED)
+
+#define MIPS_OP_ENUM(name) OP_##name,
+typedef enum { MIPS_OPS(MIPS_OP_ENUM) NUM_OPS } mips_op_t;
+
+typedef struct {
+	uint8_t op;                   /* mips_op_t handler id */
+	uint8_t rs, rt, rd, sa;
+	uint32_t imm;                 /* sign-/zero-extended (LUI: already shifted) */
+	uint32_t target;              /* branch or jump destination */
+	uint32_t word;                /* raw instruction */
+} decoded_inst_t;
+
+/******************************************************************************/
+/* Translated basic blocks                                                                                                                         */
+/******************************************************************************/
+struct mips_machine;
+typedef void (*block_fn_t)(struct mips_machine *m, const decoded_inst_t *d);
+
+typedef struct {
+	block_fn_t fn;                /* handler for d.op */
+	decoded_inst_t d;
+} block_insn_t;
+
+/* host code for a block (see mu-mips-jit.c); returns instructions executed */
+typedef uint32_t (*native_block_t)(struct mips_machine *m);
+
+/* a straight-line run ending at a branch, jump or SYSCALL (or at */
+/* BLOCK_MAX_INSNS / the end of its page), cached by guest PC       */
+typedef struct translated_block {
+	uint32_t pc;
+	uint32_t count;
+	int has_store;
+	struct translated_block *hash_next;
+	struct translated_block *succ[2];   /* chained successors */
+	uint32_t succ_pc[2];
+	native_block_t native;        /* JIT code, compiled on first use */
+	block_insn_t insns[];
+} translated_block_t;
+
+#define BLOCK_MAX_INSNS 64
+#define BLOCK_HASH_SIZE 4096
+
+typedef struct {
+	translated_block_t *hash[BLOCK_HASH_SIZE];
+	uint32_t blocks;
+	uint32_t generation;          /* code_generation the cache is valid for */
+} block_cache_t;
+
+/* out-of-line handler for every op, indexed by mips_op_t */
+extern const block_fn_t OP_FUNCS[NUM_OPS];
+
+/* per-instruction trace printed while simulating */
+enum { TRACE_OFF, TRACE_PC, TRACE_FULL, TRACE_BINARY };
+/* not a level: the untraced interpreter loop while profiling */
+#define TRACE_PROFILE (-1)
+
+/* execution core used by run/sim; all but switch only run untraced */
+enum { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+
+/* where the machine state came from: a .in text image, an ELF executable or a checkpoint */
+enum { IMAGE_HEX, IMAGE_ELF, IMAGE_CHECKPOINT };
+
+#define PROG_FILE_MAX 4096
+
 /***************************************************************/
-/* CPU State info.                                                                                                               */
+/* Golden snapshot.                                                                                                */
+/*                                                                                                                     */
+/* Taken by reset() right after it loads a program: a copy of every  */
+/* resident page plus the initial registers. From then on the first  */
+/* write to a page after each reset goes through the write TLB miss */
+/* path, which marks the page dirty, so the next reset of the same  */
+/* program copies back (or drops) only the pages written since.       */
 /***************************************************************/
+typedef struct {
+	int valid;
+	char prog_file[PROG_FILE_MAX];
+	uint64_t file_dev, file_ino, file_size, file_mtime;   /* reload if the file changes */
+	CPU_State cpu;
+	uint32_t program_size;
+	page_table_t pages;           /* golden copies of the pages resident at snapshot */
+	uint64_t *dirty_map;          /* one bit per guest page written since the last reset */
+	uint32_t *dirty;              /* those page numbers, in first-write order */
+	uint32_t dirty_count, dirty_capacity;
+} snapshot_t;
 
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_FLAG;	/* run flag*/
-uint32_t INSTRUCTION_COUNT;
-uint32_t PROGRAM_SIZE; /*in words*/
+/***************************************************************/
+/* Reverse-execution history.                                                                      */
+/*                                                                                                                     */
+/* A point is taken every HISTORY_INTERVAL instructions and whenever */
+/* the registers are set from outside (input/high/low): the registers */
+/* as they are then, plus an undo log of the pages written after it. */
+/* The write TLB is flushed at each point, so the first write to a   */
+/* page in an interval comes through the slow path, which copies the */
+/* page before it changes. Going back to instruction n rolls memory  */
+/* back to the latest point at or before n and re-executes the rest, */
+/* at most one interval. reset and restore start a new history; the */
+/* oldest points are dropped once the undo log passes                       */
+/* HISTORY_MAX_BYTES.                                                                                   */
+/***************************************************************/
+#define HISTORY_INTERVAL (1u << 20)
+#define HISTORY_MAX_BYTES (256ull << 20)
 
-char prog_file[32];
+typedef struct {
+	uint32_t instruction_count;
+	int run_flag;
+	CPU_State cpu;
+	uint32_t first_undo;          /* undo records of the interval this point starts */
+} history_point_t;
+
+typedef struct {
+	uint32_t page;                /* guest page number */
+	uint8_t *data;                /* contents at the point, NULL if it was not resident */
+} history_undo_t;
+
+typedef struct {
+	int enabled;
+	history_point_t *points;
+	uint32_t num_points, points_capacity;
+	history_undo_t *undo;
+	uint32_t num_undo, undo_capacity;
+	uint64_t undo_bytes;
+	uint64_t *saved_map;          /* one bit per page with a record in the current interval */
+} history_t;
+
+/***************************************************************/
+/* Guest profile.                                                                                                  */
+/*                                                                                                                     */
+/* While profiling, every executed instruction bumps a counter for    */
+/* its PC: (PC - MEM_TEXT_BEGIN) >> 2 indexes a dense array, split   */
+/* into one lazily allocated page of counters per text page like the */
+/* decode cache. JAL/JALR push a shadow call frame and count a call  */
+/* arc (call site, callee); the JR $31 that returns to a frame's       */
+/* return address pops it and adds the instructions run since the     */
+/* call to the arc's inclusive cost. Profiling runs on the switch       */
+/* interpreter (see mu-mips-profile.c for the reports).                       */
+/***************************************************************/
+#define PROFILE_PAGE_SLOTS (PAGE_SIZE / 4)
+#define PROFILE_MAX_DEPTH 65536       /* deeper shadow stacks drop their oldest frames */
+
+typedef struct {
+	uint32_t site, callee;        /* JAL/JALR address and target */
+	uint64_t calls, inclusive;    /* calls == 0: free slot */
+} profile_arc_t;
+
+typedef struct {
+	uint32_t ret, site, callee;
+	uint64_t start;               /* profile total at the call */
+} profile_frame_t;
+
+typedef struct {
+	int on;
+	uint32_t root;                /* PC profiling started at */
+	uint64_t total;               /* instructions counted */
+	uint64_t outside;             /* of those, outside the text segment */
+	uint64_t *counts[TEXT_PAGES]; /* PROFILE_PAGE_SLOTS counters per text page */
+	profile_arc_t *arcs;          /* open addressing on (site, callee) */
+	uint32_t num_arcs, arc_capacity;
+	profile_frame_t *stack;
+	uint32_t depth, stack_capacity;
+} profile_t;
+
+/***************************************************************/
+/* Execution statistics.                                                                                        */
+/*                                                                                                                     */
+/* run/sim calls, their host time and instructions are always kept,  */
+/* as are the soft TLB's hit and miss totals that memstats shows.    */
+/* The hot-path counters (ops, branches, loads/stores per region,     */
+/* mem_read_32 TLB misses) are only counted in builds with             */
+/* -DMU_MIPS_STATS (make STATS=1); otherwise STATS_ENABLED is 0 and  */
+/* the interpreter compiles exactly as without them. They are kept by */
+/* the switch interpreter, which every traced or profiled run uses;   */
+/* the threaded/block/JIT engines only add to the run totals.          */
+/***************************************************************/
+#ifdef MU_MIPS_STATS
+#define STATS_ENABLED 1
+#else
+#define STATS_ENABLED 0
+#endif
+
+typedef struct {
+	uint64_t runs, run_ns, run_instructions;
+	uint64_t last_run_ns, last_run_instructions;
+	uint64_t ops[NUM_OPS];
+	uint64_t taken[NUM_OPS];      /* branches and jumps that left PC + 4 */
+	uint64_t loads[NUM_MEM_REGION + 1], stores[NUM_MEM_REGION + 1];   /* last: no region */
+	uint64_t read_walks;          /* mem_read_32 TLB misses, which walk the regions */
+} stats_t;
+
+/***************************************************************/
+/* Machine context.                                                                                                          */
+/*                                                                                                                     */
+/* Everything one simulation owns. Every simulator entry point       */
+/* takes the machine it acts on, so a process can host any number  */
+/* of machines and drive each from its own thread; nothing below is */
+/* shared between machines except read-only tables.                     */
+/***************************************************************/
+struct jit_cache;
+struct replay_log;
+struct btrace;
+
+/* symbol of a loaded ELF executable */
+typedef struct {
+	uint32_t addr, size;          /* size 0: a label */
+	unsigned char type;           /* STT_FUNC, STT_OBJECT or STT_NOTYPE */
+	const char *name;
+} symbol_t;
+
+typedef struct mips_machine {
+	CPU_State cpu;                /* single architectural register file, updated in place */
+	int run_flag;                 /* run flag */
+	uint32_t instruction_count;
+	uint32_t program_size;        /* in words */
+	int image;                    /* IMAGE_* */
+	int big_endian;               /* big-endian ELF image: words stored swapped */
+	char prog_file[PROG_FILE_MAX];
+
+	int trace_level;              /* TRACE_*; TRACE_OFF for a new machine */
+	struct btrace *btrace;        /* ring and writer of the binary trace, or NULL */
+	int engine;                   /* ENGINE_* */
+	int quiet;                    /* no loader summary (batch jobs) */
+	int verbose;                  /* per-word loader output (--verbose) */
+
+	page_table_t page_table;
+	soft_tlb_t tlb;
+	/* file mapped by checkpoint_restore or the ELF loader: pages inside */
+	/* it are private copy-on-write views of the file, not heap pages    */
+	uint8_t *ckpt_map;
+	size_t ckpt_map_size;
+
+	/* one lazily allocated array of PAGE_SIZE/4 records per text page */
+	decoded_inst_t *decode_cache[TEXT_PAGES];
+	/* bumped whenever a store overwrites cached (decoded) code */
+	uint32_t code_generation;
+	block_cache_t block_cache;
+	struct jit_cache *jit;        /* host code for block_cache, mapped on first use */
+
+	snapshot_t snapshot;
+	history_t history;
+	struct replay_log *record;    /* session being recorded (see mu-mips-replay.c), or NULL */
+	profile_t *profile;           /* counts and call arcs, or NULL if never profiled */
+	stats_t stats;
+	symbol_t *symbols;            /* ELF symbols by address, or NULL */
+	uint32_t num_symbols;
+	char *symbol_names;           /* string pool of the symbol names */
+} mips_machine;
+
+/* Guest memory holds words little endian. A big-endian image's words  */
+/* are stored swapped, so its byte at address a sits where a little-   */
+/* endian byte a ^ 3 would, and its aligned halfword at a ^ 2.          */
+#define BYTE_ADDRESS(m, a) ((a) ^ ((m)->big_endian ? 3u : 0u))
+#define HALF_ADDRESS(m, a) ((a) ^ ((m)->big_endian ? 2u : 0u))
 
 
 /***************************************************************/
 /* Function Declerations.                                                                                                */
 /***************************************************************/
 void help();
-uint32_t mem_read_32(uint32_t address);
-void mem_write_32(uint32_t address, uint32_t value);
-void cycle();
-void run(int num_cycles);
-void runAll();
-void mdump(uint32_t start, uint32_t stop) ;
-void rdump();
-void handle_command();
-void reset();
-void init_memory();
-void load_program();
-void handle_instruction(); /*IMPLEMENT THIS*/
-void initialize();
-void print_program(); /*IMPLEMENT THIS*/
-void print_instruction(uint32_t);
+mips_machine *machine_create();
+void machine_destroy(mips_machine *m);
+uint32_t mem_read_32(mips_machine *m, uint32_t address);
+void mem_write_32(mips_machine *m, uint32_t address, uint32_t value);
+void mem_map_page(mips_machine *m, uint32_t address, uint8_t *host);
+void cycle(mips_machine *m);
+uint32_t run_cycles(mips_machine *m, uint32_t num_cycles);
+void run(mips_machine *m, int num_cycles);
+void runAll(mips_machine *m);
+void mdump(mips_machine *m, uint32_t start, uint32_t stop) ;
+void mdump_to(mips_machine *m, FILE *out, uint32_t start, uint32_t stop);
+void rdump(mips_machine *m);
+void rdump_to(mips_machine *m, FILE *out);
+void handle_command(mips_machine *m);
+int reset(mips_machine *m);
+void init_memory(mips_machine *m);
+void free_memory(mips_machine *m);
+void mem_stats(mips_machine *m);
+void snapshot_take(mips_machine *m);
+int snapshot_restore(mips_machine *m);
+void snapshot_release(mips_machine *m);
+int checkpoint_save(mips_machine *m, const char *path);
+int checkpoint_restore(mips_machine *m, const char *path);
+uint64_t state_hash(mips_machine *m);
+void history_enable(mips_machine *m);
+void history_point(mips_machine *m);
+void history_release(mips_machine *m);
+int history_goto(mips_machine *m, uint32_t target);
+void rstep(mips_machine *m, uint32_t n);
+void rcontinue(mips_machine *m, int has_pc, uint32_t pc);
+int load_program(mips_machine *m);
+void decode_instruction(uint32_t instruction, uint32_t pc, decoded_inst_t *d);
+void decode_cache_flush(mips_machine *m);
+void block_cache_flush(mips_machine *m);
+void handle_instruction(mips_machine *m); /*IMPLEMENT THIS*/
+void initialize(mips_machine *m);
+void print_program(mips_machine *m); /*IMPLEMENT THIS*/
+void print_instruction(mips_machine *m, uint32_t);
+void print_instruction_word(uint32_t addr, uint32_t instruction);
+void fprint_instruction_word(FILE *fp, uint32_t addr, uint32_t instruction);
+int set_prog_file(mips_machine *m, const char *path);
+int set_trace_level(mips_machine *m, const char *name);
+int set_binary_trace(mips_machine *m, const char *path, int packed);
+int set_engine(mips_machine *m, const char *name);
+
+/* mu-mips-jit.c */
+native_block_t jit_compile(mips_machine *m, translated_block_t *tb);
+void jit_reset(mips_machine *m);
+void jit_release(mips_machine *m);
+int jit_available();
+
+/* mu-mips-aot.c */
+int aot_translate(mips_machine *m, const char *path);
+
+/* mu-mips-batch.c */
+int batch_run(const char *manifest, const char *out_dir, int threads, int engine, int lockstep);
+
+/* mu-mips-lockstep.c */
+#define LOCKSTEP_MAX_LANES 64
+void lockstep_run(mips_machine **machines, const uint32_t *max, uint32_t n);
+
+/* mu-mips-replay.c */
+#define REPLAY_HASH_INTERVAL 1000000u   /* instructions between logged state hashes */
+enum { REPLAY_INPUT, REPLAY_HI, REPLAY_LO, REPLAY_RESET, REPLAY_RESTORE, REPLAY_HASH, REPLAY_END, REPLAY_REWIND };
+int record_start(mips_machine *m, const char *path, const char *checkpoint);
+void record_event(mips_machine *m, int type, uint32_t reg, uint32_t value, const char *path);
+uint32_t record_budget(mips_machine *m, uint32_t budget);
+void record_ran(mips_machine *m, uint32_t executed);
+void record_stop(mips_machine *m);
+int replay_run(mips_machine *m, const char *path);
+
+/* mu-mips-trace.c */
+#define TRACE_DEST_HI 32
+#define TRACE_DEST_LO 33
+#define TRACE_DEST_HILO 34            /* MULT/DIV: value is LO, data is HI */
+#define TRACE_DEST_NONE 0xff
+#define TRACE_SIZE 0x07               /* flags: access size in bytes */
+#define TRACE_LOAD 0x10
+#define TRACE_STORE 0x20
+
+/* one executed instruction of a binary trace */
+typedef struct {
+	uint32_t pc, word;
+	uint32_t value;               /* dest after the instruction */
+	uint32_t addr;                /* load/store effective address */
+	uint32_t data;                /* value loaded, or bytes stored */
+	uint8_t dest;                 /* register written: 0-31, TRACE_DEST_* */
+	uint8_t flags;                /* TRACE_LOAD/TRACE_STORE | size */
+	uint16_t reserved;
+} trace_record_t;
+
+typedef struct trace_reader trace_reader_t;
+
+int btrace_open(mips_machine *m, const char *path, int packed);
+void btrace_close(mips_machine *m);
+void btrace_emit(mips_machine *m, const decoded_inst_t *d, uint32_t pc, uint32_t ea);
+trace_reader_t *trace_reader_open(const char *path);
+uint64_t trace_reader_records(trace_reader_t *tr);
+int trace_reader_seek(trace_reader_t *tr, uint64_t n);
+int trace_reader_next(trace_reader_t *tr, trace_record_t *r);
+void trace_reader_close(trace_reader_t *tr);
+
+/* mu-mips-fork.c */
+int fork_run(mips_machine *m, uint32_t n, char *args);
+
+/* mu-mips-stats.c */
+void stats_print(mips_machine *m);
+int stats_save_json(mips_machine *m, const char *path);
+
+/* mu-mips-elf.c */
+int elf_probe(int fd);
+int elf_load(mips_machine *m, int fd);
+void elf_load_symbols(mips_machine *m, const char *path);
+const symbol_t *symbol_lookup(mips_machine *m, uint32_t addr);
+const char *symbol_format(mips_machine *m, uint32_t addr, char *buf, size_t size);
+void symbols_release(mips_machine *m);
+
+/* mu-mips-profile.c */
+void profile_start(mips_machine *m);
+void profile_stop(mips_machine *m);
+void profile_clear(mips_machine *m);
+void profile_release(mips_machine *m);
+void profile_miss(mips_machine *m, uint32_t pc);
+void profile_branch(mips_machine *m, const decoded_inst_t *d, uint32_t pc);
+void profile_report(mips_machine *m, uint32_t top);
+int profile_save(mips_machine *m, const char *path);
 
+#endif